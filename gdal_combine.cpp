@@ -8,115 +8,4888 @@
 
 #include "gdal.h"
 #include "cpl_string.h" 
-#include "cpl_hash_set.h"
 #include "cpl_conv.h"
+#include "cpl_multiproc.h"
+#include "cpl_virtualmem.h"
 #include "ogr_srs_api.h"
-#include <time.h>
+#include <math.h>
+#ifdef _WIN32
+#include <sys/timeb.h>
+#else
+#include <sys/time.h>
+#endif
+#include <algorithm>
+#include <queue>
+#include <vector>
 
 typedef struct {
+	const char *pszFilename;
+	int nBand;
 	GDALDatasetH hDS;
 	GDALRasterBandH hBand;
 	GDALDataType eDataType;
 	int bIsIntDataType;
-	int *panScanline;
-	double *padfScanline;
+	int bIsStat;		/* a -stat value raster, read as double, not keyed */
+	int nXOff;			/* position of the input in the combined grid */
+	int nYOff;
+	int nXSize;
+	int nYSize;
+	int bCoversGrid;	/* FALSE if part of the grid is outside of the input */
+	double dfFillValue;	/* value of the grid cells outside of the input */
+	double dfQuantStep;	/* floating point values are keyed exactly if 0, */
+						/* otherwise as the nearest multiple of the step */
+	int bSkipNodata;	/* pixels where this input is nodata or masked are */
+						/* left out (-skip_nodata) */
+	int nMaskFlags;
+	int bHasNoData;
+	double dfNoData;
+	int nKeyOffset;		/* first slot of this input in a combination key */
+	int nKeyWords;		/* number of 32-bit slots this input occupies */
+	int *panValues;		/* values of the current window */
+	double *padfValues;
+	GByte *pabyMask;	/* 0 where the current window is skipped, if bSkipNodata */
 } InputRaster;
 
+/* Inputs are processed in windows that are full-width strips of whole   */
+/* block rows, fewer rows if the buffer budget of one window             */
+/* (-buffer_mem) does not hold one block row. Pixels are counted in      */
+/* row-major order within a window and windows from the top, so IDs      */
+/* follow the row-major first occurrence of the combinations whatever    */
+/* -buffer_mem and the block sizes of the inputs. -threads and -queue    */
+/* only set how many windows are in flight.                              */
+#define MIN_WINDOW_ROWS 16
+
+/* Table entry index of the pixels left out by -skip_nodata. They get ID */
+/* 0 in the output raster, which is then its nodata value.               */
+#define SKIPPED_PIXEL 0xFFFFFFFFU
+
+/* How the pixels counted so far were resolved: reused from the left or  */
+/* upper neighbour, or looked up in the combination table.               */
+typedef struct {
+	GUIntBig nLeftHits;
+	GUIntBig nAboveHits;
+	GUIntBig nLookups;
+	GUIntBig nSkipped;	/* left out by -skip_nodata */
+} CountStats;
+
+/* Wall-clock seconds spent in each phase of a run, for -stats. With      */
+/* -threads or -queue the phases overlap, and the time of a phase done by */
+/* several threads is the sum of their times.                             */
+typedef struct {
+	double dfRead;
+	double dfCount;		/* building keys and looking them up, interleaved */
+						/* per pixel so not timed apart */
+	double dfMerge;		/* merging the window tables of -threads workers */
+	double dfSpill;		/* spilling the table and merging the runs */
+	double dfWrite;		/* writing the output raster */
+	double dfTable;		/* writing the CSV and binary tables */
+	size_t nWindowTableMem;	/* memory of the -threads window tables */
+} RunStats;
+
+typedef struct {
+	int nXSize;
+	int nYSize;
+	int nWinXSize;
+	int nWinYSize;
+	int nWindowsPerRow;
+	int nWindows;
+} WindowLayout;
+
+/* A combination key is a fixed-width array of 32-bit slots, one slot per   */
+/* integer input and two per floating point input: the bits of the value   */
+/* as a double (-0 as 0), or with -quant the value divided by the step and */
+/* rounded to a 64-bit integer. NaN is KEY_NAN_MARKER in both cases. Keys  */
+/* are only turned into text when the CSV is written.                      */
+#define KEY_NAN_MARKER ((GIntBig) (((GUIntBig) 1) << 63))
+
+static GUIntBig HashCombinationKey64(const GUInt32 *panKey, int nWords) {
+	GUIntBig nHash = 0x9E3779B97F4A7C15ULL ^ (GUIntBig) nWords;
+	int i;
+
+	for(i=0;i<nWords;i++) {
+		nHash ^= panKey[i];
+		nHash *= 0xFF51AFD7ED558CCDULL;
+		nHash ^= nHash >> 32;
+	}
+	//final avalanche so that the low bits depend on every slot
+	nHash ^= nHash >> 33;
+	nHash *= 0xC4CEB9FE1A85EC53ULL;
+	nHash ^= nHash >> 33;
+	return nHash;
+}
+
+static GUInt32 HashCombinationKey(const GUInt32 *panKey, int nWords) {
+	return (GUInt32) HashCombinationKey64(panKey, nWords);
+}
+
+/************************************************************************/
+/* ==================================================================== */
+/*                           CombinationTable                           */
+/*                                                                      */
+/*      Open-addressing hash table of the unique combinations. Keys     */
+/*      are stored back to back in an arena in order of first           */
+/*      occurrence, so an entry index is also the offset of its         */
+/*      combination ID. Counting a combination that is already in the   */
+/*      table does not allocate.                                        */
+/*                                                                      */
+/*      When every key slot has a small known value range the table     */
+/*      can instead be indexed directly by the mixed-radix number       */
+/*      formed by the slot values (InitDenseIndex()), which avoids      */
+/*      hashing altogether. If a value outside of that domain shows up  */
+/*      the table quietly switches to hashing.                          */
+/*                                                                      */
+/*      The key arena and the hash index of a saved table can be        */
+/*      attached as they are (AttachIndex()), e.g. from a mapped file.  */
+/*      Attached arrays are only read; they are copied to memory owned  */
+/*      by the table the first time they have to change.                */
+/*                                                                      */
+/*      Each entry can also aggregate nStats value rasters (-stat):     */
+/*      the number of valid values, their sum, minimum and maximum.     */
+/* ==================================================================== */
+/************************************************************************/
+
+/* per statistic of an entry: count of valid values, sum, minimum, maximum */
+#define STAT_FIELDS 4
+
+class CombinationTable {
+public:
+    CombinationTable( int nKeyWords, int nStats = 0 );
+    ~CombinationTable();
+
+    int              nKeyWords;
+    int              nStats;
+    size_t           nEntries;
+
+    GUInt32         *panKeys;       /* key arena, nKeyWords per entry */
+    GUIntBig        *panCounts;     /* pixel count per entry */
+    double          *padfStats;     /* STAT_FIELDS per stat per entry */
+
+    int              InitDenseIndex( const GInt32 *panMin, const GInt32 *panMax );
+    int              AttachIndex( GUInt32 *panKeys, size_t nEntries,
+                                  GUInt32 *panSlotEntry, GUInt32 *panSlotHash,
+                                  size_t nSlots );
+    int              GetHashIndex( const GUInt32 **ppanSlotEntry,
+                                   const GUInt32 **ppanSlotHash,
+                                   size_t *pnSlots );
+    int              IsDense() const { return panDenseEntry != NULL; }
+    int              Add( const GUInt32 *panKey, GUIntBig nCount,
+                          size_t *piEntry );
+    int              Reserve( size_t nExpected );
+    void             Reset( int bFreeMemory = FALSE );
+    const GUInt32   *GetKey( size_t iEntry ) const
+                        { return panKeys + iEntry * nKeyWords; }
+    const double    *GetStats( size_t iEntry ) const
+                        { return padfStats + iEntry * nStats * STAT_FIELDS; }
+    inline void      AddStatValue( size_t iEntry, int iStat, double dfValue );
+    void             MergeStats( size_t iEntry, const double *padfOther );
+    size_t           GetMemoryUsage() const;
+    size_t           GetSlotCount() const
+                        { return nSlotMask == 0 ? 0 : nSlotMask + 1; }
+    int              GetProbeLengths( double *pdfMean, size_t *pnMax ) const;
+
+private:
+    size_t           nEntryAlloc;
+    size_t           nSlotMask;
+    GUInt32         *panSlotEntry;  /* entry index + 1, or 0 if empty */
+    GUInt32         *panSlotHash;
+    int              bExternalKeys;  /* panKeys not owned by the table */
+    int              bExternalSlots; /* slot arrays not owned either */
+
+    GUInt32         *panDenseEntry; /* entry index + 1, or 0 if unseen */
+    GIntBig         *panDenseMin;   /* lowest value of each key slot */
+    GUIntBig        *panDenseRadix; /* number of values of each key slot */
+    GUIntBig         nDenseSize;
+
+    int              GrowEntries( size_t nMinAlloc = 0 );
+    int              GrowSlots( size_t nMinSlots = 0 );
+    int              CopyExternalSlots();
+    int              GetDenseIndex( const GUInt32 *panKey, GUIntBig *pnIndex ) const;
+    int              AppendEntry( const GUInt32 *panKey, GUIntBig nCount );
+    void             InitStats( size_t iFirst, size_t iLast );
+    int              BuildHashIndex();
+};
+
+/************************************************************************/
+/*                          CombinationTable()                          */
+/************************************************************************/
+
+CombinationTable::CombinationTable( int nKeyWords, int nStats )
+
+{
+    this->nKeyWords = nKeyWords;
+    this->nStats = nStats;
+    nEntries = 0;
+    nEntryAlloc = 0;
+    panKeys = NULL;
+    panCounts = NULL;
+    padfStats = NULL;
+    nSlotMask = 0;
+    panSlotEntry = NULL;
+    panSlotHash = NULL;
+    bExternalKeys = FALSE;
+    bExternalSlots = FALSE;
+    panDenseEntry = NULL;
+    panDenseMin = NULL;
+    panDenseRadix = NULL;
+    nDenseSize = 0;
+}
+
+/************************************************************************/
+/*                         ~CombinationTable()                          */
+/************************************************************************/
+
+CombinationTable::~CombinationTable()
+
+{
+    if( !bExternalKeys )
+        CPLFree( panKeys );
+    CPLFree( panCounts );
+    CPLFree( padfStats );
+    if( !bExternalSlots )
+    {
+        CPLFree( panSlotEntry );
+        CPLFree( panSlotHash );
+    }
+    CPLFree( panDenseEntry );
+    CPLFree( panDenseMin );
+    CPLFree( panDenseRadix );
+}
+
+/************************************************************************/
+/*                            GrowEntries()                             */
+/************************************************************************/
+
+int CombinationTable::GrowEntries( size_t nMinAlloc )
+
+{
+    size_t nNewAlloc = MAX( nEntryAlloc * 2 + 1024, nMinAlloc );
+    GUInt32 *panNewKeys;
+    GUIntBig *panNewCounts;
+
+    if( bExternalKeys )
+    {
+        panNewKeys = (GUInt32 *)
+            VSIMalloc( nNewAlloc * nKeyWords * sizeof(GUInt32) );
+        if( panNewKeys == NULL )
+            return FALSE;
+        memcpy( panNewKeys, panKeys, nEntries * nKeyWords * sizeof(GUInt32) );
+        bExternalKeys = FALSE;
+    }
+    else
+    {
+        panNewKeys = (GUInt32 *)
+            VSIRealloc( panKeys, nNewAlloc * nKeyWords * sizeof(GUInt32) );
+        if( panNewKeys == NULL )
+            return FALSE;
+    }
+    panKeys = panNewKeys;
+
+    panNewCounts = (GUIntBig *)
+        VSIRealloc( panCounts, nNewAlloc * sizeof(GUIntBig) );
+    if( panNewCounts == NULL )
+        return FALSE;
+    panCounts = panNewCounts;
+
+    if( nStats > 0 )
+    {
+        double *padfNewStats = (double *)
+            VSIRealloc( padfStats, nNewAlloc * nStats * STAT_FIELDS * sizeof(double) );
+        if( padfNewStats == NULL )
+            return FALSE;
+        padfStats = padfNewStats;
+    }
+
+    nEntryAlloc = nNewAlloc;
+    return TRUE;
+}
+
+/************************************************************************/
+/*                             GrowSlots()                              */
+/*                                                                      */
+/*      Double the slot array, or more to reach nMinSlots, and          */
+/*      reinsert every entry using its cached hash, so keys never have  */
+/*      to be rehashed.                                                 */
+/************************************************************************/
+
+int CombinationTable::GrowSlots( size_t nMinSlots )
+
+{
+    size_t nNewSlots = (nSlotMask == 0) ? 4096 : (nSlotMask + 1) * 2;
+    while( nNewSlots < nMinSlots )
+        nNewSlots *= 2;
+    GUInt32 *panNewEntry = (GUInt32 *) VSICalloc( nNewSlots, sizeof(GUInt32) );
+    GUInt32 *panNewHash = (GUInt32 *) VSIMalloc2( nNewSlots, sizeof(GUInt32) );
+    size_t iSlot;
+
+    if( panNewEntry == NULL || panNewHash == NULL )
+    {
+        CPLFree( panNewEntry );
+        CPLFree( panNewHash );
+        return FALSE;
+    }
+
+    for( iSlot = 0; nSlotMask != 0 && iSlot <= nSlotMask; iSlot++ )
+    {
+        if( panSlotEntry[iSlot] == 0 )
+            continue;
+
+        size_t iNewSlot = panSlotHash[iSlot] & (nNewSlots - 1);
+        while( panNewEntry[iNewSlot] != 0 )
+            iNewSlot = (iNewSlot + 1) & (nNewSlots - 1);
+
+        panNewEntry[iNewSlot] = panSlotEntry[iSlot];
+        panNewHash[iNewSlot] = panSlotHash[iSlot];
+    }
+
+    if( !bExternalSlots )
+    {
+        CPLFree( panSlotEntry );
+        CPLFree( panSlotHash );
+    }
+    panSlotEntry = panNewEntry;
+    panSlotHash = panNewHash;
+    nSlotMask = nNewSlots - 1;
+    bExternalSlots = FALSE;
+
+    return TRUE;
+}
+
+/************************************************************************/
+/*                         CopyExternalSlots()                          */
+/*                                                                      */
+/*      Take a private copy of attached slot arrays before changing     */
+/*      them.                                                           */
+/************************************************************************/
+
+int CombinationTable::CopyExternalSlots()
+
+{
+    size_t nSlots = nSlotMask + 1;
+    GUInt32 *panNewEntry = (GUInt32 *) VSIMalloc2( nSlots, sizeof(GUInt32) );
+    GUInt32 *panNewHash = (GUInt32 *) VSIMalloc2( nSlots, sizeof(GUInt32) );
+
+    if( panNewEntry == NULL || panNewHash == NULL )
+    {
+        CPLFree( panNewEntry );
+        CPLFree( panNewHash );
+        return FALSE;
+    }
+
+    memcpy( panNewEntry, panSlotEntry, nSlots * sizeof(GUInt32) );
+    memcpy( panNewHash, panSlotHash, nSlots * sizeof(GUInt32) );
+    panSlotEntry = panNewEntry;
+    panSlotHash = panNewHash;
+    bExternalSlots = FALSE;
+
+    return TRUE;
+}
+
+/************************************************************************/
+/*                            AttachIndex()                             */
+/*                                                                      */
+/*      Use the nEntries keys of panKeys and the hash index of nSlots   */
+/*      slots (a power of two, or 0) saved from another table, without  */
+/*      copying or rehashing them. The arrays must stay valid for the   */
+/*      life of the table or until Reset(). Counts start at 0.          */
+/*      Returns FALSE if the counts can't be allocated.                 */
+/************************************************************************/
+
+int CombinationTable::AttachIndex( GUInt32 *panKeysIn, size_t nEntriesIn,
+                                   GUInt32 *panSlotEntryIn,
+                                   GUInt32 *panSlotHashIn, size_t nSlots )
+
+{
+    CPLAssert( nEntries == 0 && nEntryAlloc == 0 && nSlotMask == 0 );
+    CPLAssert( panDenseEntry == NULL );
+
+    panCounts = (GUIntBig *) VSICalloc( MAX(nEntriesIn, 1), sizeof(GUIntBig) );
+    if( panCounts == NULL )
+        return FALSE;
+    if( nStats > 0 )
+    {
+        padfStats = (double *) VSIMalloc2( MAX(nEntriesIn, 1),
+                                           nStats * STAT_FIELDS * sizeof(double) );
+        if( padfStats == NULL )
+            return FALSE;
+    }
+
+    panKeys = panKeysIn;
+    bExternalKeys = TRUE;
+    nEntries = nEntriesIn;
+    nEntryAlloc = nEntriesIn;
+    InitStats( 0, nEntries );
+
+    if( nSlots > 0 )
+    {
+        panSlotEntry = panSlotEntryIn;
+        panSlotHash = panSlotHashIn;
+        nSlotMask = nSlots - 1;
+        bExternalSlots = TRUE;
+    }
+
+    return TRUE;
+}
+
+/************************************************************************/
+/*                            GetHashIndex()                            */
+/*                                                                      */
+/*      Return the slot arrays of the hash index, so that they can be   */
+/*      saved along with the keys. A dense table is switched to         */
+/*      hashing first. Returns FALSE if that fails.                     */
+/************************************************************************/
+
+int CombinationTable::GetHashIndex( const GUInt32 **ppanSlotEntry,
+                                    const GUInt32 **ppanSlotHash,
+                                    size_t *pnSlots )
+
+{
+    if( panDenseEntry != NULL && !BuildHashIndex() )
+        return FALSE;
+
+    *ppanSlotEntry = panSlotEntry;
+    *ppanSlotHash = panSlotHash;
+    *pnSlots = (nSlotMask == 0) ? 0 : nSlotMask + 1;
+
+    return TRUE;
+}
+
+/************************************************************************/
+/*                           InitDenseIndex()                           */
+/*                                                                      */
+/*      Switch an empty table to direct indexing over the value         */
+/*      ranges [panMin[i], panMax[i]] of the (signed integer) key       */
+/*      slots. Returns FALSE if the dense array can't be allocated.     */
+/************************************************************************/
+
+int CombinationTable::InitDenseIndex( const GInt32 *panMin, const GInt32 *panMax )
+
+{
+    int i;
+
+    CPLAssert( nEntries == 0 );
+
+    panDenseMin = (GIntBig *) CPLMalloc( nKeyWords * sizeof(GIntBig) );
+    panDenseRadix = (GUIntBig *) CPLMalloc( nKeyWords * sizeof(GUIntBig) );
+    nDenseSize = 1;
+    for( i = 0; i < nKeyWords; i++ )
+    {
+        panDenseMin[i] = panMin[i];
+        panDenseRadix[i] = (GUIntBig) ((GIntBig) panMax[i] - panMin[i] + 1);
+        nDenseSize *= panDenseRadix[i];
+    }
+
+    if( nDenseSize == (size_t) nDenseSize )
+        panDenseEntry = (GUInt32 *) VSICalloc( (size_t) nDenseSize, sizeof(GUInt32) );
+
+    if( panDenseEntry == NULL )
+    {
+        CPLFree( panDenseMin );
+        CPLFree( panDenseRadix );
+        panDenseMin = NULL;
+        panDenseRadix = NULL;
+        nDenseSize = 0;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/************************************************************************/
+/*                           BuildHashIndex()                           */
+/*                                                                      */
+/*      Leave dense mode: hash every entry found so far into a new      */
+/*      slot array and release the dense array.                         */
+/************************************************************************/
+
+int CombinationTable::BuildHashIndex()
+
+{
+    size_t iEntry;
+
+    while( (nEntries + 1) * 3 > (nSlotMask + 1) * 2 )
+    {
+        if( !GrowSlots() )
+            return FALSE;
+    }
+
+    for( iEntry = 0; iEntry < nEntries; iEntry++ )
+    {
+        GUInt32 nHash = HashCombinationKey( GetKey(iEntry), nKeyWords );
+        size_t iSlot;
+
+        for( iSlot = nHash & nSlotMask;
+             panSlotEntry[iSlot] != 0;
+             iSlot = (iSlot + 1) & nSlotMask ) {}
+
+        panSlotEntry[iSlot] = (GUInt32) (iEntry + 1);
+        panSlotHash[iSlot] = nHash;
+    }
+
+    CPLFree( panDenseEntry );
+    CPLFree( panDenseMin );
+    CPLFree( panDenseRadix );
+    panDenseEntry = NULL;
+    panDenseMin = NULL;
+    panDenseRadix = NULL;
+    nDenseSize = 0;
+
+    return TRUE;
+}
+
+/************************************************************************/
+/*                           GetDenseIndex()                            */
+/*                                                                      */
+/*      Compute the mixed-radix index of a key in the dense array.      */
+/*      Returns FALSE if the key is outside of the dense domain.        */
+/************************************************************************/
+
+inline int CombinationTable::GetDenseIndex( const GUInt32 *panKey,
+                                            GUIntBig *pnIndex ) const
+
+{
+    GUIntBig nIndex = 0;
+    int i;
+
+    for( i = nKeyWords - 1; i >= 0; i-- )
+    {
+        GUIntBig nDigit = (GUIntBig) ((GInt32) panKey[i] - panDenseMin[i]);
+        if( nDigit >= panDenseRadix[i] )
+            return FALSE;
+        nIndex = nIndex * panDenseRadix[i] + nDigit;
+    }
+
+    *pnIndex = nIndex;
+    return TRUE;
+}
+
+/************************************************************************/
+/*                            AppendEntry()                             */
+/*                                                                      */
+/*      Copy a new key to the end of the arena.                         */
+/************************************************************************/
+
+int CombinationTable::AppendEntry( const GUInt32 *panKey, GUIntBig nCount )
+
+{
+    if( nEntries >= 0xFFFFFFFEU )
+        return FALSE;
+
+    if( nEntries == nEntryAlloc && !GrowEntries() )
+        return FALSE;
+
+    memcpy( panKeys + nEntries * nKeyWords, panKey,
+            nKeyWords * sizeof(GUInt32) );
+    panCounts[nEntries] = nCount;
+    InitStats( nEntries, nEntries + 1 );
+    nEntries++;
+
+    return TRUE;
+}
+
+/************************************************************************/
+/*                             InitStats()                              */
+/*                                                                      */
+/*      Clear the statistics of entries iFirst to iLast - 1.            */
+/************************************************************************/
+
+void CombinationTable::InitStats( size_t iFirst, size_t iLast )
+
+{
+    size_t i;
+
+    for( i = iFirst * nStats; i < iLast * nStats; i++ )
+    {
+        padfStats[i * STAT_FIELDS] = 0.0;
+        padfStats[i * STAT_FIELDS + 1] = 0.0;
+        padfStats[i * STAT_FIELDS + 2] = HUGE_VAL;
+        padfStats[i * STAT_FIELDS + 3] = -HUGE_VAL;
+    }
+}
+
+/************************************************************************/
+/*                            AddStatValue()                            */
+/*                                                                      */
+/*      Aggregate one value of stat raster iStat into an entry. NaN is  */
+/*      not a value.                                                    */
+/************************************************************************/
+
+inline void CombinationTable::AddStatValue( size_t iEntry, int iStat,
+                                            double dfValue )
+
+{
+    double *padfStat = padfStats + (iEntry * nStats + iStat) * STAT_FIELDS;
+
+    if( CPLIsNan(dfValue) )
+        return;
+    padfStat[0] += 1.0;
+    padfStat[1] += dfValue;
+    if( dfValue < padfStat[2] )
+        padfStat[2] = dfValue;
+    if( dfValue > padfStat[3] )
+        padfStat[3] = dfValue;
+}
+
+/************************************************************************/
+/*                             MergeStats()                             */
+/*                                                                      */
+/*      Aggregate the statistics of an entry of another table.          */
+/************************************************************************/
+
+void CombinationTable::MergeStats( size_t iEntry, const double *padfOther )
+
+{
+    double *padfStat = padfStats + iEntry * nStats * STAT_FIELDS;
+    int iStat;
+
+    for( iStat = 0; iStat < nStats; iStat++ )
+    {
+        padfStat[0] += padfOther[0];
+        padfStat[1] += padfOther[1];
+        padfStat[2] = MIN( padfStat[2], padfOther[2] );
+        padfStat[3] = MAX( padfStat[3], padfOther[3] );
+        padfStat += STAT_FIELDS;
+        padfOther += STAT_FIELDS;
+    }
+}
+
+/************************************************************************/
+/*                                Add()                                 */
+/*                                                                      */
+/*      Count nCount more pixels of the combination panKey, adding it   */
+/*      to the table if it is new. The entry index is returned in       */
+/*      *piEntry. Returns TRUE if the combination was new, FALSE if     */
+/*      it already existed and -1 if memory could not be allocated      */
+/*      for a new combination (the table is left unchanged).            */
+/************************************************************************/
+
+int CombinationTable::Add( const GUInt32 *panKey, GUIntBig nCount,
+                           size_t *piEntry )
+
+{
+    size_t iSlot;
+
+/* -------------------------------------------------------------------- */
+/*      Dense mode: the key is a mixed-radix index into panDenseEntry.  */
+/* -------------------------------------------------------------------- */
+    if( panDenseEntry != NULL )
+    {
+        GUIntBig nIndex;
+
+        if( GetDenseIndex( panKey, &nIndex ) )
+        {
+            GUInt32 nEntry = panDenseEntry[nIndex];
+            if( nEntry != 0 )
+            {
+                panCounts[nEntry - 1] += nCount;
+                *piEntry = nEntry - 1;
+                return FALSE;
+            }
+
+            if( !AppendEntry( panKey, nCount ) )
+                return -1;
+            panDenseEntry[nIndex] = (GUInt32) nEntries;
+            *piEntry = nEntries - 1;
+            return TRUE;
+        }
+
+        CPLDebug( "gdal_combine",
+                  "Value outside of the dense index domain, "
+                  "switching to a hashed index." );
+        if( !BuildHashIndex() )
+            return -1;
+    }
+
+/* -------------------------------------------------------------------- */
+/*      Hashed mode.                                                    */
+/* -------------------------------------------------------------------- */
+    GUInt32 nHash = HashCombinationKey( panKey, nKeyWords );
+
+    if( nSlotMask != 0 )
+    {
+        for( iSlot = nHash & nSlotMask;
+             panSlotEntry[iSlot] != 0;
+             iSlot = (iSlot + 1) & nSlotMask )
+        {
+            if( panSlotHash[iSlot] == nHash )
+            {
+                size_t iEntry = panSlotEntry[iSlot] - 1;
+                if( memcmp( GetKey(iEntry), panKey,
+                            nKeyWords * sizeof(GUInt32) ) == 0 )
+                {
+                    panCounts[iEntry] += nCount;
+                    *piEntry = iEntry;
+                    return FALSE;
+                }
+            }
+        }
+    }
+
+/* -------------------------------------------------------------------- */
+/*      New combination: keep the load factor of the slot array below   */
+/*      2/3, then add the key to the arena.                             */
+/* -------------------------------------------------------------------- */
+    if( (nEntries + 1) * 3 > (nSlotMask + 1) * 2 )
+    {
+        if( !GrowSlots() )
+            return -1;
+    }
+    else if( bExternalSlots )
+    {
+        if( !CopyExternalSlots() )
+            return -1;
+    }
+
+    if( !AppendEntry( panKey, nCount ) )
+        return -1;
+
+    for( iSlot = nHash & nSlotMask;
+         panSlotEntry[iSlot] != 0;
+         iSlot = (iSlot + 1) & nSlotMask ) {}
+
+    panSlotEntry[iSlot] = (GUInt32) nEntries;
+    panSlotHash[iSlot] = nHash;
+
+    *piEntry = nEntries - 1;
+    return TRUE;
+}
+
+/************************************************************************/
+/*                              Reserve()                               */
+/*                                                                      */
+/*      Make room for nExpected entries of a hashed table up front, so  */
+/*      that it is not grown and rehashed step by step while counting.  */
+/*      Returns FALSE if the memory is not available, which leaves the  */
+/*      table usable.                                                   */
+/************************************************************************/
+
+int CombinationTable::Reserve( size_t nExpected )
+
+{
+    if( panDenseEntry != NULL )
+        return TRUE;
+    if( nExpected > nEntryAlloc && !GrowEntries( nExpected ) )
+        return FALSE;
+    if( nExpected * 3 > (nSlotMask + 1) * 2 && !GrowSlots( nExpected / 2 * 3 + 1 ) )
+        return FALSE;
+    return TRUE;
+}
+
+/************************************************************************/
+/*                               Reset()                                */
+/*                                                                      */
+/*      Remove all entries, keeping the memory allocated for reuse      */
+/*      unless bFreeMemory is set, in which case the key arena and the  */
+/*      hash slots are freed. The dense index is always kept.           */
+/************************************************************************/
+
+void CombinationTable::Reset( int bFreeMemory )
+
+{
+    if( panDenseEntry != NULL )
+    {
+        // only the cells of the entries found need clearing
+        size_t iEntry;
+        GUIntBig nIndex;
+
+        for( iEntry = 0; iEntry < nEntries; iEntry++ )
+        {
+            if( GetDenseIndex( GetKey(iEntry), &nIndex ) )
+                panDenseEntry[nIndex] = 0;
+        }
+    }
+    else if( bExternalSlots )
+    {
+        panSlotEntry = NULL;
+        panSlotHash = NULL;
+        nSlotMask = 0;
+        bExternalSlots = FALSE;
+    }
+    else if( bFreeMemory )
+    {
+        CPLFree( panSlotEntry );
+        CPLFree( panSlotHash );
+        panSlotEntry = NULL;
+        panSlotHash = NULL;
+        nSlotMask = 0;
+    }
+    else if( nSlotMask != 0 )
+    {
+        memset( panSlotEntry, 0, (nSlotMask + 1) * sizeof(GUInt32) );
+    }
+
+    if( bExternalKeys )
+    {
+        panKeys = NULL;
+        nEntryAlloc = 0;
+        bExternalKeys = FALSE;
+    }
+    else if( bFreeMemory )
+    {
+        CPLFree( panKeys );
+        CPLFree( panCounts );
+        CPLFree( padfStats );
+        panKeys = NULL;
+        panCounts = NULL;
+        padfStats = NULL;
+        nEntryAlloc = 0;
+    }
+
+    nEntries = 0;
+}
+
+/************************************************************************/
+/*                           GetMemoryUsage()                           */
+/************************************************************************/
+
+size_t CombinationTable::GetMemoryUsage() const
+
+{
+    return nEntryAlloc * (nKeyWords * sizeof(GUInt32) + sizeof(GUIntBig) +
+                          nStats * STAT_FIELDS * sizeof(double))
+        + (nSlotMask == 0 ? 0 : (nSlotMask + 1) * 2 * sizeof(GUInt32))
+        + (size_t) nDenseSize * sizeof(GUInt32);
+}
+
+/************************************************************************/
+/*                          GetProbeLengths()                           */
+/*                                                                      */
+/*      Mean and longest number of slots probed to find an entry of     */
+/*      the hash index, from the distance of each entry to its home     */
+/*      slot. Returns FALSE if the table has no hashed entries.         */
+/************************************************************************/
+
+int CombinationTable::GetProbeLengths( double *pdfMean, size_t *pnMax ) const
+
+{
+    size_t iSlot, nDistance, nOccupied = 0;
+    double dfSum = 0.0;
+
+    *pdfMean = 0.0;
+    *pnMax = 0;
+    if( panDenseEntry != NULL || nSlotMask == 0 )
+        return FALSE;
+
+    for( iSlot = 0; iSlot <= nSlotMask; iSlot++ )
+    {
+        if( panSlotEntry[iSlot] == 0 )
+            continue;
+        nDistance = (iSlot - (panSlotHash[iSlot] & nSlotMask)) & nSlotMask;
+        dfSum += (double) (nDistance + 1);
+        *pnMax = MAX( *pnMax, nDistance + 1 );
+        nOccupied++;
+    }
+    if( nOccupied == 0 )
+        return FALSE;
+    *pdfMean = dfSum / nOccupied;
+    return TRUE;
+}
+
+/************************************************************************/
+/*                            GetWallTime()                             */
+/************************************************************************/
+
+static double GetWallTime()
+{
+#ifdef _WIN32
+	struct __timeb64 sTime;
+	_ftime64(&sTime);
+	return sTime.time + sTime.millitm * 1e-3;
+#else
+	struct timeval sTime;
+	gettimeofday(&sTime, NULL);
+	return sTime.tv_sec + sTime.tv_usec * 1e-6;
+#endif
+}
+
+static void Usage() {
+    printf( "Usage: gdal_combine [-o out_raster] [-of out_format]\n"
+			"       [-ot {Byte/UInt16/UInt32/Auto}] [-ovr {NEAREST/MODE/NONE}]\n"
+			"       [-initid id] [-dense_mem MB]\n"
+			"       [-threads {n/ALL_CPUS}] [-queue n] [-buffer_mem MB]\n"
+			"       [-max_mem MB] [-dict dictionary_file] [-sample_pct pct]\n"
+			"       [-quant [input=]step]* [-skip_nodata {ALL/input}]*\n"
+			"       [-stat value_raster[:band]]* [-crosstab {from:to[,...]/CONSECUTIVE}]*\n"
+            "       [-co \"NAME=VALUE\"]* [-q] [-stats] [-stats_json out_json_file]\n"
+            "       [-csv out_csv_file] [-bin out_table_file]\n"
+			"       [-input_file_list my_list.txt]\n"
+            "       [raster_file[:band]...] \n\n" );
+}
+
+/************************************************************************/
+/*                        add_file_to_list()                            */
+/************************************************************************/
+
+static void add_file_to_list(const char* filename, int* pnInputFiles, 
+								char*** pppszInputFilenames)
+{
+	int nInputFiles = *pnInputFiles;
+	char** ppszInputFilenames = *pppszInputFilenames;
+
+	ppszInputFilenames = (char**)CPLRealloc(ppszInputFilenames,
+											sizeof(char*) * (nInputFiles+1));
+	ppszInputFilenames[nInputFiles++] = CPLStrdup(filename);
+	
+	*pnInputFiles = nInputFiles;
+	*pppszInputFilenames = ppszInputFilenames;
+}
+
+/************************************************************************/
+/*                           ParseInputSpec()                           */
+/*                                                                      */
+/*      Split an input given as filename[:band]. A trailing :n is only  */
+/*      taken as the band if the whole spec is not an existing file.    */
+/*      The filename returned must be freed with CPLFree().             */
+/************************************************************************/
+
+static char *ParseInputSpec(const char *pszSpec, int *pnBand)
+{
+	const char *pszColon = strrchr(pszSpec, ':');
+	VSIStatBufL sStat;
+	char *pszFilename;
+
+	*pnBand = 1;
+	if(pszColon == NULL || pszColon == pszSpec || pszColon[1] == '\0' ||
+		strspn(pszColon + 1, "0123456789") != strlen(pszColon + 1) ||
+		VSIStatL(pszSpec, &sStat) == 0)
+		return CPLStrdup(pszSpec);
+
+	pszFilename = CPLStrdup(pszSpec);
+	pszFilename[pszColon - pszSpec] = '\0';
+	*pnBand = atoi(pszColon + 1);
+	return pszFilename;
+}
+
+/************************************************************************/
+/*                            GetInputName()                            */
+/*                                                                      */
+/*      Column name of an input: the file basename, with the band       */
+/*      appended if it is not the first one.                            */
+/************************************************************************/
+
+static const char *GetInputName(const InputRaster *psInput)
+{
+	if(psInput->nBand == 1)
+		return CPLGetBasename(psInput->pszFilename);
+	return CPLSPrintf("%s_b%d", CPLGetBasename(psInput->pszFilename), psInput->nBand);
+}
+
+/************************************************************************/
+/*                           OpenInputRaster()                          */
+/*                                                                      */
+/*      Open band nBand of psInput->pszFilename and fill in the         */
+/*      dataset, band and data type members. Returns FALSE on failure.  */
+/************************************************************************/
+
+static int OpenInputRaster(InputRaster *psInput)
+{
+	psInput->hDS = GDALOpen(psInput->pszFilename, GA_ReadOnly);
+	if(psInput->hDS == NULL)
+		return FALSE;
+
+	if(psInput->nBand < 1 || psInput->nBand > GDALGetRasterCount(psInput->hDS)) {
+		CPLError(CE_Failure, CPLE_IllegalArg, "%s has no band %d", 
+				psInput->pszFilename, psInput->nBand);
+		GDALClose(psInput->hDS);
+		psInput->hDS = NULL;
+		return FALSE;
+	}
+	psInput->hBand = GDALGetRasterBand(psInput->hDS, psInput->nBand);
+	psInput->eDataType = GDALGetRasterDataType(psInput->hBand);
+	
+	// is it integer?
+	if(!psInput->bIsStat &&
+		(psInput->eDataType == GDT_Byte || psInput->eDataType == GDT_UInt16 ||
+		psInput->eDataType == GDT_Int16 || psInput->eDataType == GDT_UInt32 ||
+		psInput->eDataType == GDT_Int32)) {
+		psInput->bIsIntDataType = TRUE;
+	}
+	else {
+		psInput->bIsIntDataType = FALSE;
+	}
+
+	psInput->panValues = NULL;
+	psInput->padfValues = NULL;
+	psInput->pabyMask = NULL;
+	return TRUE;
+}
+
+/************************************************************************/
+/*                            InputMatches()                            */
+/*                                                                      */
+/*      Whether pszName names an input, as in the CSV header or as      */
+/*      given on the command line (pszSpec).                            */
+/************************************************************************/
+
+static int InputMatches(const InputRaster *psInput, const char *pszSpec, 
+						const char *pszName)
+{
+	return EQUAL(pszName, GetInputName(psInput)) || EQUAL(pszName, pszSpec);
+}
+
+/************************************************************************/
+/*                          SetQuantization()                           */
+/*                                                                      */
+/*      Apply a -quant option: "input=step" sets the quantization step  */
+/*      of the floating point input named input (as in the CSV header,  */
+/*      or as given on the command line), a bare step that of all       */
+/*      floating point inputs.                                          */
+/************************************************************************/
+
+static int SetQuantization(InputRaster *psInputRasters, int nInputFiles,
+							char **papszInputSpecs, const char *pszOption)
+{
+	const char *pszStep = strrchr(pszOption, '=');
+	char *pszName = NULL;
+	double dfStep;
+	int i, bFound = FALSE;
+
+	if(pszStep != NULL) {
+		pszName = CPLStrdup(pszOption);
+		pszName[pszStep - pszOption] = '\0';
+		pszStep++;
+	}
+	else {
+		pszStep = pszOption;
+	}
+
+	dfStep = CPLAtof(pszStep);
+	if(!(dfStep > 0)) {
+		CPLError(CE_Failure, CPLE_IllegalArg, 
+				"Invalid quantization step in -quant %s", pszOption);
+		CPLFree(pszName);
+		return FALSE;
+	}
+
+	for(i=0;i<nInputFiles;i++) {
+		InputRaster *psInput = &psInputRasters[i];
+		if(pszName != NULL && !InputMatches(psInput, papszInputSpecs[i], pszName))
+			continue;
+		if(psInput->bIsIntDataType) {
+			if(pszName == NULL)
+				continue;
+			CPLError(CE_Failure, CPLE_IllegalArg, 
+					"-quant %s: %s is not a floating point input", pszOption, pszName);
+			CPLFree(pszName);
+			return FALSE;
+		}
+		psInput->dfQuantStep = dfStep;
+		bFound = TRUE;
+	}
+	if(!bFound && pszName != NULL) {
+		CPLError(CE_Failure, CPLE_IllegalArg, "-quant %s: no input named %s",
+				pszOption, pszName);
+		CPLFree(pszName);
+		return FALSE;
+	}
+
+	CPLFree(pszName);
+	return TRUE;
+}
+
+/************************************************************************/
+/*                           SetSkipNodata()                            */
+/*                                                                      */
+/*      Apply a -skip_nodata option: ALL, or the name of one input.     */
+/************************************************************************/
+
+static int SetSkipNodata(InputRaster *psInputRasters, int nInputFiles,
+						char **papszInputSpecs, const char *pszOption)
+{
+	int i, bFound = FALSE;
+
+	for(i=0;i<nInputFiles;i++) {
+		InputRaster *psInput = &psInputRasters[i];
+		if(!EQUAL(pszOption, "ALL") && 
+			!InputMatches(psInput, papszInputSpecs[i], pszOption))
+			continue;
+		psInput->bSkipNodata = TRUE;
+		psInput->nMaskFlags = GDALGetMaskFlags(psInput->hBand);
+		psInput->dfNoData = GDALGetRasterNoDataValue(psInput->hBand, 
+													&psInput->bHasNoData);
+		if(psInput->nMaskFlags == GMF_ALL_VALID && psInput->bCoversGrid)
+			CPLError(CE_Warning, CPLE_AppDefined, 
+					"-skip_nodata: %s has no nodata value or mask", 
+					GetInputName(psInput));
+		bFound = TRUE;
+	}
+	if(!bFound) {
+		CPLError(CE_Failure, CPLE_IllegalArg, "-skip_nodata: no input named %s",
+				pszOption);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/************************************************************************/
+/*                            SetKeyLayout()                            */
+/*                                                                      */
+/*      Place each input in the combination key and return the number   */
+/*      of key slots: one per integer input, two per floating point     */
+/*      input and none for -stat rasters.                               */
+/************************************************************************/
+
+static int SetKeyLayout(InputRaster *psInputRasters, int nInputFiles)
+{
+	int i, nKeyWords = 0;
+
+	for(i=0;i<nInputFiles;i++) {
+		psInputRasters[i].nKeyOffset = psInputRasters[i].bIsStat ? 0 : nKeyWords;
+		if(psInputRasters[i].bIsStat)
+			psInputRasters[i].nKeyWords = 0;
+		else
+			psInputRasters[i].nKeyWords = psInputRasters[i].bIsIntDataType ? 1 : 2;
+		nKeyWords += psInputRasters[i].nKeyWords;
+	}
+	return nKeyWords;
+}
+
+/************************************************************************/
+/*                        AllocateWindowBuffers()                       */
+/************************************************************************/
+
+static int AllocateWindowBuffers(InputRaster *psInputRasters, int nInputFiles, 
+								size_t nPixels)
+{
+	int i;
+
+	for(i=0;i<nInputFiles;i++) {
+		if(psInputRasters[i].bIsIntDataType) {
+			psInputRasters[i].panValues = (int*) VSIMalloc2(nPixels, sizeof(int));
+			if(psInputRasters[i].panValues == NULL)
+				return FALSE;
+		}
+		else {
+			//if not integer read as 64-bit float
+			psInputRasters[i].padfValues = (double*) VSIMalloc2(nPixels, sizeof(double));
+			if(psInputRasters[i].padfValues == NULL)
+				return FALSE;
+		}
+		if(psInputRasters[i].bSkipNodata) {
+			psInputRasters[i].pabyMask = (GByte*) VSIMalloc(nPixels);
+			if(psInputRasters[i].pabyMask == NULL)
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/************************************************************************/
+/*                          CloseInputRasters()                         */
+/************************************************************************/
+
+static void CloseInputRasters(InputRaster *psInputRasters, int nInputFiles)
+{
+	int i;
+
+	for(i=0;i<nInputFiles;i++) {
+		if(psInputRasters[i].hDS != NULL)
+			GDALClose(psInputRasters[i].hDS);
+		CPLFree(psInputRasters[i].panValues);
+		CPLFree(psInputRasters[i].padfValues);
+		CPLFree(psInputRasters[i].pabyMask);
+	}
+}
+
+/************************************************************************/
+/*                          ComputeInputGrid()                          */
+/*                                                                      */
+/*      Place the inputs in a common grid covering the union of the     */
+/*      extents of the first nGridInputs of them (the others, -stat     */
+/*      rasters, are only placed in it). They must share pixel size     */
+/*      and alignment, differing at most by whole-pixel offsets. Sets   */
+/*      the offset and size of each input in the grid and its fill      */
+/*      value, and returns the grid size and geotransform               */
+/*      (bHasGeoTransform FALSE if the inputs are not georeferenced, in */
+/*      which case they must all have the same size). Returns FALSE if  */
+/*      the inputs are not aligned.                                     */
+/************************************************************************/
+
+static int ComputeInputGrid(InputRaster *psInputRasters, int nInputFiles,
+							int nGridInputs, int *pnXSize, int *pnYSize, 
+							double *padfGeoTransform, int *pbHasGeoTransform)
+{
+	double adfRef[6], adfGT[6];
+	double dfXOff, dfYOff;
+	int i, nMinX = 0, nMinY = 0, nMaxX = 0, nMaxY = 0, bHasNoData;
+
+	*pbHasGeoTransform = TRUE;
+	for(i=0;i<nInputFiles;i++) {
+		psInputRasters[i].nXSize = GDALGetRasterXSize(psInputRasters[i].hDS);
+		psInputRasters[i].nYSize = GDALGetRasterYSize(psInputRasters[i].hDS);
+		if(GDALGetGeoTransform(psInputRasters[i].hDS, adfGT) != CE_None)
+			*pbHasGeoTransform = FALSE;
+	}
+	GDALGetGeoTransform(psInputRasters[0].hDS, adfRef);
+
+	for(i=0;i<nInputFiles;i++) {
+		InputRaster *psInput = &psInputRasters[i];
+
+		if(!*pbHasGeoTransform) {
+			if(psInput->nXSize != psInputRasters[0].nXSize ||
+				psInput->nYSize != psInputRasters[0].nYSize) {
+				CPLError(CE_Failure, CPLE_AppDefined, 
+						"%s is not georeferenced and its size differs from %s",
+						psInput->pszFilename, psInputRasters[0].pszFilename);
+				return FALSE;
+			}
+			psInput->nXOff = 0;
+			psInput->nYOff = 0;
+		}
+		else {
+			GDALGetGeoTransform(psInput->hDS, adfGT);
+			dfXOff = (adfGT[0] - adfRef[0]) / adfRef[1];
+			dfYOff = (adfGT[3] - adfRef[3]) / adfRef[5];
+			if(adfGT[2] != 0.0 || adfGT[4] != 0.0 || adfRef[2] != 0.0 || adfRef[4] != 0.0 ||
+				fabs(adfGT[1] - adfRef[1]) > 1e-6 * fabs(adfRef[1]) ||
+				fabs(adfGT[5] - adfRef[5]) > 1e-6 * fabs(adfRef[5]) ||
+				fabs(dfXOff - floor(dfXOff + 0.5)) > 1e-3 ||
+				fabs(dfYOff - floor(dfYOff + 0.5)) > 1e-3) {
+				CPLError(CE_Failure, CPLE_AppDefined, 
+						"%s is not on the same grid as %s",
+						psInput->pszFilename, psInputRasters[0].pszFilename);
+				return FALSE;
+			}
+			psInput->nXOff = (int) floor(dfXOff + 0.5);
+			psInput->nYOff = (int) floor(dfYOff + 0.5);
+		}
+
+		if(i >= nGridInputs)
+			continue;
+		if(i == 0 || psInput->nXOff < nMinX)
+			nMinX = psInput->nXOff;
+		if(i == 0 || psInput->nYOff < nMinY)
+			nMinY = psInput->nYOff;
+		if(i == 0 || psInput->nXOff + psInput->nXSize > nMaxX)
+			nMaxX = psInput->nXOff + psInput->nXSize;
+		if(i == 0 || psInput->nYOff + psInput->nYSize > nMaxY)
+			nMaxY = psInput->nYOff + psInput->nYSize;
+	}
+
+	*pnXSize = nMaxX - nMinX;
+	*pnYSize = nMaxY - nMinY;
+	if(*pbHasGeoTransform) {
+		memcpy(padfGeoTransform, adfRef, sizeof(adfRef));
+		padfGeoTransform[0] = adfRef[0] + nMinX * adfRef[1];
+		padfGeoTransform[3] = adfRef[3] + nMinY * adfRef[5];
+	}
+
+	//cells outside of an input get its nodata value, or NaN for floating
+	//point and 0 for integer inputs without one
+	for(i=0;i<nInputFiles;i++) {
+		InputRaster *psInput = &psInputRasters[i];
+
+		psInput->nXOff -= nMinX;
+		psInput->nYOff -= nMinY;
+		psInput->bCoversGrid = psInput->nXOff <= 0 && psInput->nYOff <= 0 &&
+						psInput->nXOff + psInput->nXSize >= *pnXSize &&
+						psInput->nYOff + psInput->nYSize >= *pnYSize;
+
+		psInput->dfFillValue = GDALGetRasterNoDataValue(psInput->hBand, &bHasNoData);
+		if(!bHasNoData)
+			psInput->dfFillValue = psInput->bIsIntDataType ? 0.0 : CPLAtof("nan");
+		if(psInput->bIsIntDataType) {
+			psInput->dfFillValue = MAX(-2147483648.0, MIN(2147483647.0, 
+												floor(psInput->dfFillValue)));
+			if(!bHasNoData && !psInput->bCoversGrid)
+				CPLError(CE_Warning, CPLE_AppDefined, 
+						"%s has no nodata value, 0 is used outside of its extent",
+						psInput->pszFilename);
+		}
+	}
+	return TRUE;
+}
+
+/************************************************************************/
+/*                         ComputeWindowLayout()                        */
+/************************************************************************/
+
+static void ComputeWindowLayout(const InputRaster *psInputRasters, int nInputFiles,
+								int nXSize, int nYSize, size_t nBufferSize,
+								WindowLayout *psLayout)
+{
+	int i, nBlockXSize, nBlockYSize, nMaxBlockYSize = 1;
+	size_t nBytesPerPixel = sizeof(GUInt32);	/* output ID buffer */
+	size_t nRowsFit;
+
+	for(i=0;i<nInputFiles;i++) {
+		GDALGetBlockSize(psInputRasters[i].hBand, &nBlockXSize, &nBlockYSize);
+		nMaxBlockYSize = MAX(nMaxBlockYSize, nBlockYSize);
+		nBytesPerPixel += psInputRasters[i].bIsIntDataType ? sizeof(int) : sizeof(double);
+	}
+	nMaxBlockYSize = MIN(nMaxBlockYSize, nYSize);
+
+	//strips of whole block rows, batching small blocks, as many block rows
+	//as the buffer size allows. Windows are never narrower than the grid,
+	//that would number the combinations in window order.
+	psLayout->nWinYSize = nMaxBlockYSize * 
+				((MIN_WINDOW_ROWS + nMaxBlockYSize - 1) / nMaxBlockYSize);
+	nRowsFit = nBufferSize / nBytesPerPixel / nXSize;
+	if(nRowsFit >= (size_t) nMaxBlockYSize)
+		psLayout->nWinYSize = (int) MIN((size_t) psLayout->nWinYSize, 
+										nRowsFit / nMaxBlockYSize * nMaxBlockYSize);
+	else	//the block cache keeps a block row read over several windows
+		psLayout->nWinYSize = (int) MAX((size_t) 1, nRowsFit);
+	psLayout->nWinYSize = MIN(psLayout->nWinYSize, nYSize);
+	psLayout->nWinXSize = nXSize;
+
+	psLayout->nXSize = nXSize;
+	psLayout->nYSize = nYSize;
+	psLayout->nWindowsPerRow = (nXSize + psLayout->nWinXSize - 1) / psLayout->nWinXSize;
+	psLayout->nWindows = psLayout->nWindowsPerRow * 
+				((nYSize + psLayout->nWinYSize - 1) / psLayout->nWinYSize);
+}
+
+/************************************************************************/
+/*                              GetWindow()                             */
+/************************************************************************/
+
+static void GetWindow(const WindowLayout *psLayout, int iWindow, 
+						int *pnXOff, int *pnYOff, int *pnXSize, int *pnYSize)
+{
+	*pnXOff = (iWindow % psLayout->nWindowsPerRow) * psLayout->nWinXSize;
+	*pnYOff = (iWindow / psLayout->nWindowsPerRow) * psLayout->nWinYSize;
+	*pnXSize = MIN(psLayout->nWinXSize, psLayout->nXSize - *pnXOff);
+	*pnYSize = MIN(psLayout->nWinYSize, psLayout->nYSize - *pnYOff);
+}
+
+/************************************************************************/
+/*                           SmallestIdType()                           */
+/*                                                                      */
+/*      The smallest unsigned output type holding IDs up to nMaxID.     */
+/************************************************************************/
+
+static GDALDataType SmallestIdType(GUIntBig nMaxID)
+{
+	if(nMaxID <= 255)
+		return GDT_Byte;
+	if(nMaxID <= 65535)
+		return GDT_UInt16;
+	return GDT_UInt32;
+}
+
+/************************************************************************/
+/*                         CreateOutputRaster()                         */
+/*                                                                      */
+/*      Create the output raster with the given geotransform, if not    */
+/*      NULL, and the projection of hRefDS. If bNoDataZero, ID 0 is its */
+/*      nodata value.                                                   */
+/************************************************************************/
+
+static GDALDatasetH CreateOutputRaster(GDALDriverH hDriver, const char *pszOutRaster,
+									int nXSize, int nYSize, GDALDataType eType,
+									char **papszCreateOptions, 
+									double *padfGeoTransform, GDALDatasetH hRefDS,
+									int bNoDataZero)
+{
+	GDALDatasetH hOutDS;
+
+	hOutDS = GDALCreate(hDriver, pszOutRaster, nXSize, nYSize, 1, 
+						eType, papszCreateOptions);
+	if(hOutDS == NULL)
+		return NULL;
+						
+	if(padfGeoTransform != NULL)
+		GDALSetGeoTransform(hOutDS, padfGeoTransform);
+	if(GDALGetProjectionRef(hRefDS) != NULL )
+		GDALSetProjection(hOutDS, GDALGetProjectionRef(hRefDS));
+	if(bNoDataZero)
+		GDALSetRasterNoDataValue(GDALGetRasterBand(hOutDS, 1), 0.0);
+	return hOutDS;
+}
+
+/************************************************************************/
+/*                         GetInputValueRange()                         */
+/*                                                                      */
+/*      Find the range of values of an integer input, including its     */
+/*      nodata value and its fill value if it does not cover the whole  */
+/*      grid. Stored statistics are used when available, then the       */
+/*      range of the data type for Byte, and otherwise the band is      */
+/*      scanned if bAllowScan is set. Returns FALSE if the range is      */
+/*      not known without a scan.                                       */
+/************************************************************************/
+
+static int GetInputValueRange(const InputRaster *psInput, int bAllowScan,
+								GInt32 *pnMin, GInt32 *pnMax)
+{
+	double dfMin, dfMax, dfNoData;
+	int bHasNoData = FALSE;
+
+	if(GDALGetRasterStatistics(psInput->hBand, TRUE, FALSE, 
+								&dfMin, &dfMax, NULL, NULL) == CE_None) {
+		//use the stored statistics
+	}
+	else if(psInput->eDataType == GDT_Byte) {
+		dfMin = 0.0;
+		dfMax = 255.0;
+	}
+	else if(bAllowScan) {
+		double adfMinMax[2];
+		GDALComputeRasterMinMax(psInput->hBand, FALSE, adfMinMax);
+		dfMin = adfMinMax[0];
+		dfMax = adfMinMax[1];
+	}
+	else {
+		return FALSE;
+	}
+
+	dfNoData = GDALGetRasterNoDataValue(psInput->hBand, &bHasNoData);
+	if(bHasNoData) {
+		dfMin = MIN(dfMin, dfNoData);
+		dfMax = MAX(dfMax, dfNoData);
+	}
+	if(!psInput->bCoversGrid) {
+		dfMin = MIN(dfMin, psInput->dfFillValue);
+		dfMax = MAX(dfMax, psInput->dfFillValue);
+	}
+
+	//values are read as Int32
+	dfMin = MAX(floor(dfMin), -2147483648.0);
+	dfMax = MIN(ceil(dfMax), 2147483647.0);
+	if(dfMax < dfMin)
+		dfMax = dfMin;
+	*pnMin = (GInt32) dfMin;
+	*pnMax = (GInt32) dfMax;
+	return TRUE;
+}
+
+/************************************************************************/
+/*                       GetMaxCombinationsBound()                      */
+/*                                                                      */
+/*      A cheap upper bound on the number of combinations: the pixel    */
+/*      count, or the product of the value ranges if all inputs are     */
+/*      integer with ranges known without scanning.                     */
+/************************************************************************/
+
+static double GetMaxCombinationsBound(const InputRaster *psInputRasters, int nInputFiles,
+									int nXSize, int nYSize)
+{
+	double dfProduct = 1.0;
+	GInt32 nMin, nMax;
+	int i;
+
+	for(i=0;i<nInputFiles;i++) {
+		if(!psInputRasters[i].bIsIntDataType ||
+			!GetInputValueRange(&psInputRasters[i], FALSE, &nMin, &nMax))
+			return (double) nXSize * nYSize;
+		dfProduct *= (double) nMax - nMin + 1.0;
+	}
+	return MIN(dfProduct, (double) nXSize * nYSize);
+}
+
+/************************************************************************/
+/*                          BuildCombinationKey()                       */
+/*                                                                      */
+/*      Pack the values of all inputs (but -stat rasters) at pixel      */
+/*      iPixel of the current window into panKey.                       */
+/************************************************************************/
+
+static void BuildCombinationKey(const InputRaster *psInputRasters, int nInputFiles,
+								size_t iPixel, GUInt32 *panKey)
+{
+	int i;
+
+	for(i=0;i<nInputFiles;i++) {
+		const InputRaster *psInput = &psInputRasters[i];
+		if(psInput->bIsStat) {
+			continue;
+		}
+		else if(psInput->bIsIntDataType) {
+			panKey[psInput->nKeyOffset] = (GUInt32) psInput->panValues[iPixel];
+		}
+		else {
+			double dfValue = psInput->padfValues[iPixel];
+			GIntBig nValue;
+			if(CPLIsNan(dfValue)) {
+				nValue = KEY_NAN_MARKER;
+			}
+			else if(psInput->dfQuantStep > 0) {
+				dfValue = floor(dfValue / psInput->dfQuantStep + 0.5);
+				nValue = (GIntBig) MAX(-9.2e18, MIN(9.2e18, dfValue));
+			}
+			else {
+				dfValue += 0.0;		//-0 to 0
+				memcpy(&nValue, &dfValue, sizeof(double));
+			}
+			panKey[psInput->nKeyOffset] = (GUInt32) ((GUIntBig) nValue & 0xFFFFFFFFU);
+			panKey[psInput->nKeyOffset+1] = (GUInt32) ((GUIntBig) nValue >> 32);
+		}
+	}
+}
+
+/************************************************************************/
+/*                            GetKeyValue()                             */
+/*                                                                      */
+/*      The value of one input in a key, as a double (NaN for NaN).     */
+/************************************************************************/
+
+static double GetKeyValue(const InputRaster *psInput, const GUInt32 *panKey)
+{
+	GIntBig nValue;
+	double dfValue;
+
+	if(psInput->bIsIntDataType)
+		return (double) (int) panKey[psInput->nKeyOffset];
+
+	nValue = (GIntBig) ((GUIntBig) panKey[psInput->nKeyOffset] |
+						((GUIntBig) panKey[psInput->nKeyOffset+1] << 32));
+	if(nValue == KEY_NAN_MARKER)
+		return CPLAtof("nan");
+	if(psInput->dfQuantStep > 0)
+		return nValue * psInput->dfQuantStep;
+	memcpy(&dfValue, &nValue, sizeof(double));
+	return dfValue;
+}
+
+/************************************************************************/
+/*                            FormatDouble()                            */
+/*                                                                      */
+/*      Write a value with the fewest digits that read back to the same */
+/*      double, or "nan". Returns the number of characters written, at  */
+/*      most 24.                                                        */
+/************************************************************************/
+
+static int FormatDouble(char *pszOut, double dfValue)
+{
+	int nLen;
+
+	if(CPLIsNan(dfValue))
+		return sprintf(pszOut, "nan");
+	nLen = sprintf(pszOut, "%.15g", dfValue);
+	if(CPLAtof(pszOut) != dfValue)
+		nLen = sprintf(pszOut, "%.17g", dfValue);
+	return nLen;
+}
+
+/************************************************************************/
+/*                         FormatCombinationKey()                       */
+/*                                                                      */
+/*      Write the comma-separated input values of a key into pszOut,    */
+/*      which must hold at least nInputFiles*32 bytes. Exact floating   */
+/*      point values are written with the fewest digits that read back  */
+/*      to the same double, quantized ones with 15 significant digits.  */
+/************************************************************************/
+
+static void FormatCombinationKey(const InputRaster *psInputRasters, int nInputFiles,
+								const GUInt32 *panKey, char *pszOut)
+{
+	int i;
+	char *pszPos = pszOut;
+
+	for(i=0;i<nInputFiles;i++) {
+		const InputRaster *psInput = &psInputRasters[i];
+		if(i > 0)
+			*pszPos++ = ',';
+		if(psInput->bIsIntDataType) {
+			pszPos += sprintf(pszPos, "%d", (int) panKey[psInput->nKeyOffset]);
+		}
+		else {
+			double dfValue = GetKeyValue(psInput, panKey);
+			if(psInput->dfQuantStep > 0 && !CPLIsNan(dfValue))
+				pszPos += sprintf(pszPos, "%.15g", dfValue);
+			else
+				pszPos += FormatDouble(pszPos, dfValue);
+		}
+	}
+	*pszPos = '\0';
+}
+
+/************************************************************************/
+/* ==================================================================== */
+/*      Writing the combination table.                                  */
+/*                                                                      */
+/*      Combinations are written in CMB_ID order, to the CSV file and   */
+/*      optionally to a binary columnar table, through buffers rather   */
+/*      than one formatted write per row. The binary table (-bin) is a  */
+/*      small header followed by one fixed-width column per field, each */
+/*      starting on an 8-byte boundary so the file can be mapped and    */
+/*      used in place:                                                  */
+/*                                                                      */
+/*        char[8]   "GDCMBTB1"                                          */
+/*        GUInt32   number of value columns                             */
+/*        GUInt32   size of the header, the offset of the first column  */
+/*        GUIntBig  number of rows                                      */
+/*        for each value column, its GDALDataType (GUInt32, GDT_Int32   */
+/*        or GDT_Float64), the length of its name (GUInt32) and its     */
+/*        name, without terminating zero                                */
+/*                                                                      */
+/*        CMB_ID    GUInt32 per row                                     */
+/*        COUNT     GUIntBig per row                                    */
+/*        one GInt32 or double column per input, then the double        */
+/*        columns of the -stat rasters (see GetStatColumnName())        */
+/*                                                                      */
+/*      Numbers are in the byte order of the machine writing the file.  */
+/* ==================================================================== */
+/************************************************************************/
+
+#define BINARY_TABLE_MAGIC "GDCMBTB1"
+#define ALIGN8(n) (((n) + 7) & ~((vsi_l_offset) 7))
+
+typedef struct {
+	VSILFILE *fp;
+	vsi_l_offset nOffset;		/* file offset of the start of the buffer */
+	GByte *pabyBuffer;
+	size_t nUsed;
+	size_t nSize;
+	int bError;
+} BufferedWriter;
+
+typedef struct {
+	VSILFILE *fp;
+	int nColumns;
+	BufferedWriter *pasColumns;	/* CMB_ID, COUNT, then one per input */
+} BinaryTable;
+
+/************************************************************************/
+/*                         GetStatColumnName()                          */
+/*                                                                      */
+/*      Name of statistic iField of a -stat raster in the tables.       */
+/************************************************************************/
+
+static const char *GetStatColumnName(const InputRaster *psInput, int iField)
+{
+	static const char * const apszFields[] = {"MEAN", "MIN", "MAX", "SUM"};
+
+	return CPLSPrintf("%s_%s", GetInputName(psInput), apszFields[iField]);
+}
+
+/************************************************************************/
+/*                          GetStatColumns()                            */
+/*                                                                      */
+/*      The values written for a -stat raster from its aggregate        */
+/*      (count, sum, min, max): mean, min, max and sum. The first three */
+/*      are NaN if there was no valid value.                            */
+/************************************************************************/
+
+static void GetStatColumns(const double *padfStat, double *padfColumns)
+{
+	if(padfStat[0] == 0) {
+		padfColumns[0] = padfColumns[1] = padfColumns[2] = CPLAtof("nan");
+	}
+	else {
+		padfColumns[0] = padfStat[1] / padfStat[0];
+		padfColumns[1] = padfStat[2];
+		padfColumns[2] = padfStat[3];
+	}
+	padfColumns[3] = padfStat[1];
+}
+
+/************************************************************************/
+/*                         InitBufferedWriter()                         */
+/************************************************************************/
+
+static void InitBufferedWriter(BufferedWriter *psWriter, VSILFILE *fp, 
+								vsi_l_offset nOffset, size_t nSize)
+{
+	psWriter->fp = fp;
+	psWriter->nOffset = nOffset;
+	psWriter->pabyBuffer = (GByte*) CPLMalloc(nSize);
+	psWriter->nUsed = 0;
+	psWriter->nSize = nSize;
+	psWriter->bError = FALSE;
+}
+
+/************************************************************************/
+/*                        FlushBufferedWriter()                         */
+/*                                                                      */
+/*      Write the buffer at its offset. Writers may share a file.       */
+/************************************************************************/
+
+static void FlushBufferedWriter(BufferedWriter *psWriter)
+{
+	if(psWriter->nUsed == 0)
+		return;
+	if(VSIFSeekL(psWriter->fp, psWriter->nOffset, SEEK_SET) != 0 ||
+		VSIFWriteL(psWriter->pabyBuffer, 1, psWriter->nUsed, psWriter->fp) != psWriter->nUsed)
+		psWriter->bError = TRUE;
+	psWriter->nOffset += psWriter->nUsed;
+	psWriter->nUsed = 0;
+}
+
+/************************************************************************/
+/*                           WriteBuffered()                            */
+/************************************************************************/
+
+static void WriteBuffered(BufferedWriter *psWriter, const void *pData, size_t nBytes)
+{
+	if(psWriter->nUsed + nBytes > psWriter->nSize)
+		FlushBufferedWriter(psWriter);
+	if(nBytes > psWriter->nSize) {
+		if(VSIFSeekL(psWriter->fp, psWriter->nOffset, SEEK_SET) != 0 ||
+			VSIFWriteL(pData, 1, nBytes, psWriter->fp) != nBytes)
+			psWriter->bError = TRUE;
+		psWriter->nOffset += nBytes;
+		return;
+	}
+	memcpy(psWriter->pabyBuffer + psWriter->nUsed, pData, nBytes);
+	psWriter->nUsed += nBytes;
+}
+
+/************************************************************************/
+/*                        CloseBufferedWriter()                         */
+/*                                                                      */
+/*      Flush and free the buffer. Returns FALSE if a write failed.     */
+/************************************************************************/
+
+static int CloseBufferedWriter(BufferedWriter *psWriter)
+{
+	FlushBufferedWriter(psWriter);
+	CPLFree(psWriter->pabyBuffer);
+	psWriter->pabyBuffer = NULL;
+	return !psWriter->bError;
+}
+
+/************************************************************************/
+/*                          CreateBinaryTable()                         */
+/*                                                                      */
+/*      Create a binary table of nRows combinations and write its       */
+/*      header. Returns FALSE if the file can't be created.             */
+/************************************************************************/
+
+static int CreateBinaryTable(BinaryTable *psTable, const char *pszFilename,
+							const InputRaster *psInputRasters, int nInputFiles,
+							int nStatFiles, GUIntBig nRows)
+{
+	BufferedWriter sHeader;
+	GUInt32 nValue;
+	vsi_l_offset nHeaderSize, nOffset;
+	int i, nValueColumns = nInputFiles + nStatFiles * STAT_FIELDS;
+	char **papszNames = NULL;
+	int *panTypes = (int*) CPLMalloc(nValueColumns * sizeof(int));
+
+	psTable->fp = VSIFOpenL(pszFilename, "wb");
+	if(psTable->fp == NULL) {
+		CPLFree(panTypes);
+		return FALSE;
+	}
+
+	//inputs, then the statistics of the -stat rasters that follow them
+	for(i=0;i<nInputFiles;i++) {
+		papszNames = CSLAddString(papszNames, GetInputName(&psInputRasters[i]));
+		panTypes[i] = psInputRasters[i].bIsIntDataType ? GDT_Int32 : GDT_Float64;
+	}
+	for(i=0;i<nStatFiles * STAT_FIELDS;i++) {
+		papszNames = CSLAddString(papszNames, 
+					GetStatColumnName(&psInputRasters[nInputFiles + i / STAT_FIELDS], 
+										i % STAT_FIELDS));
+		panTypes[nInputFiles + i] = GDT_Float64;
+	}
+
+	nHeaderSize = 8 + 2 * sizeof(GUInt32) + sizeof(GUIntBig);
+	for(i=0;i<nValueColumns;i++)
+		nHeaderSize += 2 * sizeof(GUInt32) + strlen(papszNames[i]);
+	nHeaderSize = ALIGN8(nHeaderSize);
+
+	InitBufferedWriter(&sHeader, psTable->fp, 0, 4096);
+	WriteBuffered(&sHeader, BINARY_TABLE_MAGIC, 8);
+	nValue = (GUInt32) nValueColumns;
+	WriteBuffered(&sHeader, &nValue, sizeof(GUInt32));
+	nValue = (GUInt32) nHeaderSize;
+	WriteBuffered(&sHeader, &nValue, sizeof(GUInt32));
+	WriteBuffered(&sHeader, &nRows, sizeof(GUIntBig));
+	for(i=0;i<nValueColumns;i++) {
+		nValue = (GUInt32) panTypes[i];
+		WriteBuffered(&sHeader, &nValue, sizeof(GUInt32));
+		nValue = (GUInt32) strlen(papszNames[i]);
+		WriteBuffered(&sHeader, &nValue, sizeof(GUInt32));
+		WriteBuffered(&sHeader, papszNames[i], nValue);
+	}
+	CSLDestroy(papszNames);
+	if(!CloseBufferedWriter(&sHeader)) {
+		CPLFree(panTypes);
+		return FALSE;
+	}
+
+	psTable->nColumns = nValueColumns + 2;
+	psTable->pasColumns = (BufferedWriter*) CPLCalloc(psTable->nColumns, 
+													sizeof(BufferedWriter));
+	nOffset = nHeaderSize;
+	InitBufferedWriter(&psTable->pasColumns[0], psTable->fp, nOffset, 65536);
+	nOffset += ALIGN8(nRows * sizeof(GUInt32));
+	InitBufferedWriter(&psTable->pasColumns[1], psTable->fp, nOffset, 65536);
+	nOffset += nRows * sizeof(GUIntBig);
+	for(i=0;i<nValueColumns;i++) {
+		InitBufferedWriter(&psTable->pasColumns[i+2], psTable->fp, nOffset, 65536);
+		nOffset += ALIGN8(nRows * (panTypes[i] == GDT_Int32 ? 
+									sizeof(GInt32) : sizeof(double)));
+	}
+	CPLFree(panTypes);
+	return TRUE;
+}
+
+/************************************************************************/
+/*                          CloseBinaryTable()                          */
+/************************************************************************/
+
+static int CloseBinaryTable(BinaryTable *psTable)
+{
+	int i, bOK = TRUE;
+
+	for(i=0;i<psTable->nColumns;i++)
+		bOK &= CloseBufferedWriter(&psTable->pasColumns[i]);
+	CPLFree(psTable->pasColumns);
+	return VSIFCloseL(psTable->fp) == 0 && bOK;
+}
+
+/************************************************************************/
+/*                          WriteCombination()                          */
+/*                                                                      */
+/*      Write one combination to the CSV and binary tables, either of   */
+/*      which may be NULL, with the statistics of the nStatFiles -stat  */
+/*      rasters (padfStats, NULL if none). pszRow is scratch space of   */
+/*      at least (nInputFiles + nStatFiles*STAT_FIELDS)*32 + 48 bytes.  */
+/************************************************************************/
+
+static void WriteCombination(BufferedWriter *psCSV, BinaryTable *psTable,
+							const InputRaster *psInputRasters, int nInputFiles,
+							int nStatFiles, GUInt32 nID, GUIntBig nCount, 
+							const GUInt32 *panKey, const double *padfStats,
+							char *pszRow)
+{
+	int i, j, nLen;
+	double adfColumns[STAT_FIELDS];
+
+	if(psCSV != NULL) {
+		nLen = sprintf(pszRow, "%u," CPL_FRMT_GUIB ",", nID, nCount);
+		FormatCombinationKey(psInputRasters, nInputFiles, panKey, pszRow + nLen);
+		nLen += strlen(pszRow + nLen);
+		for(i=0;i<nStatFiles;i++) {
+			GetStatColumns(padfStats + i * STAT_FIELDS, adfColumns);
+			for(j=0;j<STAT_FIELDS;j++) {
+				pszRow[nLen++] = ',';
+				nLen += FormatDouble(pszRow + nLen, adfColumns[j]);
+			}
+		}
+		pszRow[nLen++] = '\n';
+		WriteBuffered(psCSV, pszRow, nLen);
+	}
+
+	if(psTable != NULL) {
+		WriteBuffered(&psTable->pasColumns[0], &nID, sizeof(GUInt32));
+		WriteBuffered(&psTable->pasColumns[1], &nCount, sizeof(GUIntBig));
+		for(i=0;i<nInputFiles;i++) {
+			if(psInputRasters[i].bIsIntDataType) {
+				GInt32 nValue = (GInt32) panKey[psInputRasters[i].nKeyOffset];
+				WriteBuffered(&psTable->pasColumns[i+2], &nValue, sizeof(GInt32));
+			}
+			else {
+				double dfValue = GetKeyValue(&psInputRasters[i], panKey);
+				WriteBuffered(&psTable->pasColumns[i+2], &dfValue, sizeof(double));
+			}
+		}
+		for(i=0;i<nStatFiles;i++) {
+			GetStatColumns(padfStats + i * STAT_FIELDS, adfColumns);
+			for(j=0;j<STAT_FIELDS;j++)
+				WriteBuffered(&psTable->pasColumns[2 + nInputFiles + i * STAT_FIELDS + j],
+							&adfColumns[j], sizeof(double));
+		}
+	}
+}
+
+typedef struct {
+	BufferedWriter *psCSV;
+	BinaryTable *psTable;
+	const InputRaster *psInputRasters;
+	int nInputFiles;
+	int nStatFiles;
+	unsigned int nInitID;
+	char *pszRow;
+} TableWriteContext;
+
+/************************************************************************/
+/*                          WriteTableEntry()                           */
+/*                                                                      */
+/*      CombineEngine::ForEach() callback writing one combination.      */
+/************************************************************************/
+
+static int WriteTableEntry(size_t iEntry, GUIntBig nCount, const GUInt32 *panKey,
+							const double *padfStats, void *pData)
+{
+	TableWriteContext *psContext = (TableWriteContext*) pData;
+
+	WriteCombination(psContext->psCSV, psContext->psTable, psContext->psInputRasters,
+					psContext->nInputFiles, psContext->nStatFiles, 
+					psContext->nInitID + (unsigned int) iEntry, nCount, panKey, 
+					padfStats, psContext->pszRow);
+	return TRUE;
+}
+
+/************************************************************************/
+/* ==================================================================== */
+/*      Combination dictionary.                                         */
+/*                                                                      */
+/*      With -dict, the combinations and their IDs are kept in a file   */
+/*      from one run to the next, so that tiles of the same layer stack */
+/*      or later runs with more pixels get the same IDs for the same    */
+/*      combinations, and new ones are numbered after the last one.     */
+/*      The file holds the key arena and the hash index of the table    */
+/*      as they are in memory, so loading it is a file mapping (or a    */
+/*      single read where mapping is not available) and no key is       */
+/*      rehashed:                                                       */
+/*                                                                      */
+/*        char[8]   "GDCMBDC1"                                          */
+/*        GUInt32   number of inputs                                    */
+/*        GUInt32   number of key slots                                 */
+/*        GUInt32   ID of the first combination                         */
+/*        GUInt32   0                                                   */
+/*        GUIntBig  number of combinations                              */
+/*        GUIntBig  number of hash slots (0 or a power of two)          */
+/*        for each input, the number of its key slots (GUInt32), 0      */
+/*        (GUInt32) and its -quant step (double, 0 if exact)            */
+/*        keys      GUInt32 x key slots per combination, padded         */
+/*        slots     GUInt32 entry index + 1 (0 if empty) per hash slot  */
+/*        hashes    GUInt32 key hash per hash slot                      */
+/*                                                                      */
+/*      Numbers are in the byte order of the machine writing the file.  */
+/*      The file is rewritten at the end of a run.                      */
+/* ==================================================================== */
+/************************************************************************/
+
+#define DICTIONARY_MAGIC "GDCMBDC1"
+
+typedef struct {
+	VSILFILE *fp;
+	CPLVirtualMem *psMap;		/* file mapping, or NULL */
+	GByte *pabyData;			/* file contents read instead of mapped */
+	int bLoaded;				/* FALSE if the file did not exist */
+	size_t nLoaded;				/* number of combinations loaded */
+	unsigned int nInitID;
+} CombinationDictionary;
+
+/************************************************************************/
+/*                          CloseDictionary()                           */
+/*                                                                      */
+/*      Release a loaded dictionary, once the table using it is gone,   */
+/*      or the file of a dictionary that failed to load.                */
+/************************************************************************/
+
+static void CloseDictionary(CombinationDictionary *psDict)
+{
+	if(psDict->psMap != NULL)
+		CPLVirtualMemFree(psDict->psMap);
+	CPLFree(psDict->pabyData);
+	if(psDict->fp != NULL)
+		VSIFCloseL(psDict->fp);
+	memset(psDict, 0, sizeof(CombinationDictionary));
+}
+
+/************************************************************************/
+/*                           LoadDictionary()                           */
+/*                                                                      */
+/*      Attach the combinations of a dictionary file to an empty        */
+/*      table. A missing file is not an error (bLoaded is FALSE).       */
+/*      Returns FALSE if the file is invalid or was made with other     */
+/*      inputs.                                                         */
+/************************************************************************/
+
+static int LoadDictionary(CombinationDictionary *psDict, const char *pszFilename,
+						const InputRaster *psInputRasters, int nInputFiles,
+						int nKeyWords, CombinationTable *poTable)
+{
+	VSIStatBufL sStat;
+	GByte abyHeader[40];
+	GUInt32 anHeader[5];
+	GUIntBig nEntries, nSlots;
+	vsi_l_offset nKeysOffset, nSlotsOffset, nFileSize;
+	GByte *pabyBase;
+	int i, bMatch;
+
+	memset(psDict, 0, sizeof(CombinationDictionary));
+	if(VSIStatL(pszFilename, &sStat) != 0)
+		return TRUE;
+
+	psDict->fp = VSIFOpenL(pszFilename, "rb");
+	if(psDict->fp == NULL || VSIFReadL(abyHeader, 40, 1, psDict->fp) != 1 ||
+		memcmp(abyHeader, DICTIONARY_MAGIC, 8) != 0) {
+		CPLError(CE_Failure, CPLE_AppDefined, 
+				"%s is not a gdal_combine dictionary", pszFilename);
+		CloseDictionary(psDict);
+		return FALSE;
+	}
+	memcpy(anHeader, abyHeader + 8, 4 * sizeof(GUInt32));
+	memcpy(&nEntries, abyHeader + 24, sizeof(GUIntBig));
+	memcpy(&nSlots, abyHeader + 32, sizeof(GUIntBig));
+
+	bMatch = (anHeader[0] == (GUInt32) nInputFiles && 
+				anHeader[1] == (GUInt32) nKeyWords);
+	for(i=0;i<nInputFiles && bMatch;i++) {
+		GByte abyInput[16];
+		GUInt32 nWords;
+		double dfStep;
+		bMatch = VSIFReadL(abyInput, 16, 1, psDict->fp) == 1;
+		memcpy(&nWords, abyInput, sizeof(GUInt32));
+		memcpy(&dfStep, abyInput + 8, sizeof(double));
+		bMatch &= nWords == (GUInt32) psInputRasters[i].nKeyWords &&
+					dfStep == psInputRasters[i].dfQuantStep;
+	}
+	if(!bMatch) {
+		CPLError(CE_Failure, CPLE_AppDefined, 
+				"The dictionary %s was made with other inputs", pszFilename);
+		CloseDictionary(psDict);
+		return FALSE;
+	}
+
+	nKeysOffset = 40 + nInputFiles * 16;
+	nSlotsOffset = ALIGN8(nKeysOffset + nEntries * nKeyWords * sizeof(GUInt32));
+	nFileSize = nSlotsOffset + nSlots * 2 * sizeof(GUInt32);
+	if((vsi_l_offset) sStat.st_size != nFileSize || nEntries >= 0xFFFFFFFEU ||
+		(nSlots & (nSlots - 1)) != 0 || (nSlots != 0 && nSlots * 2 < nEntries * 3) ||
+		nFileSize != (size_t) nFileSize) {
+		CPLError(CE_Failure, CPLE_AppDefined, 
+				"The dictionary %s is corrupt", pszFilename);
+		CloseDictionary(psDict);
+		return FALSE;
+	}
+
+	//map the file if possible, otherwise read it whole
+	if(CPLIsVirtualMemFileMapAvailable())
+		psDict->psMap = CPLVirtualMemFileMapNew(psDict->fp, 0, nFileSize, 
+												VIRTUALMEM_READONLY, NULL, NULL);
+	if(psDict->psMap != NULL) {
+		pabyBase = (GByte*) CPLVirtualMemGetAddr(psDict->psMap);
+	}
+	else {
+		psDict->pabyData = (GByte*) VSIMalloc((size_t) nFileSize);
+		if(psDict->pabyData == NULL || VSIFSeekL(psDict->fp, 0, SEEK_SET) != 0 ||
+			VSIFReadL(psDict->pabyData, 1, (size_t) nFileSize, psDict->fp) != nFileSize) {
+			CPLError(CE_Failure, CPLE_FileIO, "Could not read %s", pszFilename);
+			CloseDictionary(psDict);
+			return FALSE;
+		}
+		pabyBase = psDict->pabyData;
+	}
+
+	if(!poTable->AttachIndex((GUInt32*) (pabyBase + nKeysOffset), (size_t) nEntries,
+							(GUInt32*) (pabyBase + nSlotsOffset),
+							(GUInt32*) (pabyBase + nSlotsOffset) + nSlots,
+							(size_t) nSlots)) {
+		CPLError(CE_Failure, CPLE_OutOfMemory, "Could not load %s", pszFilename);
+		CloseDictionary(psDict);
+		return FALSE;
+	}
+
+	psDict->bLoaded = TRUE;
+	psDict->nLoaded = (size_t) nEntries;
+	psDict->nInitID = anHeader[2];
+	return TRUE;
+}
+
+/************************************************************************/
+/*                           SaveDictionary()                           */
+/*                                                                      */
+/*      Write the combinations of the table to a dictionary file.       */
+/************************************************************************/
+
+static int SaveDictionary(const char *pszFilename, 
+						const InputRaster *psInputRasters, int nInputFiles,
+						unsigned int nInitID, CombinationTable *poTable)
+{
+	static const GByte abyPad[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+	const GUInt32 *panSlotEntry, *panSlotHash;
+	size_t nSlots, nKeyBytes;
+	GUInt32 anHeader[4];
+	GUIntBig nValue;
+	VSILFILE *fp;
+	int i, bOK;
+
+	if(!poTable->GetHashIndex(&panSlotEntry, &panSlotHash, &nSlots))
+		return FALSE;
+
+	fp = VSIFOpenL(pszFilename, "wb");
+	if(fp == NULL)
+		return FALSE;
+
+	anHeader[0] = (GUInt32) nInputFiles;
+	anHeader[1] = (GUInt32) poTable->nKeyWords;
+	anHeader[2] = nInitID;
+	anHeader[3] = 0;
+	bOK = VSIFWriteL(DICTIONARY_MAGIC, 8, 1, fp) == 1 &&
+			VSIFWriteL(anHeader, sizeof(GUInt32), 4, fp) == 4;
+	nValue = poTable->nEntries;
+	bOK &= VSIFWriteL(&nValue, sizeof(GUIntBig), 1, fp) == 1;
+	nValue = nSlots;
+	bOK &= VSIFWriteL(&nValue, sizeof(GUIntBig), 1, fp) == 1;
+	for(i=0;i<nInputFiles && bOK;i++) {
+		GUInt32 anWords[2];
+		anWords[0] = (GUInt32) psInputRasters[i].nKeyWords;
+		anWords[1] = 0;
+		bOK = VSIFWriteL(anWords, sizeof(GUInt32), 2, fp) == 2 &&
+				VSIFWriteL(&psInputRasters[i].dfQuantStep, sizeof(double), 1, fp) == 1;
+	}
+
+	nKeyBytes = poTable->nEntries * poTable->nKeyWords * sizeof(GUInt32);
+	if(nKeyBytes > 0)
+		bOK &= VSIFWriteL(poTable->panKeys, 1, nKeyBytes, fp) == nKeyBytes;
+	if(nKeyBytes % 8 != 0)
+		bOK &= VSIFWriteL(abyPad, 4, 1, fp) == 1;
+	if(nSlots > 0) {
+		bOK &= VSIFWriteL(panSlotEntry, sizeof(GUInt32), nSlots, fp) == nSlots;
+		bOK &= VSIFWriteL(panSlotHash, sizeof(GUInt32), nSlots, fp) == nSlots;
+	}
+
+	bOK &= VSIFCloseL(fp) == 0;
+	return bOK;
+}
+
+/************************************************************************/
+/*                           ReadWindowMask()                           */
+/*                                                                      */
+/*      Set the window mask of a -skip_nodata input to 0 outside of     */
+/*      the input and where its mask band is 0, as far as that can be   */
+/*      known without reading its values. *pbEmpty is set to TRUE if    */
+/*      no pixel of the window is valid: then the window needs no more  */
+/*      reading, as it is skipped whole.                                */
+/************************************************************************/
+
+static CPLErr ReadWindowMask(InputRaster *psInput, 
+							int nXOff, int nYOff, int nXSize, int nYSize, int *pbEmpty)
+{
+	CPLErr eErr = CE_None;
+	size_t iPixel, nPixels = (size_t) nXSize * nYSize;
+	int iY, nX0, nY0, nX1, nY1;
+	GByte *pabyRow;
+
+	nX0 = MAX(nXOff, psInput->nXOff);
+	nY0 = MAX(nYOff, psInput->nYOff);
+	nX1 = MIN(nXOff + nXSize, psInput->nXOff + psInput->nXSize);
+	nY1 = MIN(nYOff + nYSize, psInput->nYOff + psInput->nYSize);
+
+	memset(psInput->pabyMask, 0, nPixels);
+	*pbEmpty = (nX0 >= nX1 || nY0 >= nY1);
+	if(*pbEmpty)
+		return CE_None;
+	for(iY=nY0;iY<nY1;iY++) {
+		pabyRow = psInput->pabyMask + (size_t) (iY - nYOff) * nXSize + (nX0 - nXOff);
+		memset(pabyRow, 255, nX1 - nX0);
+	}
+	if(psInput->nMaskFlags == GMF_ALL_VALID)
+		return CE_None;
+
+#if GDAL_VERSION_NUM >= 2020000
+	//sparse or empty blocks can be known from the format alone
+	if(GDALGetDataCoverageStatus(psInput->hBand, nX0 - psInput->nXOff, 
+			nY0 - psInput->nYOff, nX1 - nX0, nY1 - nY0, 0, NULL) == 
+		GDAL_DATA_COVERAGE_STATUS_EMPTY) {
+		*pbEmpty = TRUE;
+		return CE_None;
+	}
+#endif
+
+	//nodata values are found once the values are read, other masks are
+	//read first as they are smaller
+	if(psInput->nMaskFlags == GMF_NODATA)
+		return CE_None;
+
+	eErr = GDALRasterIO(GDALGetMaskBand(psInput->hBand), GF_Read, 
+				nX0 - psInput->nXOff, nY0 - psInput->nYOff, nX1 - nX0, nY1 - nY0, 
+				psInput->pabyMask + (size_t) (nY0 - nYOff) * nXSize + (nX0 - nXOff), 
+				nX1 - nX0, nY1 - nY0, GDT_Byte, 0, nXSize);
+	for(iPixel=0;iPixel<nPixels && psInput->pabyMask[iPixel] == 0;iPixel++) {}
+	*pbEmpty = (iPixel == nPixels);
+	return eErr;
+}
+
+/************************************************************************/
+/*                           MaskNodataValues()                         */
+/*                                                                      */
+/*      Clear the window mask of a -skip_nodata input where its values  */
+/*      are nodata.                                                     */
+/************************************************************************/
+
+static void MaskNodataValues(InputRaster *psInput, size_t nPixels)
+{
+	size_t iPixel;
+
+	if(psInput->bIsIntDataType) {
+		int nNoData = (int) psInput->dfNoData;
+		if(psInput->dfNoData != (double) nNoData)
+			return;
+		for(iPixel=0;iPixel<nPixels;iPixel++) {
+			if(psInput->panValues[iPixel] == nNoData)
+				psInput->pabyMask[iPixel] = 0;
+		}
+	}
+	else if(CPLIsNan(psInput->dfNoData)) {
+		for(iPixel=0;iPixel<nPixels;iPixel++) {
+			if(CPLIsNan(psInput->padfValues[iPixel]))
+				psInput->pabyMask[iPixel] = 0;
+		}
+	}
+	else {
+		for(iPixel=0;iPixel<nPixels;iPixel++) {
+			if(psInput->padfValues[iPixel] == psInput->dfNoData)
+				psInput->pabyMask[iPixel] = 0;
+		}
+	}
+}
+
+/************************************************************************/
+/*                             ReadWindow()                             */
+/*                                                                      */
+/*      Read a window of the grid from every input into its window      */
+/*      buffer. Only the part of the window overlapping an input is     */
+/*      read, with one RasterIO call, and the rest is set to its fill   */
+/*      value.                                                          */
+/************************************************************************/
+
+static CPLErr ReadWindow(InputRaster *psInputRasters, int nInputFiles,
+						int nXOff, int nYOff, int nXSize, int nYSize)
+{
+	CPLErr eErr = CE_None;
+	size_t iPixel, nPixels = (size_t) nXSize * nYSize, nBufOff;
+	int i, nX0, nY0, nX1, nY1, bEmpty = FALSE;
+
+	//with -skip_nodata, a window where one of the inputs deciding has no
+	//valid pixel is not read at all
+	for(i=0;i<nInputFiles && eErr == CE_None && !bEmpty;i++) {
+		if(psInputRasters[i].bSkipNodata)
+			eErr = ReadWindowMask(&psInputRasters[i], nXOff, nYOff, nXSize, nYSize, 
+								&bEmpty);
+	}
+	if(bEmpty) {
+		for(i=0;i<nInputFiles;i++) {
+			if(psInputRasters[i].bSkipNodata)
+				memset(psInputRasters[i].pabyMask, 0, nPixels);
+		}
+	}
+
+	for(i=0;i<nInputFiles && eErr == CE_None && !bEmpty;i++) {
+		InputRaster *psInput = &psInputRasters[i];
+
+		nX0 = MAX(nXOff, psInput->nXOff);
+		nY0 = MAX(nYOff, psInput->nYOff);
+		nX1 = MIN(nXOff + nXSize, psInput->nXOff + psInput->nXSize);
+		nY1 = MIN(nYOff + nYSize, psInput->nYOff + psInput->nYSize);
+
+		if(nX0 > nXOff || nY0 > nYOff || nX1 < nXOff + nXSize || nY1 < nYOff + nYSize) {
+			for(iPixel=0;iPixel<nPixels;iPixel++) {
+				if(psInput->bIsIntDataType)
+					psInput->panValues[iPixel] = (int) psInput->dfFillValue;
+				else
+					psInput->padfValues[iPixel] = psInput->dfFillValue;
+			}
+		}
+		if(nX0 >= nX1 || nY0 >= nY1)
+			continue;
+
+		nBufOff = (size_t) (nY0 - nYOff) * nXSize + (nX0 - nXOff);
+		if(psInput->bIsIntDataType) {
+			eErr = GDALRasterIO(psInput->hBand, GF_Read, 
+				nX0 - psInput->nXOff, nY0 - psInput->nYOff, nX1 - nX0, nY1 - nY0, 
+				psInput->panValues + nBufOff, nX1 - nX0, nY1 - nY0, 
+				GDT_Int32, 0, nXSize * sizeof(int));
+		}
+		else {
+			eErr = GDALRasterIO(psInput->hBand, GF_Read, 
+				nX0 - psInput->nXOff, nY0 - psInput->nYOff, nX1 - nX0, nY1 - nY0, 
+				psInput->padfValues + nBufOff, nX1 - nX0, nY1 - nY0, 
+				GDT_Float64, 0, nXSize * sizeof(double));
+		}
+		if(eErr == CE_None && psInput->bSkipNodata && psInput->nMaskFlags == GMF_NODATA)
+			MaskNodataValues(psInput, nPixels);
+		if(eErr == CE_None && psInput->bIsStat && psInput->bHasNoData) {
+			for(iPixel=0;iPixel<nPixels;iPixel++) {
+				if(psInput->padfValues[iPixel] == psInput->dfNoData)
+					psInput->padfValues[iPixel] = CPLAtof("nan");
+			}
+		}
+	}
+	return eErr;
+}
+
+/************************************************************************/
+/*                           SameInputValues()                          */
+/************************************************************************/
+
+static inline int SameInputValues(const InputRaster *psInputRasters, int nInputFiles,
+								size_t iPixel, size_t iOther)
+{
+	int i;
+
+	for(i=0;i<nInputFiles;i++) {
+		if(psInputRasters[i].bIsStat)
+			continue;
+		if(psInputRasters[i].bIsIntDataType) {
+			if(psInputRasters[i].panValues[iPixel] != psInputRasters[i].panValues[iOther])
+				return FALSE;
+		}
+		else if(psInputRasters[i].padfValues[iPixel] != psInputRasters[i].padfValues[iOther])
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/************************************************************************/
+/*                           IsSkippedPixel()                           */
+/************************************************************************/
+
+static inline int IsSkippedPixel(const InputRaster *psInputRasters, int nInputFiles,
+								size_t iPixel)
+{
+	int i;
+
+	for(i=0;i<nInputFiles;i++) {
+		if(psInputRasters[i].pabyMask != NULL && psInputRasters[i].pabyMask[iPixel] == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/************************************************************************/
+/*                             CountWindow()                            */
+/*                                                                      */
+/*      Count the combinations of a window already read into the        */
+/*      window buffers in poTable. The table entry index of each pixel  */
+/*      is stored in panIds.                                            */
+/*                                                                      */
+/*      Thematic inputs have long runs of identical values, so a pixel  */
+/*      whose input values all equal those of its left neighbour, or    */
+/*      else of the pixel above it, reuses that pixel's entry without   */
+/*      building a key or looking it up. Counts are added once per run  */
+/*      of pixels sharing an entry.                                     */
+/*                                                                      */
+/*      Pixels masked out for -skip_nodata get SKIPPED_PIXEL and are    */
+/*      not counted. The values of -stat rasters are aggregated per     */
+/*      pixel.                                                          */
+/************************************************************************/
+
+static void CountWindow(const InputRaster *psInputRasters, int nInputFiles,
+						int nXSize, int nYSize, CombinationTable *poTable, 
+						GUInt32 *panKey, GUInt32 *panIds, CountStats *psStats)
+{
+	size_t iPixel, nPixels = (size_t) nXSize * nYSize;
+	size_t iEntry, iRunEntry = 0;
+	GUIntBig nRunCount = 0;
+	int iX = 0, bSkip = FALSE, i;
+
+	for(i=0;i<nInputFiles;i++)
+		bSkip |= psInputRasters[i].bSkipNodata;
+
+	for(iPixel=0;iPixel<nPixels;iPixel++) {
+		if(bSkip && IsSkippedPixel(psInputRasters, nInputFiles, iPixel)) {
+			iEntry = SKIPPED_PIXEL;
+			psStats->nSkipped++;
+		}
+		else if(iX > 0 && panIds[iPixel-1] != SKIPPED_PIXEL &&
+				SameInputValues(psInputRasters, nInputFiles, iPixel, iPixel-1)) {
+			iEntry = panIds[iPixel-1];
+			psStats->nLeftHits++;
+		}
+		else if(iPixel >= (size_t) nXSize && panIds[iPixel-nXSize] != SKIPPED_PIXEL &&
+				SameInputValues(psInputRasters, nInputFiles, iPixel, iPixel-nXSize)) {
+			iEntry = panIds[iPixel-nXSize];
+			psStats->nAboveHits++;
+		}
+		else {
+			BuildCombinationKey(psInputRasters, nInputFiles, iPixel, panKey);
+			if(poTable->Add(panKey, 0, &iEntry) < 0) {
+				CPLError(CE_Fatal, CPLE_OutOfMemory,
+						"Out of memory. "
+						"Can't allocate enough memory to hold all unique combinations, "
+						"try -max_mem\n");
+			}
+			psStats->nLookups++;
+		}
+		panIds[iPixel] = (GUInt32) iEntry;
+
+		if(nRunCount > 0 && iEntry != iRunEntry) {
+			poTable->panCounts[iRunEntry] += nRunCount;
+			nRunCount = 0;
+		}
+		iRunEntry = iEntry;
+		if(iEntry != SKIPPED_PIXEL)
+			nRunCount++;
+
+		if(poTable->nStats > 0 && iEntry != SKIPPED_PIXEL) {
+			int iStat = 0;
+			for(i=0;i<nInputFiles;i++) {
+				if(psInputRasters[i].bIsStat)
+					poTable->AddStatValue(iEntry, iStat++, psInputRasters[i].padfValues[iPixel]);
+			}
+		}
+
+		if(++iX == nXSize)
+			iX = 0;
+	}
+	if(nRunCount > 0)
+		poTable->panCounts[iRunEntry] += nRunCount;
+}
+
+/************************************************************************/
+/*                            SetWindowIds()                            */
+/*                                                                      */
+/*      Turn the table entry indices of a counted window into IDs by    */
+/*      mapping them through panRemap if not NULL, then adding nIdBase. */
+/*      Skipped pixels get ID 0.                                        */
+/************************************************************************/
+
+static void SetWindowIds(GUInt32 *panIds, size_t nPixels, GUInt32 nIdBase, 
+						const GUInt32 *panRemap)
+{
+	size_t iPixel;
+
+	for(iPixel=0;iPixel<nPixels;iPixel++) {
+		if(panIds[iPixel] == SKIPPED_PIXEL)
+			panIds[iPixel] = 0;
+		else if(panRemap != NULL)
+			panIds[iPixel] = nIdBase + panRemap[panIds[iPixel]];
+		else
+			panIds[iPixel] += nIdBase;
+	}
+}
+
+/************************************************************************/
+/* ==================================================================== */
+/*                            CombineEngine                             */
+/*                                                                      */
+/*      Counts the combinations of blocks of input values that are      */
+/*      already in memory, wherever they come from: the windows read    */
+/*      by this program, or the blocks of a MEM dataset or of another   */
+/*      processing stage. Blocks are counted in the order they are      */
+/*      added, which is the order of the combination IDs.               */
+/*                                                                      */
+/*      The inputs are described by InputRaster records of which only   */
+/*      bIsIntDataType, bIsStat, dfQuantStep, bSkipNodata and the key   */
+/*      layout (SetKeyLayout()) are used. The values of an input are    */
+/*      passed as int for integer inputs and as double otherwise, -stat */
+/*      rasters included.                                               */
+/*                                                                      */
+/*      Engines that counted separate blocks, e.g. on other threads,    */
+/*      are combined with Merge(), and ForEach() walks the result in    */
+/*      ID order. The table is public for the dictionary, the dense     */
+/*      index and spilling.                                             */
+/* ==================================================================== */
+/************************************************************************/
+
+/* values of one input over a block of pixels, in row-major order */
+typedef struct {
+    const int       *panValues;     /* integer inputs */
+    const double    *padfValues;    /* floating point and -stat inputs */
+    const GByte     *pabyMask;      /* 0 to skip a pixel, for inputs with */
+                                    /* bSkipNodata, or NULL */
+} CombineBlockInput;
+
+/* receives the combinations of an engine in ID order: the entry index */
+/* (ID - first ID), the pixel count, the key and the -stat statistics  */
+/* (NULL if none); returns FALSE to stop                               */
+typedef int (*CombineResultFunc)( size_t iEntry, GUIntBig nCount,
+                                  const GUInt32 *panKey,
+                                  const double *padfStats, void *pData );
+
+class CombineEngine {
+public:
+    CombineEngine( const InputRaster *psInputs, int nInputs );
+    ~CombineEngine();
+
+    CombinationTable *poTable;
+    CountStats       sStats;
+
+    void             AddBlock( const CombineBlockInput *pasValues,
+                               int nXSize, int nYSize, GUInt32 *panEntries );
+    int              Merge( const CombineEngine *poOther, GUInt32 *panRemap );
+    int              ForEach( CombineResultFunc pfnResult, void *pData ) const;
+    double           GetValue( const GUInt32 *panKey, int iInput ) const
+                        { return GetKeyValue( pasInputs + iInput, panKey ); }
+    void             Reset();
+
+private:
+    InputRaster     *pasInputs;     /* layout copies, buffers lent per block */
+    int              nInputs;
+    GUInt32         *panKey;
+    GUInt32         *panScratch;    /* entries of a block if not wanted back */
+    size_t           nScratchAlloc;
+};
+
+/************************************************************************/
+/*                           CombineEngine()                            */
+/************************************************************************/
+
+CombineEngine::CombineEngine( const InputRaster *psInputs, int nInputs )
+
+{
+    int i, nKeyWords = 0, nStats = 0;
+
+    this->nInputs = nInputs;
+    pasInputs = (InputRaster *) CPLMalloc( nInputs * sizeof(InputRaster) );
+    for( i = 0; i < nInputs; i++ )
+    {
+        pasInputs[i] = psInputs[i];
+        pasInputs[i].hDS = NULL;
+        pasInputs[i].hBand = NULL;
+        pasInputs[i].panValues = NULL;
+        pasInputs[i].padfValues = NULL;
+        pasInputs[i].pabyMask = NULL;
+        nKeyWords += pasInputs[i].nKeyWords;
+        if( pasInputs[i].bIsStat )
+            nStats++;
+    }
+
+    poTable = new CombinationTable( nKeyWords, nStats );
+    memset( &sStats, 0, sizeof(sStats) );
+    panKey = (GUInt32 *) CPLMalloc( MAX(nKeyWords, 1) * sizeof(GUInt32) );
+    panScratch = NULL;
+    nScratchAlloc = 0;
+}
+
+/************************************************************************/
+/*                           ~CombineEngine()                           */
+/************************************************************************/
+
+CombineEngine::~CombineEngine()
+
+{
+    delete poTable;
+    CPLFree( pasInputs );
+    CPLFree( panKey );
+    CPLFree( panScratch );
+}
+
+/************************************************************************/
+/*                              AddBlock()                              */
+/*                                                                      */
+/*      Count a block of nXSize x nYSize pixels. The table entry index  */
+/*      of each pixel, or SKIPPED_PIXEL, is stored in panEntries if it  */
+/*      is not NULL.                                                    */
+/************************************************************************/
+
+void CombineEngine::AddBlock( const CombineBlockInput *pasValues,
+                              int nXSize, int nYSize, GUInt32 *panEntries )
+
+{
+    int i;
+
+    for( i = 0; i < nInputs; i++ )
+    {
+        pasInputs[i].panValues = (int *) pasValues[i].panValues;
+        pasInputs[i].padfValues = (double *) pasValues[i].padfValues;
+        pasInputs[i].pabyMask = pasInputs[i].bSkipNodata ?
+            (GByte *) pasValues[i].pabyMask : NULL;
+    }
+
+    // the entries of the block are needed for reusing neighbours
+    if( panEntries == NULL )
+    {
+        if( (size_t) nXSize * nYSize > nScratchAlloc )
+        {
+            nScratchAlloc = (size_t) nXSize * nYSize;
+            CPLFree( panScratch );
+            panScratch = (GUInt32 *) CPLMalloc( nScratchAlloc * sizeof(GUInt32) );
+        }
+        panEntries = panScratch;
+    }
+
+    CountWindow( pasInputs, nInputs, nXSize, nYSize, poTable, panKey,
+                 panEntries, &sStats );
+}
+
+/************************************************************************/
+/*                               Merge()                                */
+/*                                                                      */
+/*      Add the combinations counted by another engine over the same    */
+/*      inputs, in its ID order. If panRemap is not NULL it receives    */
+/*      the entry index in this engine of each entry of the other one.  */
+/*      Returns FALSE if out of memory.                                 */
+/************************************************************************/
+
+int CombineEngine::Merge( const CombineEngine *poOther, GUInt32 *panRemap )
+
+{
+    const CombinationTable *poFrom = poOther->poTable;
+    size_t iEntry, iMerged;
+
+    for( iEntry = 0; iEntry < poFrom->nEntries; iEntry++ )
+    {
+        if( poTable->Add( poFrom->GetKey(iEntry), poFrom->panCounts[iEntry],
+                          &iMerged ) < 0 )
+            return FALSE;
+        if( poTable->nStats > 0 )
+            poTable->MergeStats( iMerged, poFrom->GetStats(iEntry) );
+        if( panRemap != NULL )
+            panRemap[iEntry] = (GUInt32) iMerged;
+    }
+
+    sStats.nLeftHits += poOther->sStats.nLeftHits;
+    sStats.nAboveHits += poOther->sStats.nAboveHits;
+    sStats.nLookups += poOther->sStats.nLookups;
+    sStats.nSkipped += poOther->sStats.nSkipped;
+
+    return TRUE;
+}
+
+/************************************************************************/
+/*                              ForEach()                               */
+/*                                                                      */
+/*      Pass the combinations counted so far to pfnResult in ID order.  */
+/*      Combinations of a dictionary that have not been counted are     */
+/*      left out. Returns FALSE if pfnResult stopped the walk.          */
+/************************************************************************/
+
+int CombineEngine::ForEach( CombineResultFunc pfnResult, void *pData ) const
+
+{
+    size_t iEntry;
+
+    for( iEntry = 0; iEntry < poTable->nEntries; iEntry++ )
+    {
+        if( poTable->panCounts[iEntry] == 0 )
+            continue;
+        if( !pfnResult( iEntry, poTable->panCounts[iEntry],
+                        poTable->GetKey(iEntry),
+                        poTable->nStats > 0 ? poTable->GetStats(iEntry) : NULL,
+                        pData ) )
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/************************************************************************/
+/*                               Reset()                                */
+/*                                                                      */
+/*      Forget the combinations and counting statistics, keeping the    */
+/*      dense index if any.                                             */
+/************************************************************************/
+
+void CombineEngine::Reset()
+
+{
+    poTable->Reset();
+    memset( &sStats, 0, sizeof(sStats) );
+}
+
+/************************************************************************/
+/*                           GetWindowBlock()                           */
+/*                                                                      */
+/*      Point the block values of an engine at the window buffers of    */
+/*      the inputs.                                                     */
+/************************************************************************/
+
+static void GetWindowBlock(const InputRaster *psInputRasters, int nInputFiles,
+							CombineBlockInput *pasBlock)
+{
+	int i;
+
+	for(i=0;i<nInputFiles;i++) {
+		pasBlock[i].panValues = psInputRasters[i].panValues;
+		pasBlock[i].padfValues = psInputRasters[i].padfValues;
+		pasBlock[i].pabyMask = psInputRasters[i].pabyMask;
+	}
+}
+
+/************************************************************************/
+/* ==================================================================== */
+/*      Estimating the number of combinations.                          */
+/*                                                                      */
+/*      Before counting, a sample of the windows (every k-th one) is    */
+/*      read and the distinct combinations in it are estimated with a   */
+/*      HyperLogLog sketch of 2^HLL_BITS registers (about 0.8%          */
+/*      standard error), without storing any key. Combinations tend to  */
+/*      be spatially clustered, so this is an estimate of a lower bound */
+/*      on the number in the whole grid; extrapolating it to the grid   */
+/*      overshoots badly where combinations change region by region.    */
+/*      It is used to pre-size the table, to pick the -ot Auto type     */
+/*      early when it is clearly beyond UInt16, and to spill to disk    */
+/*      when even that many combinations would not fit in memory.       */
+/* ==================================================================== */
+/************************************************************************/
+
+#define HLL_BITS 14
+
+/************************************************************************/
+/*                             AddToSketch()                            */
+/************************************************************************/
+
+static inline void AddToSketch(GByte *pabyRegisters, GUIntBig nHash)
+{
+	size_t iRegister = (size_t) (nHash >> (64 - HLL_BITS));
+	GUIntBig nRest = nHash << HLL_BITS;
+	GByte nRank = 1;
+
+	//position of the first 1 bit in the remaining bits
+	while(nRank <= 64 - HLL_BITS && !(nRest & (((GUIntBig) 1) << 63))) {
+		nRest <<= 1;
+		nRank++;
+	}
+	if(nRank > pabyRegisters[iRegister])
+		pabyRegisters[iRegister] = nRank;
+}
+
+/************************************************************************/
+/*                          GetSketchEstimate()                         */
+/************************************************************************/
+
+static double GetSketchEstimate(const GByte *pabyRegisters)
+{
+	const int nRegisters = 1 << HLL_BITS;
+	double dfSum = 0.0, dfEstimate;
+	int i, nZeros = 0;
+
+	for(i=0;i<nRegisters;i++) {
+		dfSum += ldexp(1.0, -pabyRegisters[i]);
+		if(pabyRegisters[i] == 0)
+			nZeros++;
+	}
+	dfEstimate = 0.7213 / (1.0 + 1.079 / nRegisters) * nRegisters * nRegisters / dfSum;
+
+	//linear counting is more accurate while many registers are empty
+	if(dfEstimate <= 2.5 * nRegisters && nZeros > 0)
+		dfEstimate = nRegisters * log(nRegisters / (double) nZeros);
+	return dfEstimate;
+}
+
+/************************************************************************/
+/*                        EstimateCombinations()                        */
+/*                                                                      */
+/*      Estimate the number of combinations of the keyed inputs in a    */
+/*      sample of about dfSamplePct percent of the windows. Returns -1  */
+/*      if the grid has too few windows for such a sample or on error.  */
+/*      The inputs are read through their own window buffers.           */
+/************************************************************************/
+
+static double EstimateCombinations(const InputRaster *psInputRasters, int nInputFiles,
+									int nKeyWords, int nXSize, int nYSize, 
+									double dfSamplePct, size_t nBufferSize)
+{
+	InputRaster *pasInputs;
+	WindowLayout sLayout;
+	GByte *pabyRegisters;
+	GUInt32 *panKey;
+	double dfEstimate = -1.0;
+	size_t iPixel, nPixels;
+	int i, iWindow, nStride, nXOff, nYOff, nWinXSize, nWinYSize;
+	int bSkip = FALSE;
+	CPLErr eErr = CE_None;
+
+	ComputeWindowLayout(psInputRasters, nInputFiles, nXSize, nYSize, nBufferSize, &sLayout);
+	nStride = (int) (100.0 / dfSamplePct + 0.5);
+	if(nStride < 2 || sLayout.nWindows < nStride)
+		return -1.0;
+
+	pasInputs = (InputRaster*) CPLMalloc(nInputFiles * sizeof(InputRaster));
+	for(i=0;i<nInputFiles;i++) {
+		pasInputs[i] = psInputRasters[i];
+		pasInputs[i].panValues = NULL;
+		pasInputs[i].padfValues = NULL;
+		pasInputs[i].pabyMask = NULL;
+		bSkip |= pasInputs[i].bSkipNodata;
+	}
+	pabyRegisters = (GByte*) CPLCalloc(1, 1 << HLL_BITS);
+	panKey = (GUInt32*) CPLMalloc(MAX(nKeyWords, 1) * sizeof(GUInt32));
+
+	if(AllocateWindowBuffers(pasInputs, nInputFiles, 
+							(size_t) sLayout.nWinXSize * sLayout.nWinYSize)) {
+		//the middle window of each stride
+		for(iWindow=nStride/2;iWindow<sLayout.nWindows && eErr == CE_None;iWindow+=nStride) {
+			GetWindow(&sLayout, iWindow, &nXOff, &nYOff, &nWinXSize, &nWinYSize);
+			eErr = ReadWindow(pasInputs, nInputFiles, nXOff, nYOff, nWinXSize, nWinYSize);
+			nPixels = (size_t) nWinXSize * nWinYSize;
+			for(iPixel=0;iPixel<nPixels && eErr == CE_None;iPixel++) {
+				if(bSkip && IsSkippedPixel(pasInputs, nInputFiles, iPixel))
+					continue;
+				if(iPixel % nWinXSize > 0 && 
+					SameInputValues(pasInputs, nInputFiles, iPixel, iPixel-1))
+					continue;
+				BuildCombinationKey(pasInputs, nInputFiles, iPixel, panKey);
+				AddToSketch(pabyRegisters, HashCombinationKey64(panKey, nKeyWords));
+			}
+		}
+		if(eErr == CE_None)
+			dfEstimate = GetSketchEstimate(pabyRegisters);
+	}
+
+	for(i=0;i<nInputFiles;i++) {
+		CPLFree(pasInputs[i].panValues);
+		CPLFree(pasInputs[i].padfValues);
+		CPLFree(pasInputs[i].pabyMask);
+	}
+	CPLFree(pasInputs);
+	CPLFree(pabyRegisters);
+	CPLFree(panKey);
+	return dfEstimate;
+}
+
+/************************************************************************/
+/* ==================================================================== */
+/*      Overviews of the output raster (-ovr).                          */
+/*                                                                      */
+/*      The overview levels (2, 4, 8... until the smallest one fits a   */
+/*      256 x 256 tile) are created empty with the output raster and    */
+/*      filled as its IDs are written, so that it is never read back    */
+/*      as it would be by gdaladdo. NEAREST samples every level from    */
+/*      the rows of the output as they pass, taking the pixel under     */
+/*      the centre of each overview pixel as GDAL's nearest resampling  */
+/*      does. MODE takes the most common ID of the block of the output  */
+/*      under each overview pixel, 2^k x 2^k at a factor of 2^k and     */
+/*      clipped at the edges, as gdaladdo does (the first in row order  */
+/*      on ties, ignoring nodata 0). Since the blocks of each level     */
+/*      fall within those of the next, rows of the output are held      */
+/*      until a block row of the last level is complete, and every      */
+/*      level is reduced from them as its own block rows complete.      */
+/*      NEAREST only holds the last window of the output; both hold a   */
+/*      strip of rows per level.                                        */
+/* ==================================================================== */
+/************************************************************************/
+
+#define OVR_MIN_SIZE    256     /* largest dimension of the last level */
+#define OVR_STRIP_ROWS  64      /* rows of a level written at once */
+
+typedef struct {
+    GDALRasterBandH hBand;
+    int             nXSize;
+    int             nYSize;
+    int             nSrcRows;       /* NEAREST: rows of the output received */
+    int            *panSrcCols;     /* NEAREST: output column of each pixel */
+    GUInt32        *panStrip;       /* reduced rows not written yet */
+    int             nStripRows;
+    int             nStripYOff;
+} OverviewLevel;
+
+class OverviewBuilder {
+public:
+    OverviewBuilder( int nXSize, int nYSize, int bMode, int bNoDataZero );
+    ~OverviewBuilder();
+
+    int             nLevels;
+
+    int             CreateLevels( GDALDatasetH hDS );
+    CPLErr          AddWindow( int nWinYSize, const GUInt32 *panIds );
+    void            Reset();
+
+private:
+    int             nXSize;
+    int             nYSize;
+    int             bMode;
+    int             bNoDataZero;
+    OverviewLevel  *pasLevels;
+    GUInt32        *panBaseRows;    /* MODE: output rows of the block row
+                                       of the last level in progress */
+    int             nBaseRows;
+    int             nBaseRowsAlloc;
+    int             nRowsAdded;     /* MODE: rows of the output received */
+    GUInt32        *panBlockIds;    /* MODE: IDs of one block */
+
+    CPLErr          AddRow( const GUInt32 *panRow );
+    CPLErr          SampleRow( const GUInt32 *panRow );
+    CPLErr          EndStripRow( OverviewLevel *psLevel );
+    void            ReduceBlocks( const GUInt32 *panSrc, int nRows, int nFactor,
+                                  GUInt32 *panDst, int nDstXSize ) const;
+};
+
+/************************************************************************/
+/*                           NearestSrcOff()                            */
+/*                                                                      */
+/*      Row or column of the output under the centre of row or column   */
+/*      iDst of a level nDstSize long, as GDAL's nearest resampling     */
+/*      picks it.                                                       */
+/************************************************************************/
+
+static int NearestSrcOff( int iDst, int nDstSize, int nSrcSize )
+
+{
+    int nSrcOff = (int) ((iDst + 0.5) * nSrcSize / (double) nDstSize + 1e-8);
+
+    return MIN(nSrcOff, nSrcSize - 1);
+}
+
+/************************************************************************/
+/*                          OverviewBuilder()                           */
+/************************************************************************/
+
+OverviewBuilder::OverviewBuilder( int nXSize, int nYSize, int bMode,
+                                  int bNoDataZero )
+
+{
+    int i, j, nLevelXSize = nXSize, nLevelYSize = nYSize;
+
+    this->nXSize = nXSize;
+    this->nYSize = nYSize;
+    this->bMode = bMode;
+    this->bNoDataZero = bNoDataZero;
+    panBaseRows = NULL;
+    nBaseRows = 0;
+    nBaseRowsAlloc = 0;
+    nRowsAdded = 0;
+    panBlockIds = NULL;
+
+    nLevels = 0;
+    while( MAX(nLevelXSize, nLevelYSize) > OVR_MIN_SIZE )
+    {
+        nLevelXSize = (nLevelXSize + 1) / 2;
+        nLevelYSize = (nLevelYSize + 1) / 2;
+        nLevels++;
+    }
+
+    pasLevels = (OverviewLevel *) CPLCalloc( MAX(nLevels, 1), sizeof(OverviewLevel) );
+    nLevelXSize = nXSize;
+    nLevelYSize = nYSize;
+    for( i = 0; i < nLevels; i++ )
+    {
+        nLevelXSize = (nLevelXSize + 1) / 2;
+        nLevelYSize = (nLevelYSize + 1) / 2;
+        pasLevels[i].nXSize = nLevelXSize;
+        pasLevels[i].nYSize = nLevelYSize;
+        pasLevels[i].panStrip = (GUInt32 *)
+            CPLMalloc( OVR_STRIP_ROWS * (size_t) nLevelXSize * sizeof(GUInt32) );
+        if( !bMode )
+        {
+            pasLevels[i].panSrcCols = (int *)
+                CPLMalloc( nLevelXSize * sizeof(int) );
+            for( j = 0; j < nLevelXSize; j++ )
+                pasLevels[i].panSrcCols[j] =
+                    NearestSrcOff( j, nLevelXSize, nXSize );
+        }
+    }
+}
+
+/************************************************************************/
+/*                          ~OverviewBuilder()                          */
+/************************************************************************/
+
+OverviewBuilder::~OverviewBuilder()
+
+{
+    int i;
+
+    for( i = 0; i < nLevels; i++ )
+    {
+        CPLFree( pasLevels[i].panStrip );
+        CPLFree( pasLevels[i].panSrcCols );
+    }
+    CPLFree( pasLevels );
+    CPLFree( panBaseRows );
+    CPLFree( panBlockIds );
+}
+
+/************************************************************************/
+/*                            CreateLevels()                            */
+/*                                                                      */
+/*      Create the overview levels of band 1 of hDS, without computing  */
+/*      them, and for MODE allocate the rows of the output held.        */
+/*      Returns FALSE on failure.                                       */
+/************************************************************************/
+
+int OverviewBuilder::CreateLevels( GDALDatasetH hDS )
+
+{
+    GDALRasterBandH hBaseBand = GDALGetRasterBand( hDS, 1 ), hBand;
+    int *panFactors, i, j, nOverviews, nFactor;
+
+    if( nLevels == 0 )
+        return TRUE;
+
+    if( bMode )
+    {
+        nFactor = 1 << nLevels;
+        nBaseRowsAlloc = MIN(nFactor, nYSize);
+        panBaseRows = (GUInt32 *)
+            VSIMalloc3( nBaseRowsAlloc, nXSize, sizeof(GUInt32) );
+        panBlockIds = (GUInt32 *)
+            VSIMalloc3( nBaseRowsAlloc, MIN(nFactor, nXSize), sizeof(GUInt32) );
+        if( panBaseRows == NULL || panBlockIds == NULL )
+        {
+            CPLError( CE_Failure, CPLE_OutOfMemory,
+                      "Could not allocate %d rows of the output for MODE overviews",
+                      nBaseRowsAlloc );
+            return FALSE;
+        }
+    }
+
+    panFactors = (int *) CPLMalloc( nLevels * sizeof(int) );
+    for( i = 0; i < nLevels; i++ )
+        panFactors[i] = 2 << i;
+    if( GDALBuildOverviews( hDS, "NONE", nLevels, panFactors, 0, NULL,
+                            NULL, NULL ) != CE_None )
+    {
+        CPLFree( panFactors );
+        return FALSE;
+    }
+    CPLFree( panFactors );
+
+    // the levels are matched by size, drivers may order them otherwise
+    nOverviews = GDALGetOverviewCount( hBaseBand );
+    for( i = 0; i < nLevels; i++ )
+    {
+        for( j = 0; j < nOverviews; j++ )
+        {
+            hBand = GDALGetOverview( hBaseBand, j );
+            if( GDALGetRasterBandXSize( hBand ) == pasLevels[i].nXSize &&
+                GDALGetRasterBandYSize( hBand ) == pasLevels[i].nYSize )
+                pasLevels[i].hBand = hBand;
+        }
+        if( pasLevels[i].hBand == NULL )
+        {
+            CPLError( CE_Failure, CPLE_AppDefined,
+                      "Overview of %d x %d not found after creating it",
+                      pasLevels[i].nXSize, pasLevels[i].nYSize );
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/************************************************************************/
+/*                             AddWindow()                              */
+/*                                                                      */
+/*      Add the final IDs of the next window of the output raster, a    */
+/*      full-width strip of nWinYSize rows.                             */
+/************************************************************************/
+
+CPLErr OverviewBuilder::AddWindow( int nWinYSize, const GUInt32 *panIds )
+
+{
+    CPLErr eErr = CE_None;
+    int j;
+
+    for( j = 0; j < nWinYSize && eErr == CE_None && nLevels > 0; j++ )
+    {
+        if( bMode )
+            eErr = AddRow( panIds + (size_t) j * nXSize );
+        else
+            eErr = SampleRow( panIds + (size_t) j * nXSize );
+    }
+    return eErr;
+}
+
+/************************************************************************/
+/*                               AddRow()                               */
+/*                                                                      */
+/*      Add the next row of the output for MODE, reducing and writing   */
+/*      a row of every level whose block row it completes.              */
+/************************************************************************/
+
+CPLErr OverviewBuilder::AddRow( const GUInt32 *panRow )
+
+{
+    OverviewLevel *psLevel;
+    CPLErr eErr = CE_None;
+    int i, nFactor, nRows;
+
+    memcpy( panBaseRows + (size_t) nBaseRows * nXSize, panRow,
+            nXSize * sizeof(GUInt32) );
+    nBaseRows++;
+    nRowsAdded++;
+
+    for( i = 0; i < nLevels && eErr == CE_None; i++ )
+    {
+        psLevel = pasLevels + i;
+        nFactor = 2 << i;
+        nRows = nBaseRows % nFactor;
+        if( nRows == 0 )
+            nRows = nFactor;
+        else if( nRowsAdded < nYSize )
+            continue;
+
+        // the block row is the last nRows rows held
+        ReduceBlocks( panBaseRows + (size_t) (nBaseRows - nRows) * nXSize,
+                      nRows, nFactor,
+                      psLevel->panStrip + (size_t) psLevel->nStripRows * psLevel->nXSize,
+                      psLevel->nXSize );
+        eErr = EndStripRow( psLevel );
+    }
+
+    if( nBaseRows == nBaseRowsAlloc )
+        nBaseRows = 0;
+    return eErr;
+}
+
+/************************************************************************/
+/*                             SampleRow()                              */
+/*                                                                      */
+/*      Add the next row of the output for NEAREST, sampling the rows   */
+/*      of every level that fall on it.                                 */
+/************************************************************************/
+
+CPLErr OverviewBuilder::SampleRow( const GUInt32 *panRow )
+
+{
+    OverviewLevel *psLevel;
+    GUInt32 *panDst;
+    CPLErr eErr = CE_None;
+    int i, iDstRow, j;
+
+    for( i = 0; i < nLevels && eErr == CE_None; i++ )
+    {
+        psLevel = pasLevels + i;
+        iDstRow = psLevel->nStripYOff + psLevel->nStripRows;
+        while( eErr == CE_None && iDstRow < psLevel->nYSize &&
+               NearestSrcOff( iDstRow, psLevel->nYSize, nYSize ) == psLevel->nSrcRows )
+        {
+            panDst = psLevel->panStrip + (size_t) psLevel->nStripRows * psLevel->nXSize;
+            for( j = 0; j < psLevel->nXSize; j++ )
+                panDst[j] = panRow[psLevel->panSrcCols[j]];
+            eErr = EndStripRow( psLevel );
+            iDstRow++;
+        }
+        psLevel->nSrcRows++;
+    }
+    return eErr;
+}
+
+/************************************************************************/
+/*                            EndStripRow()                             */
+/*                                                                      */
+/*      Count the row just filled in the strip of psLevel, writing the  */
+/*      strip once it is full or holds the last row of the level.       */
+/************************************************************************/
+
+CPLErr OverviewBuilder::EndStripRow( OverviewLevel *psLevel )
+
+{
+    CPLErr eErr = CE_None;
+
+    psLevel->nStripRows++;
+    if( psLevel->nStripRows == OVR_STRIP_ROWS ||
+        psLevel->nStripYOff + psLevel->nStripRows == psLevel->nYSize )
+    {
+        eErr = GDALRasterIO( psLevel->hBand, GF_Write, 0, psLevel->nStripYOff,
+                             psLevel->nXSize, psLevel->nStripRows,
+                             psLevel->panStrip, psLevel->nXSize,
+                             psLevel->nStripRows, GDT_UInt32, 0, 0 );
+        psLevel->nStripYOff += psLevel->nStripRows;
+        psLevel->nStripRows = 0;
+    }
+    return eErr;
+}
+
+/************************************************************************/
+/*                            ReduceBlocks()                            */
+/*                                                                      */
+/*      Reduce nRows (nFactor or fewer at the bottom) full rows of the  */
+/*      output to one row of nDstXSize, taking the mode of each block   */
+/*      of nFactor columns.                                             */
+/************************************************************************/
+
+void OverviewBuilder::ReduceBlocks( const GUInt32 *panSrc, int nRows, int nFactor,
+                                    GUInt32 *panDst, int nDstXSize ) const
+
+{
+    const GUInt32 *panBlockRow;
+    GUInt32 nId;
+    int i, iRow, iCol, j, nCols, nBlock, nCount, nBestCount, nTies;
+
+    for( i = 0; i < nDstXSize; i++ )
+    {
+        nCols = MIN(nFactor, nXSize - nFactor * i);
+        nBlock = 0;
+        for( iRow = 0; iRow < nRows; iRow++ )
+        {
+            panBlockRow = panSrc + (size_t) iRow * nXSize + (size_t) nFactor * i;
+            for( iCol = 0; iCol < nCols; iCol++ )
+            {
+                if( panBlockRow[iCol] != 0 || !bNoDataZero )
+                    panBlockIds[nBlock++] = panBlockRow[iCol];
+            }
+        }
+
+        // count the runs of equal IDs once sorted
+        std::sort( panBlockIds, panBlockIds + nBlock );
+        panDst[i] = 0;
+        nBestCount = 0;
+        nTies = 0;
+        for( j = 0; j < nBlock; j += nCount )
+        {
+            nCount = 1;
+            while( j + nCount < nBlock && panBlockIds[j + nCount] == panBlockIds[j] )
+                nCount++;
+            if( nCount > nBestCount )
+            {
+                panDst[i] = panBlockIds[j];
+                nBestCount = nCount;
+                nTies = 1;
+            }
+            else if( nCount == nBestCount )
+                nTies++;
+        }
+        if( nTies < 2 )
+            continue;
+
+        // of the IDs tied, the first in row order
+        for( iRow = 0; iRow < nRows; iRow++ )
+        {
+            panBlockRow = panSrc + (size_t) iRow * nXSize + (size_t) nFactor * i;
+            for( iCol = 0; iCol < nCols; iCol++ )
+            {
+                nId = panBlockRow[iCol];
+                if( (nId != 0 || !bNoDataZero) &&
+                    std::upper_bound( panBlockIds, panBlockIds + nBlock, nId ) -
+                    std::lower_bound( panBlockIds, panBlockIds + nBlock, nId ) == nBestCount )
+                {
+                    panDst[i] = nId;
+                    iRow = nRows;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+/************************************************************************/
+/*                               Reset()                                */
+/*                                                                      */
+/*      Start over from the first row, to rewrite the levels.           */
+/************************************************************************/
+
+void OverviewBuilder::Reset()
+
+{
+    int i;
+
+    nBaseRows = 0;
+    nRowsAdded = 0;
+    for( i = 0; i < nLevels; i++ )
+    {
+        pasLevels[i].nSrcRows = 0;
+        pasLevels[i].nStripRows = 0;
+        pasLevels[i].nStripYOff = 0;
+    }
+}
+
+/************************************************************************/
+/* ==================================================================== */
+/*      Spilling the combination table to disk.                        */
+/*                                                                      */
+/*      With -max_mem, once the table outgrows the limit after a        */
+/*      window has been counted, its entries are written to a           */
+/*      temporary run file sorted by key and the table is emptied.      */
+/*      Entries are identified by provisional IDs, numbered on from     */
+/*      one table to the next, and these are what goes to the ID        */
+/*      raster. Since runs are written in counting order, the first     */
+/*      occurrence of a combination is its smallest provisional ID.     */
+/*                                                                      */
+/*      At the end the runs are merged by key. Each combination is      */
+/*      written to a record file at the offset of its smallest          */
+/*      provisional ID, and every provisional ID is mapped to that one. */
+/*      Numbering the first occurrences in order then gives the final   */
+/*      IDs, the same as without spilling, and the ID raster is         */
+/*      rewritten through the map. At most MAX_OPEN_SPILL_RUNS runs     */
+/*      (the GDAL_COMBINE_MAX_OPEN_RUNS configuration option) are       */
+/*      open at once: if there are more, groups of consecutive runs     */
+/*      are first merged into longer runs, in as many passes as needed. */
+/*                                                                      */
+/*      The map takes 4 bytes per provisional ID, so it is kept in a    */
+/*      temporary file too, and both resolved and applied to the ID     */
+/*      raster a slice of provisional IDs at a time, sized so as to     */
+/*      stay within -max_mem.                                           */
+/* ==================================================================== */
+/************************************************************************/
+
+#define MAX_OPEN_SPILL_RUNS 64
+#define ID_MAP_BLOCK 4096
+
+typedef struct {
+	size_t nMaxMem;				/* table memory that triggers a spill, 0 for never */
+	unsigned int nInitID;
+	unsigned int nIdBase;		/* ID of the first entry of the table */
+	int nRuns;					/* run files in papszRunFiles */
+	int nSpilledRuns;			/* runs written, before any were merged */
+	char **papszRunFiles;
+	double dfTime;				/* wall time spent spilling */
+} SpillState;
+
+/* orders table entries by key */
+class CombinationKeyLess {
+    const CombinationTable *poTable;
+  public:
+    CombinationKeyLess( const CombinationTable *poTableIn ) : poTable(poTableIn) {}
+    bool operator()( GUInt32 iA, GUInt32 iB ) const
+    {
+        return memcmp( poTable->GetKey(iA), poTable->GetKey(iB),
+                       poTable->nKeyWords * sizeof(GUInt32) ) < 0;
+    }
+};
+
+/************************************************************************/
+/*                             SpillTable()                             */
+/*                                                                      */
+/*      Write the entries of poTable to a new run file as (key, count,  */
+/*      provisional ID) records sorted by key, then empty the table.    */
+/************************************************************************/
+
+static CPLErr SpillTable(SpillState *psSpill, CombinationTable *poTable)
+{
+	GUInt32 *panOrder;
+	VSILFILE *fpRun;
+	const char *pszRunFile;
+	size_t i, nWritten = 0;
+	GUInt32 nProvID;
+
+	if(poTable->nEntries == 0)
+		return CE_None;
+	if(poTable->nEntries > 0xFFFFFFFFU - psSpill->nIdBase) {
+		CPLError(CE_Failure, CPLE_AppDefined, 
+				"Too many provisional combination IDs to spill the table");
+		return CE_Failure;
+	}
+
+	panOrder = (GUInt32*) VSIMalloc2(poTable->nEntries, sizeof(GUInt32));
+	if(panOrder == NULL) {
+		CPLError(CE_Failure, CPLE_OutOfMemory, "Could not allocate the spill order");
+		return CE_Failure;
+	}
+	for(i=0;i<poTable->nEntries;i++)
+		panOrder[i] = (GUInt32) i;
+	std::sort(panOrder, panOrder + poTable->nEntries, CombinationKeyLess(poTable));
+
+	pszRunFile = CPLGenerateTempFilename("gdal_combine_run");
+	fpRun = VSIFOpenL(pszRunFile, "wb");
+	if(fpRun == NULL) {
+		CPLError(CE_Failure, CPLE_OpenFailed, "Could not create %s", pszRunFile);
+		CPLFree(panOrder);
+		return CE_Failure;
+	}
+	psSpill->papszRunFiles = CSLAddString(psSpill->papszRunFiles, pszRunFile);
+	psSpill->nRuns++;
+	psSpill->nSpilledRuns++;
+
+	for(i=0;i<poTable->nEntries;i++) {
+		nProvID = psSpill->nIdBase - psSpill->nInitID + panOrder[i];
+		nWritten += VSIFWriteL(poTable->GetKey(panOrder[i]), 
+								poTable->nKeyWords * sizeof(GUInt32), 1, fpRun);
+		nWritten += VSIFWriteL(&poTable->panCounts[panOrder[i]], sizeof(GUIntBig), 1, fpRun);
+		nWritten += VSIFWriteL(&nProvID, sizeof(GUInt32), 1, fpRun);
+	}
+	CPLFree(panOrder);
+	if(VSIFCloseL(fpRun) != 0 || nWritten != 3 * poTable->nEntries) {
+		CPLError(CE_Failure, CPLE_FileIO, "Could not write %s", pszRunFile);
+		return CE_Failure;
+	}
+
+	CPLDebug("gdal_combine", "Spilled %lu combinations to %s",
+			(unsigned long) poTable->nEntries, pszRunFile);
+	psSpill->nIdBase += (unsigned int) poTable->nEntries;
+	//free the memory too, -max_mem is checked against what is allocated
+	poTable->Reset(TRUE);
+	return CE_None;
+}
+
+/************************************************************************/
+/*                             CheckSpill()                             */
+/*                                                                      */
+/*      Spill the table if it has outgrown the memory limit. Must only  */
+/*      be called between windows.                                      */
+/************************************************************************/
+
+static CPLErr CheckSpill(SpillState *psSpill, CombinationTable *poTable)
+{
+	double dfStart;
+	CPLErr eErr;
+
+	if(psSpill->nMaxMem == 0 || poTable->GetMemoryUsage() <= psSpill->nMaxMem)
+		return CE_None;
+	dfStart = GetWallTime();
+	eErr = SpillTable(psSpill, poTable);
+	psSpill->dfTime += GetWallTime() - dfStart;
+	return eErr;
+}
+
+/************************************************************************/
+/*                            GetIdMapSlice()                           */
+/*                                                                      */
+/*      Number of provisional IDs in a slice of the ID map. A slice     */
+/*      takes half of nMaxMem, and while the map is resolved the        */
+/*      lookups waiting on earlier slices take the other half.          */
+/************************************************************************/
+
+static size_t GetIdMapSlice(size_t nMaxMem)
+{
+	return MAX(nMaxMem / 8, (size_t) ID_MAP_BLOCK);
+}
+
+/************************************************************************/
+/*                            LookUpIdMap()                             */
+/*                                                                      */
+/*      Set panMap[i] to the final ID of provisional ID f for each      */
+/*      pending (f << 32 | i), reading them from fpMap in order a block */
+/*      at a time.                                                      */
+/************************************************************************/
+
+static CPLErr LookUpIdMap(VSILFILE *fpMap, GUIntBig *panPending, size_t nPending,
+						GUInt32 *panMap, GUInt32 *panBlock)
+{
+	size_t i, nFirst, nBlockStart = 0, nBlockSize = 0;
+
+	std::sort(panPending, panPending + nPending);
+	for(i=0;i<nPending;i++) {
+		nFirst = (size_t) (panPending[i] >> 32);
+		if(nBlockSize == 0 || nFirst >= nBlockStart + nBlockSize) {
+			nBlockStart = nFirst - nFirst % ID_MAP_BLOCK;
+			nBlockSize = 0;
+			if(VSIFSeekL(fpMap, (vsi_l_offset) nBlockStart * sizeof(GUInt32), SEEK_SET) == 0)
+				nBlockSize = VSIFReadL(panBlock, sizeof(GUInt32), ID_MAP_BLOCK, fpMap);
+			if(nFirst >= nBlockStart + nBlockSize) {
+				CPLError(CE_Failure, CPLE_FileIO, "Could not read the ID map");
+				return CE_Failure;
+			}
+		}
+		panMap[(GUInt32) panPending[i]] = panBlock[nFirst - nBlockStart];
+	}
+	return CE_None;
+}
+
+/************************************************************************/
+/*                             WriteIdMap()                             */
+/*                                                                      */
+/*      Write the map from provisional to final IDs to pszMapFile, a    */
+/*      GUInt32 per provisional ID. The first occurrences, the records  */
+/*      of pszRecordFile, are numbered in order, then each slice of the */
+/*      map is read back and the nDups (provisional ID, first           */
+/*      occurrence) pairs of pszDupFile that fall in it are resolved:   */
+/*      directly if the first occurrence is in the slice too, else by   */
+/*      looking it up in the slices already written.                    */
+/************************************************************************/
+
+static CPLErr WriteIdMap(SpillState *psSpill, size_t nRecordSize, 
+						const char *pszRecordFile, const char *pszDupFile, size_t nDups,
+						const char *pszMapFile)
+{
+	size_t nProvIDs = psSpill->nIdBase - psSpill->nInitID;
+	size_t nSlice = MIN(GetIdMapSlice(psSpill->nMaxMem), MAX(nProvIDs, 1));
+	size_t nMaxPending = nSlice / 2, nPending = 0;
+	size_t iProv, i, n = 0, nRead, nLo, nHi;
+	GUInt32 *panMap, *panDups, *panBlock, *panRecord, nNextID = psSpill->nInitID;
+	GUIntBig *panPending, nCount;
+	VSILFILE *fpRecords, *fpDups = NULL, *fpMap;
+	CPLErr eErr = CE_None;
+
+	panMap = (GUInt32*) VSIMalloc2(nSlice, sizeof(GUInt32));
+	panPending = (GUIntBig*) VSIMalloc2(nMaxPending, sizeof(GUIntBig));
+	if(panMap == NULL || panPending == NULL) {
+		CPLError(CE_Failure, CPLE_OutOfMemory, "Could not allocate the ID map");
+		CPLFree(panMap);
+		CPLFree(panPending);
+		return CE_Failure;
+	}
+	panDups = (GUInt32*) CPLMalloc(ID_MAP_BLOCK * 2 * sizeof(GUInt32));
+	panBlock = (GUInt32*) CPLMalloc(ID_MAP_BLOCK * sizeof(GUInt32));
+	panRecord = (GUInt32*) CPLMalloc(nRecordSize);
+
+	fpMap = VSIFOpenL(pszMapFile, "w+b");
+	fpRecords = VSIFOpenL(pszRecordFile, "rb");
+	if(fpMap == NULL || fpRecords == NULL) {
+		CPLError(CE_Failure, CPLE_OpenFailed, "Could not create %s", pszMapFile);
+		eErr = CE_Failure;
+	}
+
+	//first occurrences have a record, trailing empty slots may be missing
+	for(iProv=0;iProv<nProvIDs && eErr == CE_None;iProv++) {
+		nCount = 0;
+		if(VSIFReadL(panRecord, nRecordSize, 1, fpRecords) == 1)
+			memcpy(&nCount, (GByte*) panRecord + nRecordSize - sizeof(GUIntBig), 
+					sizeof(GUIntBig));
+		panMap[n++] = nCount > 0 ? nNextID++ : 0;
+		if(n == nSlice || iProv + 1 == nProvIDs) {
+			if(VSIFWriteL(panMap, sizeof(GUInt32), n, fpMap) != n) {
+				CPLError(CE_Failure, CPLE_FileIO, "Could not write %s", pszMapFile);
+				eErr = CE_Failure;
+			}
+			n = 0;
+		}
+	}
+
+	if(eErr == CE_None && nDups > 0) {
+		fpDups = VSIFOpenL(pszDupFile, "rb");
+		if(fpDups == NULL) {
+			CPLError(CE_Failure, CPLE_OpenFailed, "Could not open %s", pszDupFile);
+			eErr = CE_Failure;
+		}
+	}
+	for(nLo=0;nLo<nProvIDs && nDups > 0 && eErr == CE_None;nLo+=nSlice) {
+		nHi = MIN(nLo + nSlice, nProvIDs);
+		if(VSIFSeekL(fpMap, (vsi_l_offset) nLo * sizeof(GUInt32), SEEK_SET) != 0 ||
+			VSIFReadL(panMap, sizeof(GUInt32), nHi - nLo, fpMap) != nHi - nLo) {
+			CPLError(CE_Failure, CPLE_FileIO, "Could not read %s", pszMapFile);
+			eErr = CE_Failure;
+			break;
+		}
+
+		//a first occurrence is always a smaller provisional ID than the
+		//others, and its final ID never changes once numbered
+		VSIFSeekL(fpDups, 0, SEEK_SET);
+		while(eErr == CE_None && 
+			(nRead = VSIFReadL(panDups, 2 * sizeof(GUInt32), ID_MAP_BLOCK, fpDups)) > 0) {
+			for(i=0;i<nRead && eErr == CE_None;i++) {
+				if(panDups[2 * i] < nLo || panDups[2 * i] >= nHi)
+					continue;
+				if(panDups[2 * i + 1] >= nLo)
+					panMap[panDups[2 * i] - nLo] = panMap[panDups[2 * i + 1] - nLo];
+				else {
+					panPending[nPending++] = ((GUIntBig) panDups[2 * i + 1] << 32) | 
+											(panDups[2 * i] - nLo);
+					if(nPending == nMaxPending) {
+						eErr = LookUpIdMap(fpMap, panPending, nPending, panMap, panBlock);
+						nPending = 0;
+					}
+				}
+			}
+		}
+		if(eErr == CE_None && nPending > 0)
+			eErr = LookUpIdMap(fpMap, panPending, nPending, panMap, panBlock);
+		nPending = 0;
+
+		if(eErr == CE_None &&
+			(VSIFSeekL(fpMap, (vsi_l_offset) nLo * sizeof(GUInt32), SEEK_SET) != 0 ||
+			VSIFWriteL(panMap, sizeof(GUInt32), nHi - nLo, fpMap) != nHi - nLo)) {
+			CPLError(CE_Failure, CPLE_FileIO, "Could not write %s", pszMapFile);
+			eErr = CE_Failure;
+		}
+	}
+
+	if(fpDups != NULL)
+		VSIFCloseL(fpDups);
+	if(fpRecords != NULL)
+		VSIFCloseL(fpRecords);
+	if(fpMap != NULL && VSIFCloseL(fpMap) != 0 && eErr == CE_None) {
+		CPLError(CE_Failure, CPLE_FileIO, "Could not write %s", pszMapFile);
+		eErr = CE_Failure;
+	}
+	CPLFree(panMap);
+	CPLFree(panPending);
+	CPLFree(panDups);
+	CPLFree(panBlock);
+	CPLFree(panRecord);
+	return eErr;
+}
+
+/************************************************************************/
+/*                           MergeSpillRuns()                           */
+/*                                                                      */
+/*      Merge the run files into pszRecordFile, which gets one (key,    */
+/*      count) record per combination at the offset of its first        */
+/*      provisional ID and zeros elsewhere, and write the map from      */
+/*      provisional to final IDs to pszMapFile. Returns the number of   */
+/*      combinations in *pnCombinations.                                */
+/************************************************************************/
+
+typedef struct {
+	VSILFILE *fp;
+	GUInt32 *panKey;
+	GUIntBig nCount;
+	GUInt32 nProvID;
+} SpillRunCursor;
+
+/* orders runs by their current key, then by run so first occurrences come first */
+class SpillRunGreater {
+    const SpillRunCursor *pasRuns;
+    size_t nKeySize;
+  public:
+    SpillRunGreater( const SpillRunCursor *pasRunsIn, size_t nKeySizeIn ) :
+        pasRuns(pasRunsIn), nKeySize(nKeySizeIn) {}
+    bool operator()( int iA, int iB ) const
+    {
+        int nCmp = memcmp( pasRuns[iA].panKey, pasRuns[iB].panKey, nKeySize );
+        return nCmp > 0 || (nCmp == 0 && iA > iB);
+    }
+};
+
+typedef std::priority_queue<int, std::vector<int>, SpillRunGreater> SpillRunHeap;
+
+static int ReadSpillRecord(SpillRunCursor *psRun, size_t nKeySize)
+{
+	return VSIFReadL(psRun->panKey, nKeySize, 1, psRun->fp) == 1 &&
+		VSIFReadL(&psRun->nCount, sizeof(GUIntBig), 1, psRun->fp) == 1 &&
+		VSIFReadL(&psRun->nProvID, sizeof(GUInt32), 1, psRun->fp) == 1;
+}
+
+/* open nRuns run files and push those with a record onto poHeap */
+static CPLErr OpenSpillRuns(char **papszRunFiles, int nRuns, size_t nKeySize,
+							SpillRunCursor *pasRuns, SpillRunHeap *poHeap)
+{
+	CPLErr eErr = CE_None;
+	int i;
+
+	for(i=0;i<nRuns;i++) {
+		pasRuns[i].panKey = (GUInt32*) CPLMalloc(nKeySize);
+		pasRuns[i].fp = VSIFOpenL(papszRunFiles[i], "rb");
+		if(pasRuns[i].fp == NULL) {
+			CPLError(CE_Failure, CPLE_OpenFailed, "Could not open %s", papszRunFiles[i]);
+			eErr = CE_Failure;
+		}
+		else if(ReadSpillRecord(&pasRuns[i], nKeySize))
+			poHeap->push(i);
+	}
+	return eErr;
+}
+
+/* close and delete the run files opened by OpenSpillRuns() */
+static void CloseSpillRuns(char **papszRunFiles, int nRuns, SpillRunCursor *pasRuns)
+{
+	int i;
+
+	for(i=0;i<nRuns;i++) {
+		if(pasRuns[i].fp != NULL)
+			VSIFCloseL(pasRuns[i].fp);
+		VSIUnlink(papszRunFiles[i]);
+		CPLFree(pasRuns[i].panKey);
+	}
+}
+
+/************************************************************************/
+/*                          MergeSpillRunGroup()                        */
+/*                                                                      */
+/*      Merge nRuns consecutive run files into the run file             */
+/*      pszRunFile, keeping every record. Records of the same key stay  */
+/*      in run order, so the merged run can stand for the group in a    */
+/*      later merge. The group's files are deleted.                     */
+/************************************************************************/
+
+static CPLErr MergeSpillRunGroup(char **papszRunFiles, int nRuns, size_t nKeySize,
+								const char *pszRunFile)
+{
+	SpillRunCursor *pasRuns;
+	VSILFILE *fpRun;
+	size_t nRecords = 0, nWritten = 0;
+	CPLErr eErr;
+
+	pasRuns = (SpillRunCursor*) CPLCalloc(nRuns, sizeof(SpillRunCursor));
+	SpillRunHeap oHeap(SpillRunGreater(pasRuns, nKeySize));
+
+	eErr = OpenSpillRuns(papszRunFiles, nRuns, nKeySize, pasRuns, &oHeap);
+	fpRun = VSIFOpenL(pszRunFile, "wb");
+	if(fpRun == NULL) {
+		CPLError(CE_Failure, CPLE_OpenFailed, "Could not create %s", pszRunFile);
+		eErr = CE_Failure;
+	}
+
+	while(eErr == CE_None && !oHeap.empty()) {
+		SpillRunCursor *psRun = &pasRuns[oHeap.top()];
+		oHeap.pop();
+
+		nWritten += VSIFWriteL(psRun->panKey, nKeySize, 1, fpRun);
+		nWritten += VSIFWriteL(&psRun->nCount, sizeof(GUIntBig), 1, fpRun);
+		nWritten += VSIFWriteL(&psRun->nProvID, sizeof(GUInt32), 1, fpRun);
+		nRecords++;
+
+		if(ReadSpillRecord(psRun, nKeySize))
+			oHeap.push((int) (psRun - pasRuns));
+	}
+	if(fpRun != NULL && (VSIFCloseL(fpRun) != 0 || nWritten != 3 * nRecords) &&
+		eErr == CE_None) {
+		CPLError(CE_Failure, CPLE_FileIO, "Could not write %s", pszRunFile);
+		eErr = CE_Failure;
+	}
+
+	CloseSpillRuns(papszRunFiles, nRuns, pasRuns);
+	CPLFree(pasRuns);
+	return eErr;
+}
+
+/************************************************************************/
+/*                           ReduceSpillRuns()                          */
+/*                                                                      */
+/*      Merge groups of consecutive runs until no more than nMaxOpen    */
+/*      are left. On failure the runs left, including partly written   */
+/*      ones, are still listed in psSpill for deleting.                 */
+/************************************************************************/
+
+static CPLErr ReduceSpillRuns(SpillState *psSpill, size_t nKeySize, int nMaxOpen)
+{
+	CPLErr eErr = CE_None;
+	char **papszMerged;
+	int i, j, nGroup, nPasses = 0;
+
+	nMaxOpen = MAX(nMaxOpen, 2);
+	while(eErr == CE_None && psSpill->nRuns > nMaxOpen) {
+		papszMerged = NULL;
+		for(i=0;i<psSpill->nRuns;i+=nMaxOpen) {
+			nGroup = MIN(nMaxOpen, psSpill->nRuns - i);
+			if(nGroup == 1 || eErr != CE_None) {
+				for(j=0;j<nGroup;j++)
+					papszMerged = CSLAddString(papszMerged, psSpill->papszRunFiles[i + j]);
+				continue;
+			}
+			papszMerged = CSLAddString(papszMerged, 
+										CPLGenerateTempFilename("gdal_combine_run"));
+			eErr = MergeSpillRunGroup(psSpill->papszRunFiles + i, nGroup, nKeySize,
+									papszMerged[CSLCount(papszMerged) - 1]);
+		}
+		CSLDestroy(psSpill->papszRunFiles);
+		psSpill->papszRunFiles = papszMerged;
+		psSpill->nRuns = CSLCount(papszMerged);
+		nPasses++;
+	}
+	if(nPasses > 0)
+		CPLDebug("gdal_combine", "Merged the runs down to %d in %d passes",
+				psSpill->nRuns, nPasses);
+	return eErr;
+}
+
+static CPLErr MergeSpillRuns(SpillState *psSpill, int nKeyWords, 
+							const char *pszRecordFile, const char *pszMapFile,
+							GUIntBig *pnCombinations)
+{
+	size_t nKeySize = nKeyWords * sizeof(GUInt32);
+	size_t nRecordSize = nKeySize + sizeof(GUIntBig);
+	SpillRunCursor *pasRuns;
+	GUInt32 *panGroupKey, nGroupID = 0, anDup[2];
+	GUIntBig nGroupCount = 0, nCombinations = 0;
+	int bHaveGroup = FALSE;
+	size_t nWritten = 0, nDups = 0, nDupsWritten = 0;
+	VSILFILE *fpRecords, *fpDups;
+	char *pszDupFile;
+	CPLErr eErr = CE_None;
+
+	fpRecords = VSIFOpenL(pszRecordFile, "wb");
+	if(fpRecords == NULL) {
+		CPLError(CE_Failure, CPLE_OpenFailed, "Could not create %s", pszRecordFile);
+		return CE_Failure;
+	}
+	//the provisional IDs that are not first occurrences, with their first
+	pszDupFile = CPLStrdup(CPLGenerateTempFilename("gdal_combine_dup"));
+	fpDups = VSIFOpenL(pszDupFile, "wb");
+	if(fpDups == NULL) {
+		CPLError(CE_Failure, CPLE_OpenFailed, "Could not create %s", pszDupFile);
+		VSIFCloseL(fpRecords);
+		CPLFree(pszDupFile);
+		return CE_Failure;
+	}
+
+	eErr = ReduceSpillRuns(psSpill, nKeySize, atoi(CPLGetConfigOption(
+							"GDAL_COMBINE_MAX_OPEN_RUNS", CPLSPrintf("%d", MAX_OPEN_SPILL_RUNS))));
+
+	pasRuns = (SpillRunCursor*) CPLCalloc(psSpill->nRuns, sizeof(SpillRunCursor));
+	panGroupKey = (GUInt32*) CPLMalloc(nKeySize);
+	SpillRunHeap oHeap(SpillRunGreater(pasRuns, nKeySize));
+
+	if(eErr == CE_None)
+		eErr = OpenSpillRuns(psSpill->papszRunFiles, psSpill->nRuns, nKeySize, 
+							pasRuns, &oHeap);
+
+	while(eErr == CE_None && !oHeap.empty()) {
+		SpillRunCursor *psRun = &pasRuns[oHeap.top()];
+		oHeap.pop();
+
+		if(bHaveGroup && memcmp(panGroupKey, psRun->panKey, nKeySize) == 0) {
+			nGroupCount += psRun->nCount;
+			anDup[0] = psRun->nProvID;
+			anDup[1] = nGroupID;
+			nDupsWritten += VSIFWriteL(anDup, sizeof(anDup), 1, fpDups);
+			nDups++;
+		}
+		else {
+			//the previous combination is complete
+			if(bHaveGroup) {
+				VSIFSeekL(fpRecords, (vsi_l_offset) nGroupID * nRecordSize, SEEK_SET);
+				nWritten += VSIFWriteL(panGroupKey, nKeySize, 1, fpRecords);
+				nWritten += VSIFWriteL(&nGroupCount, sizeof(GUIntBig), 1, fpRecords);
+				nCombinations++;
+			}
+			memcpy(panGroupKey, psRun->panKey, nKeySize);
+			nGroupCount = psRun->nCount;
+			nGroupID = psRun->nProvID;
+			bHaveGroup = TRUE;
+		}
+
+		if(ReadSpillRecord(psRun, nKeySize))
+			oHeap.push((int) (psRun - pasRuns));
+	}
+	if(bHaveGroup) {
+		VSIFSeekL(fpRecords, (vsi_l_offset) nGroupID * nRecordSize, SEEK_SET);
+		nWritten += VSIFWriteL(panGroupKey, nKeySize, 1, fpRecords);
+		nWritten += VSIFWriteL(&nGroupCount, sizeof(GUIntBig), 1, fpRecords);
+		nCombinations++;
+	}
+	if(VSIFCloseL(fpRecords) != 0 || nWritten != 2 * nCombinations) {
+		CPLError(CE_Failure, CPLE_FileIO, "Could not write %s", pszRecordFile);
+		eErr = CE_Failure;
+	}
+	if(VSIFCloseL(fpDups) != 0 || nDupsWritten != nDups) {
+		CPLError(CE_Failure, CPLE_FileIO, "Could not write %s", pszDupFile);
+		eErr = CE_Failure;
+	}
+
+	CloseSpillRuns(psSpill->papszRunFiles, psSpill->nRuns, pasRuns);
+	CPLFree(pasRuns);
+	CPLFree(panGroupKey);
+
+	if(eErr == CE_None)
+		eErr = WriteIdMap(psSpill, nRecordSize, pszRecordFile, pszDupFile, nDups, 
+						pszMapFile);
+	VSIUnlink(pszDupFile);
+	CPLFree(pszDupFile);
+
+	if(eErr == CE_None)
+		*pnCombinations = nCombinations;
+	return eErr;
+}
+
+/************************************************************************/
+/*                            RemapIdRaster()                           */
+/*                                                                      */
+/*      Copy the provisional IDs of hSrcBand to hDstBand window by      */
+/*      window, mapping them to final IDs through pszMapFile if it is   */
+/*      not NULL. The map is applied in passes over the raster, one per */
+/*      slice of nMapSlice provisional IDs in order, each pass from the */
+/*      second on reading back what the ones before it wrote. The bands */
+/*      may be the same: a final ID is never larger than its            */
+/*      provisional one, so it is not mapped again by a later pass. If  */
+/*      poOverviews is not NULL, the overviews of hDstBand are built    */
+/*      over in the last pass.                                          */
+/************************************************************************/
+
+static CPLErr RemapIdRaster(GDALRasterBandH hSrcBand, GDALRasterBandH hDstBand,
+							OverviewBuilder *poOverviews,
+							const WindowLayout *psLayout, const char *pszMapFile,
+							size_t nMapSlice, unsigned int nInitID,
+							GDALProgressFunc pfnProgress, void *pProgressData)
+{
+	GUInt32 *panIds, *panOut, *panMap = NULL, nId;
+	VSILFILE *fpMap = NULL;
+	VSIStatBufL sStat;
+	CPLErr eErr = CE_None;
+	int iWindow, iPass, nPasses = 1, nXOff, nYOff, nXSize, nYSize;
+	size_t iPixel, nProvIDs = 0, nLo = 0, nHi = 0;
+
+	if(pszMapFile != NULL) {
+		if(VSIStatL(pszMapFile, &sStat) == 0)
+			nProvIDs = (size_t) (sStat.st_size / sizeof(GUInt32));
+		nMapSlice = MIN(nMapSlice, MAX(nProvIDs, 1));
+		nPasses = (int) MAX((nProvIDs + nMapSlice - 1) / nMapSlice, 1);
+		panMap = (GUInt32*) VSIMalloc2(nMapSlice, sizeof(GUInt32));
+		if(panMap == NULL) {
+			CPLError(CE_Failure, CPLE_OutOfMemory, "Could not allocate the ID map");
+			return CE_Failure;
+		}
+		fpMap = VSIFOpenL(pszMapFile, "rb");
+		if(fpMap == NULL) {
+			CPLError(CE_Failure, CPLE_OpenFailed, "Could not open %s", pszMapFile);
+			CPLFree(panMap);
+			return CE_Failure;
+		}
+	}
+
+	panIds = (GUInt32*) VSIMalloc3(psLayout->nWinXSize, psLayout->nWinYSize, 
+								sizeof(GUInt32));
+	panOut = panIds;
+	if(panIds != NULL && fpMap != NULL && hSrcBand != hDstBand)
+		panOut = (GUInt32*) VSIMalloc3(psLayout->nWinXSize, psLayout->nWinYSize, 
+									sizeof(GUInt32));
+	if(panIds == NULL || panOut == NULL) {
+		CPLError(CE_Failure, CPLE_OutOfMemory, "Could not allocate window buffers");
+		eErr = CE_Failure;
+	}
+
+	for(iPass=0;iPass<nPasses && eErr == CE_None;iPass++) {
+		if(fpMap != NULL) {
+			nLo = (size_t) iPass * nMapSlice;
+			nHi = MIN(nLo + nMapSlice, nProvIDs);
+			if(VSIFSeekL(fpMap, (vsi_l_offset) nLo * sizeof(GUInt32), SEEK_SET) != 0 ||
+				VSIFReadL(panMap, sizeof(GUInt32), nHi - nLo, fpMap) != nHi - nLo) {
+				CPLError(CE_Failure, CPLE_FileIO, "Could not read %s", pszMapFile);
+				eErr = CE_Failure;
+				break;
+			}
+		}
+		if(poOverviews != NULL && iPass == nPasses - 1)
+			poOverviews->Reset();
+
+		for(iWindow=0;iWindow<psLayout->nWindows && eErr == CE_None;iWindow++) {
+			GetWindow(psLayout, iWindow, &nXOff, &nYOff, &nXSize, &nYSize);
+			eErr = GDALRasterIO(hSrcBand, GF_Read, nXOff, nYOff, nXSize, nYSize,
+								panIds, nXSize, nYSize, GDT_UInt32, 0, 0);
+			//pixels of the slices before this one were written to hDstBand
+			if(eErr == CE_None && panOut != panIds && iPass > 0)
+				eErr = GDALRasterIO(hDstBand, GF_Read, nXOff, nYOff, nXSize, nYSize,
+									panOut, nXSize, nYSize, GDT_UInt32, 0, 0);
+			if(eErr == CE_None && fpMap != NULL) {
+				//ID 0 below nInitID is a skipped pixel
+				for(iPixel=0;iPixel<(size_t) nXSize * nYSize;iPixel++) {
+					nId = panIds[iPixel];
+					if(nId >= nInitID && nId - nInitID >= nLo && nId - nInitID < nHi)
+						panOut[iPixel] = panMap[nId - nInitID - nLo];
+					else if(panOut != panIds && iPass == 0)
+						panOut[iPixel] = nId;
+				}
+			}
+			if(eErr == CE_None)
+				eErr = GDALRasterIO(hDstBand, GF_Write, nXOff, nYOff, nXSize, nYSize,
+									panOut, nXSize, nYSize, GDT_UInt32, 0, 0);
+			if(eErr == CE_None && poOverviews != NULL && iPass == nPasses - 1)
+				eErr = poOverviews->AddWindow(nYSize, panOut);
+
+			if(pfnProgress != NULL)
+				pfnProgress((iPass * (double) psLayout->nWindows + iWindow + 1) / 
+							((double) nPasses * psLayout->nWindows), NULL, pProgressData);
+		}
+	}
+
+	if(panOut != panIds)
+		CPLFree(panOut);
+	CPLFree(panIds);
+	CPLFree(panMap);
+	if(fpMap != NULL)
+		VSIFCloseL(fpMap);
+	return eErr;
+}
+
+/************************************************************************/
+/* ==================================================================== */
+/*      Multi-threaded combine.                                         */
+/*                                                                      */
+/*      Each worker thread opens its own handles on the inputs, claims  */
+/*      the next window and counts it into a table of its own. Window   */
+/*      tables are then merged into the global table strictly in        */
+/*      window order, so combination IDs are assigned by first          */
+/*      occurrence in processing order exactly as with a single thread, */
+/*      and the output raster and CSV do not depend on the number of    */
+/*      threads. Merging is done by whichever worker finds the next     */
+/*      window ready, which also remaps the window's IDs and writes it  */
+/*      to the output raster.                                           */
+/* ==================================================================== */
+/************************************************************************/
+
+typedef struct {
+	int nXOff;
+	int nYOff;
+	int nXSize;
+	int nYSize;
+	int bReady;
+	CombineEngine *poEngine;
+	GUInt32 *panIds;			/* window table entry index of each pixel */
+} CombineChunk;
+
 typedef struct {
-    unsigned int nID;
-    unsigned long long nCount;
-    char *pszCombination;
-} Combination;
+	const InputRaster *psInputRasters;
+	int nInputFiles;
+	const WindowLayout *psLayout;
+	CombineEngine *poEngine;
+	SpillState *psSpill;
+	GDALRasterBandH hOutBand;
+	OverviewBuilder *poOverviews;
+	GDALProgressFunc pfnProgress;
+	void *pProgressData;
+
+	/* the members below are protected by hMutex */
+	void *hMutex;
+	void *hCond;
+	int nNextChunk;				/* next window to be claimed by a worker */
+	int nNextMerge;				/* next window to be merged */
+	int bMerging;
+	CPLErr eErr;
+	int nRing;					/* windows in flight, claimed or awaiting merge */
+	CombineChunk *pasRing;
+	RunStats sStats;			/* reading and counting */
+	GUInt32 *panRemap;			/* only used by the merging worker, */
+	size_t nRemapAlloc;			/* like the members below */
+	RunStats sMergeStats;		/* merging and writing */
+} CombineJob;
+
+/************************************************************************/
+/*                             MergeChunk()                             */
+/************************************************************************/
+
+static CPLErr MergeChunk(CombineJob *psJob, CombineChunk *psChunk)
+{
+	size_t nLocal = psChunk->poEngine->poTable->nEntries, nPixels;
+	CPLErr eErr = CE_None;
+	double dfTimer = GetWallTime();
+
+	if(nLocal > psJob->nRemapAlloc) {
+		psJob->nRemapAlloc = nLocal;
+		psJob->panRemap = (GUInt32*) CPLRealloc(psJob->panRemap,
+										psJob->nRemapAlloc * sizeof(GUInt32));
+	}
+
+	if(!psJob->poEngine->Merge(psChunk->poEngine, psJob->panRemap)) {
+		CPLError(CE_Fatal, CPLE_OutOfMemory,
+				"Out of memory. "
+				"Can't allocate enough memory to hold all unique combinations, "
+				"try -max_mem\n");
+	}
+	psJob->sMergeStats.dfMerge += GetWallTime() - dfTimer;
 
-unsigned long CombinationHashFunc(const void* elt) {
-    Combination* psStruct = (Combination*) elt;
-    return CPLHashSetHashStr(psStruct->pszCombination);
+	if(psJob->hOutBand != NULL) {
+		nPixels = (size_t) psChunk->nXSize * psChunk->nYSize;
+		SetWindowIds(psChunk->panIds, nPixels, psJob->psSpill->nIdBase, psJob->panRemap);
+
+		dfTimer = GetWallTime();
+		eErr = GDALRasterIO(psJob->hOutBand, GF_Write, psChunk->nXOff, psChunk->nYOff, 
+							psChunk->nXSize, psChunk->nYSize, psChunk->panIds, 
+							psChunk->nXSize, psChunk->nYSize, GDT_UInt32, 0, 0);
+		if(eErr == CE_None && psJob->poOverviews != NULL)
+			eErr = psJob->poOverviews->AddWindow(psChunk->nYSize, psChunk->panIds);
+		psJob->sMergeStats.dfWrite += GetWallTime() - dfTimer;
+	}
+	if(eErr == CE_None)
+		eErr = CheckSpill(psJob->psSpill, psJob->poEngine->poTable);
+
+	if(psJob->pfnProgress != NULL)
+		psJob->pfnProgress((psJob->nNextMerge + 1) / (double) psJob->psLayout->nWindows,
+							NULL, psJob->pProgressData);
+
+	return eErr;
 }
 
-int CombinationEqualFunc(const void* elt1, const void* elt2) {
-    Combination* psStruct1 = (Combination*) elt1;
-    Combination* psStruct2 = (Combination*) elt2;
-    return strcmp(psStruct1->pszCombination, psStruct2->pszCombination) == 0;
+/************************************************************************/
+/*                            CombineWorker()                           */
+/************************************************************************/
+
+static void CombineWorker(void *pData)
+{
+	CombineJob *psJob = (CombineJob*) pData;
+	InputRaster *psInputRasters;
+	CombineBlockInput *pasBlock;
+	CPLErr eErr = CE_None;
+	double dfRead = 0.0, dfCount = 0.0, dfTimer;
+	int i;
+
+	psInputRasters = (InputRaster*) CPLMalloc(psJob->nInputFiles * sizeof(InputRaster));
+	for(i=0;i<psJob->nInputFiles;i++) {
+		psInputRasters[i] = psJob->psInputRasters[i];
+		if(!OpenInputRaster(&psInputRasters[i])) {
+			CPLError(CE_Failure, CPLE_OpenFailed, "Could not open dataset: %s",
+					psInputRasters[i].pszFilename);
+			eErr = CE_Failure;
+		}
+	}
+	if(eErr == CE_None && 
+		!AllocateWindowBuffers(psInputRasters, psJob->nInputFiles, 
+			(size_t) psJob->psLayout->nWinXSize * psJob->psLayout->nWinYSize)) {
+		CPLError(CE_Failure, CPLE_OutOfMemory, "Could not allocate window buffers");
+		eErr = CE_Failure;
+	}
+	pasBlock = (CombineBlockInput*) CPLMalloc(psJob->nInputFiles * sizeof(CombineBlockInput));
+	GetWindowBlock(psInputRasters, psJob->nInputFiles, pasBlock);
+
+	CPLAcquireMutex(psJob->hMutex, 1000.0);
+	if(eErr != CE_None)
+		psJob->eErr = eErr;
+
+	while(psJob->eErr == CE_None) {
+		CombineChunk *psChunk;
+
+		//claim the next window once its ring slot has been merged
+		while(psJob->eErr == CE_None && psJob->nNextChunk < psJob->psLayout->nWindows &&
+				psJob->nNextChunk >= psJob->nNextMerge + psJob->nRing) {
+			CPLCondWait(psJob->hCond, psJob->hMutex);
+		}
+		if(psJob->eErr != CE_None || psJob->nNextChunk >= psJob->psLayout->nWindows)
+			break;
+
+		psChunk = &psJob->pasRing[psJob->nNextChunk % psJob->nRing];
+		GetWindow(psJob->psLayout, psJob->nNextChunk, &psChunk->nXOff, &psChunk->nYOff,
+					&psChunk->nXSize, &psChunk->nYSize);
+		psJob->nNextChunk++;
+		CPLReleaseMutex(psJob->hMutex);
+
+		psChunk->poEngine->Reset();
+		dfTimer = GetWallTime();
+		eErr = ReadWindow(psInputRasters, psJob->nInputFiles, 
+						psChunk->nXOff, psChunk->nYOff, psChunk->nXSize, psChunk->nYSize);
+		dfRead += GetWallTime() - dfTimer;
+		if(eErr == CE_None) {
+			dfTimer = GetWallTime();
+			psChunk->poEngine->AddBlock(pasBlock, psChunk->nXSize, psChunk->nYSize, 
+										psChunk->panIds);
+			dfCount += GetWallTime() - dfTimer;
+		}
+
+		CPLAcquireMutex(psJob->hMutex, 1000.0);
+		if(eErr != CE_None) {
+			psJob->eErr = eErr;
+			break;
+		}
+		psChunk->bReady = TRUE;
+
+		//merge every window that is ready, in order, unless another
+		//worker is already doing so
+		if(!psJob->bMerging) {
+			psJob->bMerging = TRUE;
+			while(psJob->eErr == CE_None && psJob->nNextMerge < psJob->psLayout->nWindows &&
+					psJob->pasRing[psJob->nNextMerge % psJob->nRing].bReady) {
+				CombineChunk *psMerge = &psJob->pasRing[psJob->nNextMerge % psJob->nRing];
+
+				CPLReleaseMutex(psJob->hMutex);
+				eErr = MergeChunk(psJob, psMerge);
+				CPLAcquireMutex(psJob->hMutex, 1000.0);
+
+				if(eErr != CE_None)
+					psJob->eErr = eErr;
+				psMerge->bReady = FALSE;
+				psJob->nNextMerge++;
+				CPLCondBroadcast(psJob->hCond);
+			}
+			psJob->bMerging = FALSE;
+		}
+	}
+
+	psJob->sStats.dfRead += dfRead;
+	psJob->sStats.dfCount += dfCount;
+	CPLCondBroadcast(psJob->hCond);
+	CPLReleaseMutex(psJob->hMutex);
+
+	CloseInputRasters(psInputRasters, psJob->nInputFiles);
+	CPLFree(psInputRasters);
+	CPLFree(pasBlock);
 }
 
-void CombinationFreeFunc(void* elt) {
-    Combination* psStruct = (Combination*) elt;
-    CPLFree(psStruct->pszCombination);
-    CPLFree(psStruct);
+/************************************************************************/
+/*                          CombineThreaded()                           */
+/*                                                                      */
+/*      Run the combine into poEngine with nThreads workers, each       */
+/*      counting windows into engines of their own. If panDenseMin is   */
+/*      not NULL the window tables are directly indexed over that       */
+/*      domain. The IDs written to hOutBand, if not NULL, are added to  */
+/*      poOverviews, if not NULL. Phase times are added to psRunStats.  */
+/************************************************************************/
+
+static CPLErr CombineThreaded(const InputRaster *psInputRasters, int nInputFiles,
+							const WindowLayout *psLayout, CombineEngine *poEngine,
+							SpillState *psSpill, GDALRasterBandH hOutBand, 
+							OverviewBuilder *poOverviews, int nThreads,
+							const GInt32 *panDenseMin, const GInt32 *panDenseMax,
+							RunStats *psRunStats,
+							GDALProgressFunc pfnProgress, void *pProgressData)
+{
+	CombineJob sJob;
+	CPLJoinableThread **pahThreads;
+	CPLErr eErr = CE_None;
+	int i;
+
+	sJob.psInputRasters = psInputRasters;
+	sJob.nInputFiles = nInputFiles;
+	sJob.psLayout = psLayout;
+	sJob.poEngine = poEngine;
+	sJob.psSpill = psSpill;
+	sJob.hOutBand = hOutBand;
+	sJob.poOverviews = poOverviews;
+	sJob.pfnProgress = pfnProgress;
+	sJob.pProgressData = pProgressData;
+	sJob.nNextChunk = 0;
+	sJob.nNextMerge = 0;
+	sJob.bMerging = FALSE;
+	sJob.eErr = CE_None;
+	sJob.panRemap = NULL;
+	sJob.nRemapAlloc = 0;
+	memset(&sJob.sStats, 0, sizeof(RunStats));
+	memset(&sJob.sMergeStats, 0, sizeof(RunStats));
+
+	//allow each worker one window waiting to be merged besides the one
+	//it is counting
+	sJob.nRing = nThreads * 2;
+	sJob.pasRing = (CombineChunk*) CPLCalloc(sJob.nRing, sizeof(CombineChunk));
+	for(i=0;i<sJob.nRing;i++) {
+		sJob.pasRing[i].poEngine = new CombineEngine(psInputRasters, nInputFiles);
+		if(panDenseMin != NULL)
+			sJob.pasRing[i].poEngine->poTable->InitDenseIndex(panDenseMin, panDenseMax);
+		sJob.pasRing[i].panIds = (GUInt32*) VSIMalloc3(psLayout->nWinXSize, 
+												psLayout->nWinYSize, sizeof(GUInt32));
+		if(sJob.pasRing[i].panIds == NULL) {
+			CPLError(CE_Failure, CPLE_OutOfMemory, "Could not allocate window buffers");
+			eErr = CE_Failure;
+		}
+	}
+
+	sJob.hMutex = CPLCreateMutex();
+	CPLReleaseMutex(sJob.hMutex);
+	sJob.hCond = CPLCreateCond();
+
+	pahThreads = (CPLJoinableThread**) CPLCalloc(nThreads, sizeof(CPLJoinableThread*));
+	for(i=0;i<nThreads && eErr == CE_None;i++) {
+		pahThreads[i] = CPLCreateJoinableThread(CombineWorker, &sJob);
+		if(pahThreads[i] == NULL) {
+			CPLError(CE_Failure, CPLE_AppDefined, "Could not start worker thread");
+			eErr = CE_Failure;
+		}
+	}
+	for(i=0;i<nThreads;i++) {
+		if(pahThreads[i] != NULL)
+			CPLJoinThread(pahThreads[i]);
+	}
+	if(eErr == CE_None)
+		eErr = sJob.eErr;
+
+	psRunStats->dfRead += sJob.sStats.dfRead;
+	psRunStats->dfCount += sJob.sStats.dfCount;
+	psRunStats->dfMerge += sJob.sMergeStats.dfMerge;
+	psRunStats->dfWrite += sJob.sMergeStats.dfWrite;
+
+	CPLDestroyCond(sJob.hCond);
+	CPLDestroyMutex(sJob.hMutex);
+	for(i=0;i<sJob.nRing;i++) {
+		psRunStats->nWindowTableMem += sJob.pasRing[i].poEngine->poTable->GetMemoryUsage();
+		delete sJob.pasRing[i].poEngine;
+		CPLFree(sJob.pasRing[i].panIds);
+	}
+	CPLFree(sJob.pasRing);
+	CPLFree(sJob.panRemap);
+	CPLFree(pahThreads);
+
+	return eErr;
 }
 
-static void Usage() {
-    printf( "Usage: gdal_combine [-o out_raster] [-of out_format]\n"
-			"       [-ot {Byte/UInt16/UInt32}] [-initid id]\n"
-            "       [-co \"NAME=VALUE\"]* [-q]\n"
-            "       -csv out_csv_file\n"
-			"       [-input_file_list my_list.txt]\n"
-            "       [raster files...] \n\n" );
+/************************************************************************/
+/* ==================================================================== */
+/*      Pipelined combine.                                              */
+/*                                                                      */
+/*      Combinations are counted into the global table on the calling  */
+/*      thread, while nQueue-1 reader threads, each with its own        */
+/*      handles on the inputs, read the next windows ahead of it and a  */
+/*      writer thread writes the output windows behind it. Windows      */
+/*      cycle through a ring of nQueue slots, each holding the input    */
+/*      buffers and output IDs of one window, so decoding, counting and */
+/*      writing overlap within a fixed amount of buffer memory.         */
+/* ==================================================================== */
+/************************************************************************/
+
+#define SLOT_FREE		0
+#define SLOT_READING	1
+#define SLOT_READ		2
+#define SLOT_COUNTED	3
+
+typedef struct {
+	int nXOff;
+	int nYOff;
+	int nXSize;
+	int nYSize;
+	int nState;
+	InputRaster *psInputRasters;	/* window buffers of this slot */
+	CombineBlockInput *pasBlock;	/* the same as an engine block */
+	GUInt32 *panIds;
+} PipelineSlot;
+
+typedef struct {
+	const InputRaster *psInputRasters;
+	int nInputFiles;
+	const WindowLayout *psLayout;
+	GDALRasterBandH hOutBand;
+	OverviewBuilder *poOverviews;
+
+	/* the members below are protected by hMutex */
+	void *hMutex;
+	void *hCond;
+	int nNextRead;				/* next window to be claimed by a reader */
+	int nNextWrite;				/* next window to be written */
+	CPLErr eErr;
+	int nQueue;
+	PipelineSlot *pasSlots;
+	RunStats sStats;			/* reading and writing */
+} PipelineJob;
+
+/************************************************************************/
+/*                           PipelineReader()                           */
+/************************************************************************/
+
+static void PipelineReader(void *pData)
+{
+	PipelineJob *psJob = (PipelineJob*) pData;
+	InputRaster *psInputRasters;
+	CPLErr eErr = CE_None;
+	double dfRead = 0.0, dfTimer;
+	int i;
+
+	psInputRasters = (InputRaster*) CPLMalloc(psJob->nInputFiles * sizeof(InputRaster));
+	for(i=0;i<psJob->nInputFiles;i++) {
+		psInputRasters[i] = psJob->psInputRasters[i];
+		if(!OpenInputRaster(&psInputRasters[i])) {
+			CPLError(CE_Failure, CPLE_OpenFailed, "Could not open dataset: %s",
+					psInputRasters[i].pszFilename);
+			eErr = CE_Failure;
+		}
+	}
+
+	CPLAcquireMutex(psJob->hMutex, 1000.0);
+	if(eErr != CE_None)
+		psJob->eErr = eErr;
+
+	while(psJob->eErr == CE_None) {
+		PipelineSlot *psSlot;
+
+		//claim the next window once its slot has been written
+		while(psJob->eErr == CE_None && psJob->nNextRead < psJob->psLayout->nWindows &&
+				psJob->pasSlots[psJob->nNextRead % psJob->nQueue].nState != SLOT_FREE) {
+			CPLCondWait(psJob->hCond, psJob->hMutex);
+		}
+		if(psJob->eErr != CE_None || psJob->nNextRead >= psJob->psLayout->nWindows)
+			break;
+
+		psSlot = &psJob->pasSlots[psJob->nNextRead % psJob->nQueue];
+		GetWindow(psJob->psLayout, psJob->nNextRead, &psSlot->nXOff, &psSlot->nYOff,
+					&psSlot->nXSize, &psSlot->nYSize);
+		psSlot->nState = SLOT_READING;
+		psJob->nNextRead++;
+		CPLReleaseMutex(psJob->hMutex);
+
+		for(i=0;i<psJob->nInputFiles;i++)
+			psSlot->psInputRasters[i].hBand = psInputRasters[i].hBand;
+		dfTimer = GetWallTime();
+		eErr = ReadWindow(psSlot->psInputRasters, psJob->nInputFiles, 
+						psSlot->nXOff, psSlot->nYOff, psSlot->nXSize, psSlot->nYSize);
+		dfRead += GetWallTime() - dfTimer;
+
+		CPLAcquireMutex(psJob->hMutex, 1000.0);
+		if(eErr != CE_None) {
+			psJob->eErr = eErr;
+			break;
+		}
+		psSlot->nState = SLOT_READ;
+		CPLCondBroadcast(psJob->hCond);
+	}
+
+	psJob->sStats.dfRead += dfRead;
+	CPLCondBroadcast(psJob->hCond);
+	CPLReleaseMutex(psJob->hMutex);
+
+	CloseInputRasters(psInputRasters, psJob->nInputFiles);
+	CPLFree(psInputRasters);
 }
 
 /************************************************************************/
-/*                        add_file_to_list()                            */
+/*                           PipelineWriter()                           */
 /************************************************************************/
 
-static void add_file_to_list(const char* filename, int* pnInputFiles, 
-								char*** pppszInputFilenames)
+static void PipelineWriter(void *pData)
 {
-	int nInputFiles = *pnInputFiles;
-	char** ppszInputFilenames = *pppszInputFilenames;
+	PipelineJob *psJob = (PipelineJob*) pData;
+	CPLErr eErr;
+	double dfWrite = 0.0, dfTimer;
 
-	ppszInputFilenames = (char**)CPLRealloc(ppszInputFilenames,
-											sizeof(char*) * (nInputFiles+1));
-	ppszInputFilenames[nInputFiles++] = CPLStrdup(filename);
-	
-	*pnInputFiles = nInputFiles;
-	*pppszInputFilenames = ppszInputFilenames;
+	CPLAcquireMutex(psJob->hMutex, 1000.0);
+
+	while(psJob->eErr == CE_None) {
+		PipelineSlot *psSlot;
+
+		//windows are written in order as soon as they are counted
+		while(psJob->eErr == CE_None && psJob->nNextWrite < psJob->psLayout->nWindows &&
+				psJob->pasSlots[psJob->nNextWrite % psJob->nQueue].nState != SLOT_COUNTED) {
+			CPLCondWait(psJob->hCond, psJob->hMutex);
+		}
+		if(psJob->eErr != CE_None || psJob->nNextWrite >= psJob->psLayout->nWindows)
+			break;
+
+		psSlot = &psJob->pasSlots[psJob->nNextWrite % psJob->nQueue];
+		CPLReleaseMutex(psJob->hMutex);
+
+		dfTimer = GetWallTime();
+		eErr = GDALRasterIO(psJob->hOutBand, GF_Write, psSlot->nXOff, psSlot->nYOff, 
+							psSlot->nXSize, psSlot->nYSize, psSlot->panIds, 
+							psSlot->nXSize, psSlot->nYSize, GDT_UInt32, 0, 0);
+		if(eErr == CE_None && psJob->poOverviews != NULL)
+			eErr = psJob->poOverviews->AddWindow(psSlot->nYSize, psSlot->panIds);
+		dfWrite += GetWallTime() - dfTimer;
+
+		CPLAcquireMutex(psJob->hMutex, 1000.0);
+		if(eErr != CE_None) {
+			psJob->eErr = eErr;
+			break;
+		}
+		psSlot->nState = SLOT_FREE;
+		psJob->nNextWrite++;
+		CPLCondBroadcast(psJob->hCond);
+	}
+
+	psJob->sStats.dfWrite += dfWrite;
+	CPLCondBroadcast(psJob->hCond);
+	CPLReleaseMutex(psJob->hMutex);
+}
+
+/************************************************************************/
+/*                          CombinePipelined()                          */
+/*                                                                      */
+/*      Run the combine into poEngine with a ring of nQueue (at least   */
+/*      2) windows in flight. The IDs written to hOutBand, if not NULL, */
+/*      are added to poOverviews, if not NULL. Phase times are added to */
+/*      psRunStats.                                                     */
+/************************************************************************/
+
+static CPLErr CombinePipelined(const InputRaster *psInputRasters, int nInputFiles,
+							const WindowLayout *psLayout, CombineEngine *poEngine,
+							SpillState *psSpill, GDALRasterBandH hOutBand, 
+							OverviewBuilder *poOverviews, int nQueue,
+							RunStats *psRunStats,
+							GDALProgressFunc pfnProgress, void *pProgressData)
+{
+	PipelineJob sJob;
+	CPLJoinableThread **pahThreads;
+	CPLJoinableThread *hWriter = NULL;
+	CPLErr eErr = CE_None;
+	double dfTimer;
+	size_t nWinPixels;
+	int i, j, nReaders, iWindow;
+
+	sJob.psInputRasters = psInputRasters;
+	sJob.nInputFiles = nInputFiles;
+	sJob.psLayout = psLayout;
+	sJob.hOutBand = hOutBand;
+	sJob.poOverviews = poOverviews;
+	sJob.nNextRead = 0;
+	sJob.nNextWrite = 0;
+	sJob.eErr = CE_None;
+	sJob.nQueue = nQueue;
+	memset(&sJob.sStats, 0, sizeof(RunStats));
+
+	//the slots get their own window buffers, the readers lend them
+	//their band handles
+	nWinPixels = (size_t) psLayout->nWinXSize * psLayout->nWinYSize;
+	sJob.pasSlots = (PipelineSlot*) CPLCalloc(nQueue, sizeof(PipelineSlot));
+	for(i=0;i<nQueue;i++) {
+		sJob.pasSlots[i].nState = SLOT_FREE;
+		sJob.pasSlots[i].psInputRasters = 
+			(InputRaster*) CPLMalloc(nInputFiles * sizeof(InputRaster));
+		for(j=0;j<nInputFiles;j++) {
+			sJob.pasSlots[i].psInputRasters[j] = psInputRasters[j];
+			sJob.pasSlots[i].psInputRasters[j].hDS = NULL;
+			sJob.pasSlots[i].psInputRasters[j].hBand = NULL;
+			sJob.pasSlots[i].psInputRasters[j].panValues = NULL;
+			sJob.pasSlots[i].psInputRasters[j].padfValues = NULL;
+			sJob.pasSlots[i].psInputRasters[j].pabyMask = NULL;
+		}
+		if(!AllocateWindowBuffers(sJob.pasSlots[i].psInputRasters, nInputFiles, nWinPixels))
+			eErr = CE_Failure;
+		sJob.pasSlots[i].pasBlock = 
+			(CombineBlockInput*) CPLMalloc(nInputFiles * sizeof(CombineBlockInput));
+		GetWindowBlock(sJob.pasSlots[i].psInputRasters, nInputFiles, 
+						sJob.pasSlots[i].pasBlock);
+		sJob.pasSlots[i].panIds = (GUInt32*) VSIMalloc2(nWinPixels, sizeof(GUInt32));
+		if(sJob.pasSlots[i].panIds == NULL)
+			eErr = CE_Failure;
+	}
+	if(eErr != CE_None)
+		CPLError(CE_Failure, CPLE_OutOfMemory, "Could not allocate window buffers");
+
+	sJob.hMutex = CPLCreateMutex();
+	CPLReleaseMutex(sJob.hMutex);
+	sJob.hCond = CPLCreateCond();
+
+	nReaders = nQueue - 1;
+	pahThreads = (CPLJoinableThread**) CPLCalloc(nReaders, sizeof(CPLJoinableThread*));
+	for(i=0;i<nReaders && eErr == CE_None;i++) {
+		pahThreads[i] = CPLCreateJoinableThread(PipelineReader, &sJob);
+		if(pahThreads[i] == NULL) {
+			CPLError(CE_Failure, CPLE_AppDefined, "Could not start reader thread");
+			eErr = CE_Failure;
+		}
+	}
+	if(eErr == CE_None && hOutBand != NULL) {
+		hWriter = CPLCreateJoinableThread(PipelineWriter, &sJob);
+		if(hWriter == NULL) {
+			CPLError(CE_Failure, CPLE_AppDefined, "Could not start writer thread");
+			eErr = CE_Failure;
+		}
+	}
+
+	/* count the windows in order as they are read */
+	for(iWindow=0;iWindow<psLayout->nWindows && eErr == CE_None;iWindow++) {
+		PipelineSlot *psSlot = &sJob.pasSlots[iWindow % nQueue];
+
+		CPLAcquireMutex(sJob.hMutex, 1000.0);
+		while(sJob.eErr == CE_None && psSlot->nState != SLOT_READ)
+			CPLCondWait(sJob.hCond, sJob.hMutex);
+		eErr = sJob.eErr;
+		CPLReleaseMutex(sJob.hMutex);
+		if(eErr != CE_None)
+			break;
+
+		dfTimer = GetWallTime();
+		poEngine->AddBlock(psSlot->pasBlock, psSlot->nXSize, psSlot->nYSize, 
+							psSlot->panIds);
+		psRunStats->dfCount += GetWallTime() - dfTimer;
+		if(hOutBand != NULL) {
+			SetWindowIds(psSlot->panIds, (size_t) psSlot->nXSize * psSlot->nYSize,
+						psSpill->nIdBase, NULL);
+		}
+		eErr = CheckSpill(psSpill, poEngine->poTable);
+
+		CPLAcquireMutex(sJob.hMutex, 1000.0);
+		psSlot->nState = hOutBand != NULL ? SLOT_COUNTED : SLOT_FREE;
+		CPLCondBroadcast(sJob.hCond);
+		CPLReleaseMutex(sJob.hMutex);
+
+		if(pfnProgress != NULL)
+			pfnProgress((iWindow + 1) / (double) psLayout->nWindows, NULL, pProgressData);
+	}
+
+	//stop the other threads if counting failed
+	CPLAcquireMutex(sJob.hMutex, 1000.0);
+	if(eErr != CE_None && sJob.eErr == CE_None)
+		sJob.eErr = eErr;
+	CPLCondBroadcast(sJob.hCond);
+	CPLReleaseMutex(sJob.hMutex);
+
+	for(i=0;i<nReaders;i++) {
+		if(pahThreads[i] != NULL)
+			CPLJoinThread(pahThreads[i]);
+	}
+	if(hWriter != NULL)
+		CPLJoinThread(hWriter);
+	if(eErr == CE_None)
+		eErr = sJob.eErr;
+	psRunStats->dfRead += sJob.sStats.dfRead;
+	psRunStats->dfWrite += sJob.sStats.dfWrite;
+
+	CPLDestroyCond(sJob.hCond);
+	CPLDestroyMutex(sJob.hMutex);
+	for(i=0;i<nQueue;i++) {
+		CloseInputRasters(sJob.pasSlots[i].psInputRasters, nInputFiles);
+		CPLFree(sJob.pasSlots[i].psInputRasters);
+		CPLFree(sJob.pasSlots[i].pasBlock);
+		CPLFree(sJob.pasSlots[i].panIds);
+	}
+	CPLFree(sJob.pasSlots);
+	CPLFree(pahThreads);
+
+	return eErr;
+}
+
+/************************************************************************/
+/*                          CombineSequential()                         */
+/*                                                                      */
+/*      Run the combine into poEngine reading, counting and writing     */
+/*      one window after the other on the calling thread, with the      */
+/*      window buffers of psInputRasters. The IDs written to hOutBand,  */
+/*      if not NULL, are added to poOverviews, if not NULL. Phase times */
+/*      are added to psRunStats.                                        */
+/************************************************************************/
+
+static CPLErr CombineSequential(InputRaster *psInputRasters, int nInputFiles,
+								const WindowLayout *psLayout, CombineEngine *poEngine,
+								SpillState *psSpill, GDALRasterBandH hOutBand,
+								OverviewBuilder *poOverviews,
+								RunStats *psRunStats,
+								GDALProgressFunc pfnProgress, void *pProgressData)
+{
+	CombineBlockInput *pasBlock;
+	GUInt32 *panIds;
+	CPLErr eErr = CE_None;
+	double dfTimer;
+	int iWindow, nXOff, nYOff, nXSize, nYSize;
+
+	if(!AllocateWindowBuffers(psInputRasters, nInputFiles, 
+						(size_t) psLayout->nWinXSize * psLayout->nWinYSize)) {
+		CPLError(CE_Failure, CPLE_OutOfMemory, "Could not allocate window buffers");
+		return CE_Failure;
+	}
+	pasBlock = (CombineBlockInput*) CPLMalloc(nInputFiles * sizeof(CombineBlockInput));
+	GetWindowBlock(psInputRasters, nInputFiles, pasBlock);
+	panIds = (GUInt32*) CPLMalloc((size_t) psLayout->nWinXSize * 
+								psLayout->nWinYSize * sizeof(GUInt32));
+
+	for(iWindow=0;iWindow<psLayout->nWindows && eErr == CE_None;iWindow++) {
+		GetWindow(psLayout, iWindow, &nXOff, &nYOff, &nXSize, &nYSize);
+		dfTimer = GetWallTime();
+		eErr = ReadWindow(psInputRasters, nInputFiles, nXOff, nYOff, nXSize, nYSize);
+		psRunStats->dfRead += GetWallTime() - dfTimer;
+		if(eErr == CE_None) {
+			dfTimer = GetWallTime();
+			poEngine->AddBlock(pasBlock, nXSize, nYSize, panIds);
+			psRunStats->dfCount += GetWallTime() - dfTimer;
+		}
+		
+		//write the window to the output raster if needed
+		if(eErr == CE_None && hOutBand != NULL) {
+			SetWindowIds(panIds, (size_t) nXSize * nYSize, psSpill->nIdBase, NULL);
+			dfTimer = GetWallTime();
+			eErr = GDALRasterIO(hOutBand, GF_Write, nXOff, nYOff, nXSize, nYSize,
+								panIds, nXSize, nYSize, GDT_UInt32, 0, 0);
+			if(eErr == CE_None && poOverviews != NULL)
+				eErr = poOverviews->AddWindow(nYSize, panIds);
+			psRunStats->dfWrite += GetWallTime() - dfTimer;
+		}
+		if(eErr == CE_None)
+			eErr = CheckSpill(psSpill, poEngine->poTable);
+							
+		if(pfnProgress != NULL)
+			pfnProgress((iWindow + 1) / (double) psLayout->nWindows, NULL, pProgressData);
+	}
+
+	CPLFree(pasBlock);
+	CPLFree(panIds);
+	return eErr;
+}
+
+/************************************************************************/
+/* ==================================================================== */
+/*      Cross-tabulation (-crosstab).                                   */
+/*                                                                      */
+/*      Pairs of inputs, e.g. the same layer in consecutive years, are  */
+/*      tabulated against each other in a single pass: each window is   */
+/*      read once and counted by one CombineEngine per pair, keyed on   */
+/*      the two values. A pair of integer inputs whose value ranges are */
+/*      known and small enough is counted in a dense matrix (the dense  */
+/*      index of its table). The result is written as a long-form CSV   */
+/*      with one row per pair and transition, in order of first         */
+/*      occurrence within each pair.                                    */
+/* ==================================================================== */
+/************************************************************************/
+
+typedef struct {
+	int iFrom;
+	int iTo;
+	InputRaster asInputs[2];	/* the two inputs keyed on their own */
+	CombineEngine *poEngine;
+	CombineBlockInput asBlock[2];
+} CrosstabPair;
+
+/************************************************************************/
+/*                         ParseCrosstabPairs()                         */
+/*                                                                      */
+/*      Add the pairs of a -crosstab option to *ppanPairs (from and to  */
+/*      input index of each). Pairs are given as from:to input numbers  */
+/*      counting from 1, separated by commas, or as CONSECUTIVE for     */
+/*      1:2,2:3,...                                                     */
+/************************************************************************/
+
+static int ParseCrosstabPairs(const char *pszOption, int nInputFiles, 
+								int **ppanPairs, int *pnPairs)
+{
+	char **papszPairs;
+	int i, iFrom, iTo;
+
+	if(EQUAL(pszOption, "CONSECUTIVE")) {
+		for(i=0;i+1<nInputFiles;i++) {
+			*ppanPairs = (int*) CPLRealloc(*ppanPairs, (*pnPairs + 1) * 2 * sizeof(int));
+			(*ppanPairs)[*pnPairs * 2] = i;
+			(*ppanPairs)[*pnPairs * 2 + 1] = i + 1;
+			(*pnPairs)++;
+		}
+		return TRUE;
+	}
+
+	papszPairs = CSLTokenizeString2(pszOption, ",", 0);
+	for(i=0;papszPairs != NULL && papszPairs[i] != NULL;i++) {
+		if(sscanf(papszPairs[i], "%d:%d", &iFrom, &iTo) != 2 ||
+			iFrom < 1 || iFrom > nInputFiles || iTo < 1 || iTo > nInputFiles) {
+			CPLError(CE_Failure, CPLE_IllegalArg, 
+					"-crosstab %s: invalid pair %s, expected from:to input numbers "
+					"between 1 and %d", pszOption, papszPairs[i], nInputFiles);
+			CSLDestroy(papszPairs);
+			return FALSE;
+		}
+		*ppanPairs = (int*) CPLRealloc(*ppanPairs, (*pnPairs + 1) * 2 * sizeof(int));
+		(*ppanPairs)[*pnPairs * 2] = iFrom - 1;
+		(*ppanPairs)[*pnPairs * 2 + 1] = iTo - 1;
+		(*pnPairs)++;
+	}
+	CSLDestroy(papszPairs);
+	return TRUE;
+}
+
+/************************************************************************/
+/*                          InitCrosstabPair()                          */
+/*                                                                      */
+/*      Set up the engine of a pair, with a dense index if it takes at  */
+/*      most dfMaxDenseSlots.                                           */
+/************************************************************************/
+
+static void InitCrosstabPair(CrosstabPair *psPair, const InputRaster *psInputRasters,
+							int iFrom, int iTo, double dfMaxDenseSlots)
+{
+	GInt32 anMin[2], anMax[2];
+	int i;
+
+	psPair->iFrom = iFrom;
+	psPair->iTo = iTo;
+	psPair->asInputs[0] = psInputRasters[iFrom];
+	psPair->asInputs[1] = psInputRasters[iTo];
+	SetKeyLayout(psPair->asInputs, 2);
+	psPair->poEngine = new CombineEngine(psPair->asInputs, 2);
+
+	//only ranges known without reading the data, which would be another pass
+	for(i=0;i<2;i++) {
+		if(!psPair->asInputs[i].bIsIntDataType ||
+			!GetInputValueRange(&psPair->asInputs[i], FALSE, &anMin[i], &anMax[i]))
+			return;
+	}
+	if(((double) anMax[0] - anMin[0] + 1.0) * ((double) anMax[1] - anMin[1] + 1.0) 
+			<= dfMaxDenseSlots)
+		psPair->poEngine->poTable->InitDenseIndex(anMin, anMax);
 }
 
 /************************************************************************/
-/* "itoa" v. 0.4: Written by Luks Chmela: Released under GPLv3.        */
-/*  http://www.strudel.org.uk/itoa/                                     */
+/*                          CombineCrosstab()                           */
+/*                                                                      */
+/*      Read every window of the inputs once and count it into the      */
+/*      engine of each pair.                                            */
 /************************************************************************/
-char* itoa_(int value, char* result, int base) {
-	if (base < 2 || base > 36) {
-		*result = '\0';
-		return result;
+
+static CPLErr CombineCrosstab(InputRaster *psInputRasters, int nInputFiles,
+							const WindowLayout *psLayout, CrosstabPair *pasPairs, 
+							int nPairs, GDALProgressFunc pfnProgress, void *pProgressData)
+{
+	CombineBlockInput *pasBlock;
+	CPLErr eErr = CE_None;
+	int i, iWindow, nXOff, nYOff, nXSize, nYSize;
+
+	if(!AllocateWindowBuffers(psInputRasters, nInputFiles, 
+						(size_t) psLayout->nWinXSize * psLayout->nWinYSize)) {
+		CPLError(CE_Failure, CPLE_OutOfMemory, "Could not allocate window buffers");
+		return CE_Failure;
 	}
+	pasBlock = (CombineBlockInput*) CPLMalloc(nInputFiles * sizeof(CombineBlockInput));
+	GetWindowBlock(psInputRasters, nInputFiles, pasBlock);
+	for(i=0;i<nPairs;i++) {
+		pasPairs[i].asBlock[0] = pasBlock[pasPairs[i].iFrom];
+		pasPairs[i].asBlock[1] = pasBlock[pasPairs[i].iTo];
+	}
+
+	for(iWindow=0;iWindow<psLayout->nWindows && eErr == CE_None;iWindow++) {
+		GetWindow(psLayout, iWindow, &nXOff, &nYOff, &nXSize, &nYSize);
+		//one input at a time, as a window with no valid pixel in one input
+		//is only empty for the pairs of that input
+		for(i=0;i<nInputFiles && eErr == CE_None;i++)
+			eErr = ReadWindow(&psInputRasters[i], 1, nXOff, nYOff, nXSize, nYSize);
+		for(i=0;i<nPairs && eErr == CE_None;i++)
+			pasPairs[i].poEngine->AddBlock(pasPairs[i].asBlock, nXSize, nYSize, NULL);
+
+		if(pfnProgress != NULL)
+			pfnProgress((iWindow + 1) / (double) psLayout->nWindows, NULL, pProgressData);
+	}
+
+	CPLFree(pasBlock);
+	return eErr;
+}
+
+typedef struct {
+	BufferedWriter *psCSV;
+	const CrosstabPair *psPair;
+	const char *pszPrefix;		/* "from,to," */
+	char *pszRow;
+} CrosstabWriteContext;
+
+/************************************************************************/
+/*                        WriteCrosstabEntry()                          */
+/************************************************************************/
+
+static int WriteCrosstabEntry(size_t /* iEntry */, GUIntBig nCount, const GUInt32 *panKey,
+							const double * /* padfStats */, void *pData)
+{
+	CrosstabWriteContext *psContext = (CrosstabWriteContext*) pData;
+	int nLen;
+
+	nLen = sprintf(psContext->pszRow, "%s", psContext->pszPrefix);
+	FormatCombinationKey(psContext->psPair->asInputs, 2, panKey, psContext->pszRow + nLen);
+	nLen += strlen(psContext->pszRow + nLen);
+	nLen += sprintf(psContext->pszRow + nLen, "," CPL_FRMT_GUIB "\n", nCount);
+	WriteBuffered(psContext->psCSV, psContext->pszRow, nLen);
+	return TRUE;
+}
+
+/************************************************************************/
+/*                           WriteCrosstab()                            */
+/************************************************************************/
 
-	char* ptr = result, *ptr1 = result, tmp_char;
-	int tmp_value;
+static int WriteCrosstab(VSILFILE *fpCSV, const CrosstabPair *pasPairs, int nPairs)
+{
+	BufferedWriter sCSVWriter;
+	CrosstabWriteContext sContext;
+	char *pszFrom, *pszPrefix;
+	int i;
 
-	do {
-		tmp_value = value;
-		value /= base;
-		*ptr++ = "zyxwvutsrqponmlkjihgfedcba9876543210123456789abcdefghijklmnopqrstuvwxyz" 
-			[35 + (tmp_value - value * base)];
-	} while (value);
+	InitBufferedWriter(&sCSVWriter, fpCSV, 0, 1024 * 1024);
+	WriteBuffered(&sCSVWriter, "FROM,TO,FROM_VALUE,TO_VALUE,COUNT\n", 34);
 
-	if (tmp_value < 0) *ptr++ = '-';
-	*ptr-- = '\0';
-	while(ptr1 < ptr) {
-		tmp_char = *ptr;
-		*ptr--= *ptr1;
-		*ptr1++ = tmp_char;
+	sContext.psCSV = &sCSVWriter;
+	for(i=0;i<nPairs;i++) {
+		pszFrom = CPLStrdup(GetInputName(&pasPairs[i].asInputs[0]));
+		pszPrefix = CPLStrdup(CPLSPrintf("%s,%s,", pszFrom, 
+										GetInputName(&pasPairs[i].asInputs[1])));
+		CPLFree(pszFrom);
+		sContext.pszPrefix = pszPrefix;
+		sContext.psPair = &pasPairs[i];
+		sContext.pszRow = (char*) CPLMalloc(strlen(pszPrefix) + 2 * 32 + 32);
+		pasPairs[i].poEngine->ForEach(WriteCrosstabEntry, &sContext);
+		CPLFree(sContext.pszRow);
+		CPLFree(pszPrefix);
 	}
-	return result;
+	return CloseBufferedWriter(&sCSVWriter);
+}
+
+/************************************************************************/
+/* ==================================================================== */
+/*      Run statistics (-stats, -stats_json).                           */
+/* ==================================================================== */
+/************************************************************************/
+
+/************************************************************************/
+/*                           PrintRunStats()                            */
+/************************************************************************/
+
+static void PrintRunStats(const RunStats *psRunStats, const CombinationTable *poTable,
+						GUIntBig nPixels, GUIntBig nCombinations, double dfWallTime)
+{
+	double dfMeanProbe;
+	size_t nMaxProbe;
+
+	printf("Wall time: %.3f s, %.0f pixels per second\n", dfWallTime,
+			dfWallTime > 0 ? nPixels / dfWallTime : 0.0);
+	printf("  read %.3f s, key build and lookup %.3f s, merge %.3f s, spill %.3f s,\n"
+			"  raster write %.3f s, table write %.3f s\n",
+			psRunStats->dfRead, psRunStats->dfCount, psRunStats->dfMerge, 
+			psRunStats->dfSpill, psRunStats->dfWrite, psRunStats->dfTable);
+	printf("Unique combinations: " CPL_FRMT_GUIB "\n", nCombinations);
+	printf("Peak table memory: %.1f MB\n", 
+			(poTable->GetMemoryUsage() + psRunStats->nWindowTableMem) / (1024.0 * 1024.0));
+	if(poTable->IsDense())
+		printf("Index: dense\n");
+	else if(poTable->GetProbeLengths(&dfMeanProbe, &nMaxProbe))
+		printf("Index: hashed, %lu slots, load factor %.3f, "
+				"probe length %.3f mean, %lu max\n",
+				(unsigned long) poTable->GetSlotCount(),
+				poTable->nEntries / (double) poTable->GetSlotCount(),
+				dfMeanProbe, (unsigned long) nMaxProbe);
 }
 
 /************************************************************************/
-/*                          WriteDataToCSVForEach()                     */
+/*                         WriteRunStatsJSON()                          */
+/*                                                                      */
+/*      Write the -stats figures to a JSON file. Index figures are      */
+/*      those of the table at the end of the run, which is the last     */
+/*      part of a spilled table.                                        */
 /************************************************************************/
 
-static int WriteDataToCSVForEach(void* elt, void* user_data) {
-    FILE* fp = (FILE*) user_data;
-    Combination* cmb = (Combination*) elt;
-	
-	//be sure there is no trailing comma in the cmb string
-	if(EQUAL(&cmb->pszCombination[strlen(cmb->pszCombination)], ","))
-		cmb->pszCombination[strlen(cmb->pszCombination)-1] = '\0';
-		
-	VSIFPrintf(fp, "%u,%llu,%s\n", cmb->nID, cmb->nCount, cmb->pszCombination);
+static int WriteRunStatsJSON(const char *pszFilename, const RunStats *psRunStats,
+							const CombineEngine *poEngine, GUIntBig nPixels, 
+							GUIntBig nCombinations, double dfWallTime, 
+							int nThreads, int nQueue, int nSpillRuns)
+{
+	const CombinationTable *poTable = poEngine->poTable;
+	VSILFILE *fp;
+	double dfMeanProbe;
+	size_t nMaxProbe;
+	int bHashed;
+
+	fp = VSIFOpenL(pszFilename, "wb");
+	if(fp == NULL)
+		return FALSE;
+
+	bHashed = !poTable->IsDense() && poTable->GetProbeLengths(&dfMeanProbe, &nMaxProbe);
 
-    return TRUE;
+	VSIFPrintfL(fp, "{\n");
+	VSIFPrintfL(fp, "  \"pixels\": " CPL_FRMT_GUIB ",\n", nPixels);
+	VSIFPrintfL(fp, "  \"threads\": %d,\n", nThreads);
+	VSIFPrintfL(fp, "  \"queue\": %d,\n", nThreads > 1 ? 0 : nQueue);
+	VSIFPrintfL(fp, "  \"wall_seconds\": %.6f,\n", dfWallTime);
+	VSIFPrintfL(fp, "  \"pixels_per_second\": %.1f,\n", 
+				dfWallTime > 0 ? nPixels / dfWallTime : 0.0);
+	VSIFPrintfL(fp, "  \"phase_seconds\": {\n");
+	VSIFPrintfL(fp, "    \"read\": %.6f,\n", psRunStats->dfRead);
+	VSIFPrintfL(fp, "    \"key_build_and_lookup\": %.6f,\n", psRunStats->dfCount);
+	VSIFPrintfL(fp, "    \"merge\": %.6f,\n", psRunStats->dfMerge);
+	VSIFPrintfL(fp, "    \"spill\": %.6f,\n", psRunStats->dfSpill);
+	VSIFPrintfL(fp, "    \"raster_write\": %.6f,\n", psRunStats->dfWrite);
+	VSIFPrintfL(fp, "    \"table_write\": %.6f\n", psRunStats->dfTable);
+	VSIFPrintfL(fp, "  },\n");
+	VSIFPrintfL(fp, "  \"unique_combinations\": " CPL_FRMT_GUIB ",\n", nCombinations);
+	VSIFPrintfL(fp, "  \"spill_runs\": %d,\n", nSpillRuns);
+	VSIFPrintfL(fp, "  \"peak_table_memory_bytes\": " CPL_FRMT_GUIB ",\n",
+				(GUIntBig) (poTable->GetMemoryUsage() + psRunStats->nWindowTableMem));
+	VSIFPrintfL(fp, "  \"index\": \"%s\",\n", 
+				poTable->IsDense() ? "dense" : "hashed");
+	if(bHashed) {
+		VSIFPrintfL(fp, "  \"hash_slots\": %lu,\n", (unsigned long) poTable->GetSlotCount());
+		VSIFPrintfL(fp, "  \"load_factor\": %.6f,\n", 
+					poTable->nEntries / (double) poTable->GetSlotCount());
+		VSIFPrintfL(fp, "  \"mean_probe_length\": %.6f,\n", dfMeanProbe);
+		VSIFPrintfL(fp, "  \"max_probe_length\": %lu,\n", (unsigned long) nMaxProbe);
+	}
+	VSIFPrintfL(fp, "  \"pixels_left_reused\": " CPL_FRMT_GUIB ",\n", 
+				poEngine->sStats.nLeftHits);
+	VSIFPrintfL(fp, "  \"pixels_above_reused\": " CPL_FRMT_GUIB ",\n", 
+				poEngine->sStats.nAboveHits);
+	VSIFPrintfL(fp, "  \"pixels_looked_up\": " CPL_FRMT_GUIB ",\n", 
+				poEngine->sStats.nLookups);
+	VSIFPrintfL(fp, "  \"pixels_skipped\": " CPL_FRMT_GUIB "\n", 
+				poEngine->sStats.nSkipped);
+	VSIFPrintfL(fp, "}\n");
+
+	return VSIFCloseL(fp) == 0;
 }
 
 /************************************************************************/
@@ -125,33 +4898,77 @@ static int WriteDataToCSVForEach(void* elt, void* user_data) {
 
 int main(int argc, char ** argv) {
 
-    GDALDatasetH hOutDS;
+    GDALDatasetH hOutDS = NULL;
     GDALDriverH hDriver;
-	GDALRasterBandH hOutBand;
+	GDALRasterBandH hOutBand = NULL;
 	InputRaster *psInputRasters;
 	CPLErr eErr;
-    int	i, nXoff, nYoff;
+    int	i;
     int	nXSize, nYSize;
 	const char *pszCSVFile=NULL;
     const char *pszOutRaster=NULL, *pszOutFormat = "GTiff";
 	const char *pszOutDataType = NULL;
     GDALDataType eOutDataType = GDT_UInt16;
-    double adfGeoTransform[6];
     char **papszCreateOptions = NULL;
-	unsigned int *panOutline;
+	char **papszQuant = NULL;
+	char **papszSkipNodata = NULL;
+	char **papszStatFiles = NULL;
+	int nStatFiles = 0;
+	char **papszCrosstab = NULL;
+	int bSkipNodata = FALSE;
+    double adfGeoTransform[6];
+	int bHasGeoTransform;
+	WindowLayout sLayout;
     int nInputFiles = 0;
     char **ppszInputFilenames = NULL;
 	int bQuiet = FALSE;
     GDALProgressFunc pfnProgress = GDALTermProgress;
 	void* pProgressData = NULL;
-	static CPLHashSet* phAllCombination = NULL;
-	char szTmp[16];
-	unsigned int nCmbID = 0;
-	FILE* fp;
+	CombineEngine *poEngine = NULL;
+	CombinationTable *poTable = NULL;
+	size_t iEntry;
+	unsigned int nInitID = 0;
+	int bInitIDSet = FALSE;
+	GUIntBig nMaxID;
+	int bAutoType = FALSE;
+	int nKeyWords = 0;
+	int nDenseMemMB = 1024;
+	GInt32 *panRangeMin = NULL, *panRangeMax = NULL;
+	int bLocalDense = FALSE;
+	int nThreads = 1;
+	int nQueue = 3;
+	int nBufferMemMB = 64;
+	double dfCounted;
+	int nMaxMemMB = 0;
+	double dfSamplePct = 1.0, dfEstimate = -1.0, dfEntryBytes;
+	SpillState sSpill;
+	GDALDatasetH hIdDS = NULL;
+	GDALRasterBandH hIdBand = NULL;
+	const char *pszOvrResampling = NULL;
+	OverviewBuilder *poOverviews = NULL;
+	const char *pszOptionList;
+	char *pszIdRaster = NULL, *pszRecordFile = NULL;
+	char *pszMapFile = NULL;
+	GUIntBig nCombinations, iRecord;
+	GUInt32 *panRecord = NULL;
+	VSILFILE *fpRecords = NULL;
+	VSILFILE *fpCSV = NULL;
+	BufferedWriter sCSVWriter;
+	const char *pszBinFile = NULL;
+	BinaryTable sBinTable;
+	TableWriteContext sWriteContext;
+	int bWriteOK = TRUE;
+	GUIntBig nRows;
+	const char *pszDictFile = NULL;
+	char *pszDictTemp = NULL;
+	CombinationDictionary sDict;
 	char *pszVarList = NULL;
 	int nChar = 0;
-	clock_t start, finish;
-	double dfDuration;
+	char *pszKeyText = NULL;
+	int bStats = FALSE;
+	const char *pszStatsFile = NULL;
+	RunStats sRunStats;
+	double dfStart, dfTimer, dfDuration;
 
 /* -------------------------------------------------------------------- */
 /*      Register standard GDAL drivers and process command options.     */
@@ -180,6 +4997,9 @@ int main(int argc, char ** argv) {
 			else if(EQUAL(pszOutDataType,"UInt32")) {
 				eOutDataType = GDT_UInt32;
 			}
+			else if(EQUAL(pszOutDataType,"Auto")) {
+				bAutoType = TRUE;
+			}
 			else {
 				fprintf(stderr, "Output data type %s is not valid.\n\n", argv[i]);
 				Usage();
@@ -188,26 +5008,77 @@ int main(int argc, char ** argv) {
 			}
 		}
 
-		else if(EQUAL(argv[i],"-initid") && i < argc-1)
-            nCmbID = atoi(argv[++i]);
+		else if(EQUAL(argv[i],"-ovr") && i < argc-1) {
+            pszOvrResampling = argv[++i];
+			if(EQUAL(pszOvrResampling,"NONE")) {
+				pszOvrResampling = NULL;
+			}
+			else if(!EQUAL(pszOvrResampling,"NEAREST") && !EQUAL(pszOvrResampling,"MODE")) {
+				fprintf(stderr, "Overview resampling %s is not valid.\n\n", argv[i]);
+				Usage();
+				GDALDestroyDriverManager();
+				exit(1);
+			}
+		}
+
+		else if(EQUAL(argv[i],"-initid") && i < argc-1) {
+            nInitID = atoi(argv[++i]);
+			bInitIDSet = TRUE;
+		}
+			
+		else if(EQUAL(argv[i],"-dense_mem") && i < argc-1)
+            nDenseMemMB = atoi(argv[++i]);
+			
+		else if(EQUAL(argv[i],"-threads") && i < argc-1) {
+			i++;
+			if(EQUAL(argv[i],"ALL_CPUS"))
+				nThreads = CPLGetNumCPUs();
+			else
+				nThreads = atoi(argv[i]);
+			if(nThreads < 1)
+				nThreads = 1;
+		}
+			
+		else if(EQUAL(argv[i],"-queue") && i < argc-1) {
+            nQueue = atoi(argv[++i]);
+			if(nQueue < 1)
+				nQueue = 1;
+		}
+			
+		else if(EQUAL(argv[i],"-buffer_mem") && i < argc-1)
+            nBufferMemMB = atoi(argv[++i]);
+			
+		else if(EQUAL(argv[i],"-max_mem") && i < argc-1)
+            nMaxMemMB = atoi(argv[++i]);
+			
+		else if(EQUAL(argv[i],"-sample_pct") && i < argc-1)
+            dfSamplePct = CPLAtof(argv[++i]);
 			
 		else if(EQUAL(argv[i],"-csv") && i < argc-1)
             pszCSVFile = argv[++i];
 			
-        else if(EQUAL(argv[i],"-co") && i < argc-1) {
-            papszCreateOptions = CSLAddString(papszCreateOptions, argv[++i]);
-        }
-        else if (EQUAL(argv[i],"-q") || EQUAL(argv[i],"-quiet")) {
-            bQuiet = TRUE;
-        }
-		
-        else if(argv[i][0] == '-') {
-            fprintf(stderr, "Option %s incomplete, or not recognised.\n\n", argv[i]);
-            Usage();
-            GDALDestroyDriverManager();
-            exit(1);
-        }
-		
+		else if(EQUAL(argv[i],"-bin") && i < argc-1)
+            pszBinFile = argv[++i];
+			
+		else if(EQUAL(argv[i],"-dict") && i < argc-1)
+            pszDictFile = argv[++i];
+			
+		else if(EQUAL(argv[i],"-quant") && i < argc-1)
+            papszQuant = CSLAddString(papszQuant, argv[++i]);
+			
+		else if(EQUAL(argv[i],"-stat") && i < argc-1) {
+            papszStatFiles = CSLAddString(papszStatFiles, argv[++i]);
+			nStatFiles++;
+		}
+			
+		else if(EQUAL(argv[i],"-crosstab") && i < argc-1)
+            papszCrosstab = CSLAddString(papszCrosstab, argv[++i]);
+			
+		else if(EQUAL(argv[i],"-skip_nodata") && i < argc-1) {
+            papszSkipNodata = CSLAddString(papszSkipNodata, argv[++i]);
+			bSkipNodata = TRUE;
+		}
+			
         else if(EQUAL(argv[i],"-input_file_list") && i < argc-1) {
             const char* input_file_list = argv[++i];
             FILE* f = VSIFOpen(input_file_list, "r");
@@ -222,25 +5093,74 @@ int main(int argc, char ** argv) {
                 VSIFClose(f);
             }
         }
+			
+        else if(EQUAL(argv[i],"-co") && i < argc-1) {
+            papszCreateOptions = CSLAddString(papszCreateOptions, argv[++i]);
+        }
+        else if (EQUAL(argv[i],"-q") || EQUAL(argv[i],"-quiet")) {
+            bQuiet = TRUE;
+        }
+		
+		else if(EQUAL(argv[i],"-stats"))
+            bStats = TRUE;
+			
+		else if(EQUAL(argv[i],"-stats_json") && i < argc-1)
+            pszStatsFile = argv[++i];
+		
+        else if(argv[i][0] == '-') {
+            fprintf(stderr, "Option %s incomplete, or not recognised.\n\n", argv[i]);
+            Usage();
+            GDALDestroyDriverManager();
+            exit(1);
+        }
 
         else {
             add_file_to_list(argv[i], &nInputFiles, &ppszInputFilenames);
         }
 	}
 		
-    if(pszCSVFile == NULL || nInputFiles == 0) {
+    if((pszCSVFile == NULL && pszBinFile == NULL) || nInputFiles == 0) {
         Usage();
 		GDALDestroyDriverManager();
 		exit(1);
 	}
 	
-	fp = VSIFOpen(pszCSVFile, "wt");
-	if(fp == NULL) {
-		fprintf(stderr, "Can't open %s for writing output CSV file\n", pszCSVFile);
+	//IDs are only final once the runs of a spilled table are merged
+	if(pszDictFile != NULL && nMaxMemMB > 0) {
+		fprintf(stderr, "-dict can't be used with -max_mem\n");
+		GDALDestroyDriverManager();
+		exit(1);
+	}
+	//spilled runs only hold keys and counts
+	if(nStatFiles > 0 && nMaxMemMB > 0) {
+		fprintf(stderr, "-stat can't be used with -max_mem\n");
+		GDALDestroyDriverManager();
+		exit(1);
+	}
+	//a cross-tabulation is a CSV of its own
+	if(papszCrosstab != NULL && 
+		(pszCSVFile == NULL || pszOutRaster != NULL || pszBinFile != NULL || 
+		pszDictFile != NULL || nStatFiles > 0 || nMaxMemMB > 0)) {
+		fprintf(stderr, "-crosstab needs -csv and can't be used with -o, -bin, -dict, "
+				"-stat or -max_mem\n");
+		GDALDestroyDriverManager();
+		exit(1);
+	}
+	if(pszOvrResampling != NULL && pszOutRaster == NULL) {
+		fprintf(stderr, "-ovr needs -o\n");
 		GDALDestroyDriverManager();
 		exit(1);
 	}
 	
+	if(pszCSVFile != NULL) {
+		fpCSV = VSIFOpenL(pszCSVFile, "wb");
+		if(fpCSV == NULL) {
+			fprintf(stderr, "Can't open %s for writing output CSV file\n", pszCSVFile);
+			GDALDestroyDriverManager();
+			exit(1);
+		}
+	}
+	
 /* -------------------------------------------------------------------- */
 /*      Find the output driver.                                         */
 /* -------------------------------------------------------------------- */
@@ -265,182 +5185,600 @@ int main(int argc, char ** argv) {
         exit(1);
     }
 
+	//write the output tiled unless told otherwise, for display and its
+	//overviews
+	pszOptionList = GDALGetMetadataItem(hDriver, GDAL_DMD_CREATIONOPTIONLIST, NULL);
+	if(pszOptionList != NULL && strstr(pszOptionList, "'TILED'") != NULL &&
+		CSLFetchNameValue(papszCreateOptions, "TILED") == NULL)
+		papszCreateOptions = CSLSetNameValue(papszCreateOptions, "TILED", "YES");
+
 
     if (!bQuiet) {
 		pfnProgress = GDALTermProgress;
 		printf("Combining %d input files...\n", nInputFiles);
 	}
 	
-	start = clock();
+	dfStart = GetWallTime();
+	memset(&sRunStats, 0, sizeof(RunStats));
 
-	psInputRasters = (InputRaster*) CPLMalloc(nInputFiles*sizeof(InputRaster));
+	//the -stat value rasters follow the inputs
+	psInputRasters = (InputRaster*) CPLMalloc((nInputFiles + nStatFiles) * 
+												sizeof(InputRaster));
 	
 	for (i=0;i<nInputFiles;i++) {
-		psInputRasters[i].hDS = GDALOpen(ppszInputFilenames[i], GA_ReadOnly);
-		if(psInputRasters[i].hDS == NULL) {
+		psInputRasters[i].pszFilename = ParseInputSpec(ppszInputFilenames[i], 
+													&psInputRasters[i].nBand);
+		psInputRasters[i].bIsStat = FALSE;
+		if(!OpenInputRaster(&psInputRasters[i])) {
 			fprintf(stderr, "Could not open dataset: %s\n", ppszInputFilenames[i]);
 			GDALDestroyDriverManager();
 			exit(1);
 		}
-		
-		// TO DO: support specific bands in each raster (for now assume band 1)
-		psInputRasters[i].hBand = GDALGetRasterBand(psInputRasters[i].hDS, 1);
-		psInputRasters[i].eDataType = GDALGetRasterDataType(psInputRasters[i].hBand);
-		
-		// is it integer?
-		if(psInputRasters[i].eDataType == GDT_Byte || psInputRasters[i].eDataType == GDT_UInt16 ||
-			psInputRasters[i].eDataType == GDT_Int16 || psInputRasters[i].eDataType == GDT_UInt32 ||
-			psInputRasters[i].eDataType == GDT_Int32) {
-			psInputRasters[i].bIsIntDataType = TRUE;
+		psInputRasters[i].dfQuantStep = 0.0;
+		psInputRasters[i].bSkipNodata = FALSE;
+	}
+	for (i=0;i<nStatFiles;i++) {
+		InputRaster *psStat = &psInputRasters[nInputFiles + i];
+		psStat->pszFilename = ParseInputSpec(papszStatFiles[i], &psStat->nBand);
+		psStat->bIsStat = TRUE;
+		if(!OpenInputRaster(psStat)) {
+			fprintf(stderr, "Could not open dataset: %s\n", papszStatFiles[i]);
+			GDALDestroyDriverManager();
+			exit(1);
 		}
-		else {
-			psInputRasters[i].bIsIntDataType = FALSE;
+		psStat->dfQuantStep = 0.0;
+		psStat->bSkipNodata = FALSE;
+		psStat->dfNoData = GDALGetRasterNoDataValue(psStat->hBand, &psStat->bHasNoData);
+	}
+	nKeyWords = SetKeyLayout(psInputRasters, nInputFiles + nStatFiles);
+	for(i=0;papszQuant != NULL && papszQuant[i] != NULL;i++) {
+		if(!SetQuantization(psInputRasters, nInputFiles, ppszInputFilenames, 
+							papszQuant[i])) {
+			GDALDestroyDriverManager();
+			exit(1);
 		}
 	}
 	
-	//for now all input rasters must have same extent and cell size...
-	//use first raster as reference
-	nXSize = GDALGetRasterXSize(psInputRasters[0].hDS);
-	nYSize = GDALGetRasterYSize(psInputRasters[0].hDS);
+	//inputs on the same grid are combined over the union of their extents
+	if(!ComputeInputGrid(psInputRasters, nInputFiles + nStatFiles, nInputFiles, 
+						&nXSize, &nYSize, 
+						adfGeoTransform, &bHasGeoTransform)) {
+		fprintf(stderr, "The input rasters must share cell size and alignment\n");
+		GDALDestroyDriverManager();
+		exit(1);
+	}
 	if (!bQuiet)
 		printf("raster size: %d x %d\n", nXSize, nYSize);
-	
+
+	//needs the extent of each input in the grid
+	for(i=0;papszSkipNodata != NULL && papszSkipNodata[i] != NULL;i++) {
+		if(!SetSkipNodata(psInputRasters, nInputFiles, ppszInputFilenames, 
+							papszSkipNodata[i])) {
+			GDALDestroyDriverManager();
+			exit(1);
+		}
+	}
+
 /* -------------------------------------------------------------------- */
-/*      Create the output raster if one is requested.                   */
+/*      With -crosstab, tabulate the pairs of inputs and stop there.    */
 /* -------------------------------------------------------------------- */
-	if(pszOutRaster != NULL) {
-		hOutDS = GDALCreate(hDriver, pszOutRaster, nXSize, nYSize, 1, 
-							eOutDataType, papszCreateOptions);
-		if(hOutDS == NULL) {
-			fprintf(stderr, "Could not create the output raster\n");
+	if(papszCrosstab != NULL) {
+		int *panPairs = NULL, nPairs = 0;
+		CrosstabPair *pasPairs;
+
+		for(i=0;papszCrosstab[i] != NULL;i++) {
+			if(!ParseCrosstabPairs(papszCrosstab[i], nInputFiles, &panPairs, &nPairs)) {
+				GDALDestroyDriverManager();
+				exit(1);
+			}
+		}
+		if(nPairs == 0) {
+			fprintf(stderr, "-crosstab: no pairs of inputs to tabulate\n");
 			GDALDestroyDriverManager();
 			exit(1);
 		}
-							
-		if(GDALGetGeoTransform(psInputRasters[0].hDS, adfGeoTransform) == CE_None)
-			GDALSetGeoTransform(hOutDS, adfGeoTransform);
-		if(GDALGetProjectionRef(psInputRasters[0].hDS) != NULL )
-			GDALSetProjection(hOutDS, GDALGetProjectionRef(psInputRasters[0].hDS));
-		
-		hOutBand = GDALGetRasterBand(hOutDS, 1);
+
+		//the dense memory budget is shared by the pairs
+		pasPairs = (CrosstabPair*) CPLCalloc(nPairs, sizeof(CrosstabPair));
+		for(i=0;i<nPairs;i++) {
+			InitCrosstabPair(&pasPairs[i], psInputRasters, panPairs[i * 2], panPairs[i * 2 + 1],
+							MAX(nDenseMemMB, 0) * 1024.0 * 1024.0 / sizeof(GUInt32) / nPairs);
+		}
+		ComputeWindowLayout(psInputRasters, nInputFiles, nXSize, nYSize,
+							(size_t) MAX(nBufferMemMB, 1) * 1024 * 1024, &sLayout);
+		if (!bQuiet)
+			printf("Tabulating %d pairs in windows of %d x %d\n", nPairs, 
+					sLayout.nWinXSize, sLayout.nWinYSize);
+
+		eErr = CombineCrosstab(psInputRasters, nInputFiles, &sLayout, pasPairs, nPairs,
+								bQuiet ? NULL : pfnProgress, pProgressData);
+		if(eErr == CE_None)
+			bWriteOK = WriteCrosstab(fpCSV, pasPairs, nPairs);
+		bWriteOK &= VSIFCloseL(fpCSV) == 0;
+		if(eErr != CE_None || !bWriteOK) {
+			fprintf(stderr, "gdal_combine failed\n");
+			GDALDestroyDriverManager();
+			exit(1);
+		}
+
+		dfDuration = GetWallTime() - dfStart;
+		if (!bQuiet) {
+			printf("Cross-tabulation written to: %s\n", pszCSVFile);
+			printf("gdal_combine completed in %2.1f seconds\n\n", dfDuration);
+		}
+
+		for(i=0;i<nPairs;i++)
+			delete pasPairs[i].poEngine;
+		CPLFree(pasPairs);
+		CPLFree(panPairs);
+		CloseInputRasters(psInputRasters, nInputFiles);
+		for (i=0;i<nInputFiles;i++) {
+			CPLFree(ppszInputFilenames[i]);
+			CPLFree((char*) psInputRasters[i].pszFilename);
+		}
+		CPLFree(psInputRasters);
+		CPLFree(ppszInputFilenames);
+		CSLDestroy(papszCrosstab);
+		CSLDestroy(papszQuant);
+		CSLDestroy(papszSkipNodata);
+		GDALDestroyDriverManager();
+		CSLDestroy(argv);
+		return 0;
 	}
 	
 /* -------------------------------------------------------------------- */
-/*      Process the inputs.							                    */
+/*      Start from the combinations of a dictionary if one is given.    */
 /* -------------------------------------------------------------------- */
-
-	for(i=0;i<nInputFiles;i++) {
-		if(psInputRasters[i].bIsIntDataType) {
-			psInputRasters[i].panScanline = (int*) VSIMalloc2(nXSize, sizeof(int));
+	poEngine = new CombineEngine(psInputRasters, nInputFiles + nStatFiles);
+	poTable = poEngine->poTable;
+	
+	if(pszDictFile != NULL) {
+		if(!LoadDictionary(&sDict, pszDictFile, psInputRasters, nInputFiles, 
+							nKeyWords, poTable)) {
+			fprintf(stderr, "Could not use the dictionary %s\n", pszDictFile);
+			GDALDestroyDriverManager();
+			exit(1);
 		}
-		else {
-			//if not integer read as 64-bit float
-			psInputRasters[i].padfScanline = (double*) VSIMalloc2(nXSize, sizeof(double));
+		if(sDict.bLoaded) {
+			if(bInitIDSet && nInitID != sDict.nInitID) {
+				fprintf(stderr, "-initid %u does not match the first ID of the "
+						"dictionary (%u)\n", nInitID, sDict.nInitID);
+				GDALDestroyDriverManager();
+				exit(1);
+			}
+			nInitID = sDict.nInitID;
+			if (!bQuiet)
+				printf("%lu combinations loaded from %s\n", 
+						(unsigned long) sDict.nLoaded, pszDictFile);
 		}
 	}
+
+	//ID 0 is kept for the skipped pixels
+	if(bSkipNodata && nInitID == 0) {
+		if(bInitIDSet || (pszDictFile != NULL && sDict.bLoaded)) {
+			fprintf(stderr, "-skip_nodata needs combination IDs from 1 up, "
+					"0 is the nodata value of the output\n");
+			GDALDestroyDriverManager();
+			exit(1);
+		}
+		nInitID = 1;
+	}
 	
-	if(pszOutRaster != NULL)
-		panOutline = (unsigned int*) VSIMalloc2(nXSize, sizeof(unsigned int));
-	
-	phAllCombination = CPLHashSetNew(CombinationHashFunc, CombinationEqualFunc, CombinationFreeFunc);
+/* -------------------------------------------------------------------- */
+/*      Estimate the number of combinations from a sample of windows.   */
+/* -------------------------------------------------------------------- */
+	//rough table memory per combination, with the hash slots
+	dfEntryBytes = nKeyWords * sizeof(GUInt32) + sizeof(GUIntBig) + 
+					nStatFiles * STAT_FIELDS * sizeof(double) + 3 * 2 * sizeof(GUInt32);
+
+	if(dfSamplePct > 0 && poTable->nEntries == 0) {
+		dfEstimate = EstimateCombinations(psInputRasters, nInputFiles, nKeyWords, 
+										nXSize, nYSize, MIN(dfSamplePct, 50.0),
+										(size_t) MAX(nBufferMemMB, 1) * 1024 * 1024);
+		if(dfEstimate >= 0 && !bQuiet)
+			printf("Estimated at least %.0f combinations from a %g%% sample\n", 
+					dfEstimate, MIN(dfSamplePct, 50.0));
+	}
+
+	//spill to disk if even the estimate would take more than half of the RAM
+#if GDAL_VERSION_NUM >= 2000000
+	if(dfEstimate > 0 && nMaxMemMB == 0 && pszDictFile == NULL && nStatFiles == 0) {
+		GIntBig nRAM = CPLGetUsablePhysicalRAM();
+		if(nRAM > 0 && dfEstimate * dfEntryBytes > nRAM / 2) {
+			nMaxMemMB = (int) MIN(nRAM / 2 / (1024 * 1024), (GIntBig) 2147483647);
+			if (!bQuiet)
+				printf("The table will not fit in memory, using -max_mem %d\n", nMaxMemMB);
+		}
+	}
+#endif
 	
-	/* scan input rasters and gather combinations in the hash set */
-	for(nYoff=0;nYoff<nYSize;nYoff++) {
-		for(i=0;i<nInputFiles;i++) {
-			if(psInputRasters[i].bIsIntDataType) {
-				GDALRasterIO(psInputRasters[i].hBand, GF_Read, 0, nYoff, nXSize, 1, 
-					psInputRasters[i].panScanline, nXSize, 1, GDT_Int32, 0, 0);
-			}
-			else {
-				GDALRasterIO(psInputRasters[i].hBand, GF_Read, 0, nYoff, nXSize, 1, 
-					psInputRasters[i].padfScanline, nXSize, 1, GDT_Float64, 0, 0);
-			}
+/* -------------------------------------------------------------------- */
+/*      Create the output raster if one is requested.                   */
+/* -------------------------------------------------------------------- */
+	//with -ot Auto, pick the type now if a cheap bound on the number of
+	//combinations allows it, otherwise once they have been counted
+	if(pszOutRaster != NULL && bAutoType) {
+		double dfBound = GetMaxCombinationsBound(psInputRasters, nInputFiles, 
+												nXSize, nYSize);
+		dfBound += (double) poTable->nEntries;
+		if(nInitID + dfBound - 1.0 <= 65535.0) {
+			eOutDataType = SmallestIdType((GUIntBig) (nInitID + dfBound - 1.0));
+			bAutoType = FALSE;
+			if (!bQuiet)
+				printf("Output data type: %s\n", GDALGetDataTypeName(eOutDataType));
 		}
-		for(nXoff=0;nXoff<nXSize;nXoff++) {
-			Combination* cmb = (Combination*) VSIMalloc2(1, sizeof(Combination));
-			cmb->pszCombination = (char*) VSIMalloc2(nInputFiles, 16);
-			if (cmb == NULL || cmb->pszCombination == NULL) {
-				CPLError(CE_Fatal, CPLE_OutOfMemory,
-						"VSIMalloc2(): Out of memory. "
-						"Can't allocate enough memory to hold all unique combinations\n");
+		//a larger type is only wasteful if the estimate is wrong, so take
+		//it as soon as the estimate clearly needs it, even if 3% too high
+		else if(nInitID + dfEstimate * 0.97 - 1.0 > 65535.0) {
+			eOutDataType = GDT_UInt32;
+			bAutoType = FALSE;
+			if (!bQuiet)
+				printf("Output data type: %s\n", GDALGetDataTypeName(eOutDataType));
+		}
+	}
+
+	if(pszOutRaster != NULL) {
+		if(!bAutoType) {
+			hOutDS = CreateOutputRaster(hDriver, pszOutRaster, nXSize, nYSize, 
+										eOutDataType, papszCreateOptions, 
+										bHasGeoTransform ? adfGeoTransform : NULL,
+										psInputRasters[0].hDS, bSkipNodata);
+			if(hOutDS == NULL) {
+				fprintf(stderr, "Could not create the output raster\n");
+				GDALDestroyDriverManager();
+				exit(1);
 			}
-			cmb->pszCombination[0] = '\0';
-			
-			for(i=0;i<(nInputFiles);i++) {
-				if(psInputRasters[i].bIsIntDataType) {
-					//itoa is much faster...
-					itoa_(psInputRasters[i].panScanline[nXoff], szTmp, 10);
-					//sprintf(szTmp, "%ld", psInputRasters[i].panScanline[nXoff]);
-				}
-				else {
-					sprintf(szTmp, "%.f", psInputRasters[i].padfScanline[nXoff]);
+			hOutBand = GDALGetRasterBand(hOutDS, 1);
+			hIdBand = hOutBand;
+			if(pszOvrResampling != NULL) {
+				poOverviews = new OverviewBuilder(nXSize, nYSize, EQUAL(pszOvrResampling, "MODE"),
+												bSkipNodata);
+				if(!poOverviews->CreateLevels(hOutDS)) {
+					fprintf(stderr, "Could not create the overviews of the output raster\n");
+					GDALDestroyDriverManager();
+					exit(1);
 				}
-				//CPLStrlcat(cmb->pszCombination, szTmp, (nInputFiles * 16));
-				strcat(cmb->pszCombination, szTmp);
-				if(i < (nInputFiles-1))
-					//CPLStrlcat(cmb->pszCombination, ",", (nInputFiles * 16));
-					strcat(cmb->pszCombination, ",");
+				if (!bQuiet && poOverviews->nLevels > 0)
+					printf("Building %d %s overview levels as the IDs are written\n", 
+							poOverviews->nLevels, pszOvrResampling);
 			}
-			
-			if(Combination* elt = (Combination*) CPLHashSetLookup(phAllCombination, cmb)) {
-				cmb->nID = elt->nID;
-				cmb->nCount = elt->nCount + 1;
+		}
+
+		//if the table may be spilled or the output type is not known yet,
+		//provisional IDs are written to a UInt32 raster and copied to the
+		//output at the end
+		if(bAutoType || (nMaxMemMB > 0 && eOutDataType != GDT_UInt32)) {
+			pszIdRaster = CPLStrdup(CPLGenerateTempFilename("gdal_combine_ids"));
+			hIdDS = GDALCreate(hDriver, pszIdRaster, nXSize, nYSize, 1, 
+								GDT_UInt32, NULL);
+			if(hIdDS == NULL) {
+				fprintf(stderr, "Could not create the temporary ID raster %s\n", 
+						pszIdRaster);
+				GDALDestroyDriverManager();
+				exit(1);
 			}
-			else {
-				cmb->nID = nCmbID++;
-				cmb->nCount = 1;
+			hIdBand = GDALGetRasterBand(hIdDS, 1);
+		}
+	}
+	
+/* -------------------------------------------------------------------- */
+/*      Process the inputs.							                    */
+/* -------------------------------------------------------------------- */
+	sSpill.nMaxMem = (size_t) MAX(nMaxMemMB, 0) * 1024 * 1024;
+	sSpill.nInitID = nInitID;
+	sSpill.nIdBase = nInitID;
+	sSpill.nRuns = 0;
+	sSpill.nSpilledRuns = 0;
+	sSpill.papszRunFiles = NULL;
+	sSpill.dfTime = 0.0;
+
+	//leave room for the entries of a spilling table next to the dense array
+	if(nMaxMemMB > 0)
+		nDenseMemMB = MIN(nDenseMemMB, nMaxMemMB / 2);
+
+	/* if all inputs are integer and the product of their value ranges fits */
+	/* the dense memory budget, index combinations directly (no hashing) */
+	if(nDenseMemMB > 0 && nKeyWords == nInputFiles && poTable->nEntries == 0) {
+		panRangeMin = (GInt32*) CPLMalloc(nInputFiles * sizeof(GInt32));
+		panRangeMax = (GInt32*) CPLMalloc(nInputFiles * sizeof(GInt32));
+		double dfMaxSlots = nDenseMemMB * 1024.0 * 1024.0 / sizeof(GUInt32);
+		double dfSlots = 1.0;
+		int *pabRangeKnown = (int*) CPLMalloc(nInputFiles * sizeof(int));
+
+		//ranges known without reading the data first, then scan the
+		//remaining inputs only as long as the domain still fits
+		for(i=0;i<nInputFiles;i++) {
+			pabRangeKnown[i] = GetInputValueRange(&psInputRasters[i], FALSE,
+											&panRangeMin[i], &panRangeMax[i]);
+			if(pabRangeKnown[i])
+				dfSlots *= (double) panRangeMax[i] - panRangeMin[i] + 1.0;
+		}
+		for(i=0;i<nInputFiles && dfSlots <= dfMaxSlots;i++) {
+			if(!pabRangeKnown[i]) {
+				GetInputValueRange(&psInputRasters[i], TRUE, 
+									&panRangeMin[i], &panRangeMax[i]);
+				dfSlots *= (double) panRangeMax[i] - panRangeMin[i] + 1.0;
 			}
-			
-			if(pszOutRaster != NULL)
-				panOutline[nXoff] = cmb->nID;
-			
-			//printf("%lu%llu,%s\n", cmb->nID, cmb->nCount, cmb->pszCombination);
-			CPLHashSetInsert(phAllCombination, cmb);
 		}
-		
-		//write a line to the output raster if needed
-		if(pszOutRaster != NULL) {
-			eErr = GDALRasterIO(hOutBand, GF_Write, 0, nYoff, nXSize, 1, panOutline, 
-						nXSize, 1, GDT_UInt32, 0, 0);
-			//TO DO: if(eErr != CE_None)
+
+		if(dfSlots <= dfMaxSlots && poTable->InitDenseIndex(panRangeMin, panRangeMax)) {
+			if (!bQuiet)
+				printf("Counting with a dense index of %.0f slots\n", dfSlots);
+
+			//the window tables of the workers may be dense as well if
+			//all of them fit the budget too
+			if(nThreads > 1 && dfSlots * (2 * nThreads + 1) <= dfMaxSlots)
+				bLocalDense = TRUE;
 		}
-						
+
+		CPLFree(pabRangeKnown);
+	}
+
+	//pre-size a hashed table for the estimate, leaving -max_mem room to grow
+	if(dfEstimate > 0 && !poTable->IsDense() && poTable->nEntries == 0) {
+		double dfReserve = MIN(dfEstimate, 1073741824.0);
+		if(nMaxMemMB > 0)
+			dfReserve = MIN(dfReserve, nMaxMemMB * 1024.0 * 1024.0 / 2 / dfEntryBytes);
+		poTable->Reserve((size_t) dfReserve);
+	}
+	
+	//-buffer_mem is the budget of one window, the windows in flight (two
+	//per worker when threaded, otherwise the pipeline queue) each have one
+	ComputeWindowLayout(psInputRasters, nInputFiles + nStatFiles, nXSize, nYSize,
+						(size_t) MAX(nBufferMemMB, 1) * 1024 * 1024, &sLayout);
+	if (!bQuiet)
+		printf("Processing in windows of %d x %d\n", sLayout.nWinXSize, sLayout.nWinYSize);
+
+	//overviews are only built while counting if the final IDs are written
+	//then, otherwise (and again after spilling) while remapping them
+	if(nThreads > 1) {
+		if (!bQuiet)
+			printf("Using %d threads\n", nThreads);
+		eErr = CombineThreaded(psInputRasters, nInputFiles + nStatFiles, &sLayout,
+								poEngine, &sSpill, hIdBand, 
+								hIdBand == hOutBand ? poOverviews : NULL, nThreads,
+								bLocalDense ? panRangeMin : NULL, panRangeMax,
+								&sRunStats, bQuiet ? NULL : pfnProgress, pProgressData);
+	}
+	else if(nQueue > 1) {
+		eErr = CombinePipelined(psInputRasters, nInputFiles + nStatFiles, &sLayout,
+								poEngine, &sSpill, hIdBand, 
+								hIdBand == hOutBand ? poOverviews : NULL, nQueue,
+								&sRunStats, bQuiet ? NULL : pfnProgress, pProgressData);
+	}
+	else {
+		eErr = CombineSequential(psInputRasters, nInputFiles + nStatFiles, &sLayout,
+								poEngine, &sSpill, hIdBand, 
+								hIdBand == hOutBand ? poOverviews : NULL,
+								&sRunStats, bQuiet ? NULL : pfnProgress, pProgressData);
+	}
+
+/* -------------------------------------------------------------------- */
+/*      If the table was spilled, spill the rest too, merge the runs    */
+/*      and map the provisional IDs to the final ones.                  */
+/* -------------------------------------------------------------------- */
+	nCombinations = poTable->nEntries;
+	dfTimer = GetWallTime();
+	if(eErr == CE_None && sSpill.nRuns > 0) {
+		eErr = SpillTable(&sSpill, poTable);
+		if(eErr == CE_None) {
+			if (!bQuiet)
+				printf("Merging %d spilled runs...\n", sSpill.nRuns);
+			pszRecordFile = CPLStrdup(CPLGenerateTempFilename("gdal_combine_cmb"));
+			pszMapFile = CPLStrdup(CPLGenerateTempFilename("gdal_combine_map"));
+			eErr = MergeSpillRuns(&sSpill, nKeyWords, pszRecordFile, pszMapFile, 
+								&nCombinations);
+		}
+	}
+	sRunStats.dfSpill = sSpill.dfTime + (GetWallTime() - dfTimer);
+	if(eErr == CE_None && pszOutRaster != NULL && bAutoType) {
+		eOutDataType = SmallestIdType(nCombinations > 0 ? nInitID + nCombinations - 1 : 0);
 		if (!bQuiet)
-			pfnProgress(nYoff / (nYSize-1.0), NULL, pProgressData);
+			printf("Output data type: %s\n", GDALGetDataTypeName(eOutDataType));
+		hOutDS = CreateOutputRaster(hDriver, pszOutRaster, nXSize, nYSize, 
+									eOutDataType, papszCreateOptions, 
+									bHasGeoTransform ? adfGeoTransform : NULL,
+									psInputRasters[0].hDS, bSkipNodata);
+		if(hOutDS == NULL) {
+			fprintf(stderr, "Could not create the output raster\n");
+			GDALDestroyDriverManager();
+			exit(1);
+		}
+		hOutBand = GDALGetRasterBand(hOutDS, 1);
+		if(pszOvrResampling != NULL) {
+			poOverviews = new OverviewBuilder(nXSize, nYSize, EQUAL(pszOvrResampling, "MODE"),
+											bSkipNodata);
+			if(!poOverviews->CreateLevels(hOutDS)) {
+				fprintf(stderr, "Could not create the overviews of the output raster\n");
+				GDALDestroyDriverManager();
+				exit(1);
+			}
+			if (!bQuiet && poOverviews->nLevels > 0)
+				printf("Building %d %s overview levels as the IDs are written\n", 
+						poOverviews->nLevels, pszOvrResampling);
+		}
+	}
+	if(eErr == CE_None && hIdBand != NULL && (pszMapFile != NULL || hIdDS != NULL)) {
+		dfTimer = GetWallTime();
+		eErr = RemapIdRaster(hIdBand, hOutBand, poOverviews, &sLayout, pszMapFile,
+							GetIdMapSlice(sSpill.nMaxMem), nInitID,
+							bQuiet ? NULL : pfnProgress, pProgressData);
+		sRunStats.dfWrite += GetWallTime() - dfTimer;
+	}
+	if(pszMapFile != NULL) {
+		VSIUnlink(pszMapFile);
+		CPLFree(pszMapFile);
+	}
+	delete poOverviews;
+	if(hIdDS != NULL) {
+		GDALClose(hIdDS);
+		GDALDeleteDataset(hDriver, pszIdRaster);
+		CPLFree(pszIdRaster);
+	}
+
+	if(eErr != CE_None) {
+		fprintf(stderr, "gdal_combine failed\n");
+		GDALDestroyDriverManager();
+		exit(1);
 	}
 	
+	nMaxID = nInitID + nCombinations - 1;
+
 	if(pszOutRaster != NULL && !bQuiet) {
 		printf("\nRaster output written to: %s\n", pszOutRaster);
 
 		//warn if the combination ID exceeded the range of eOutDataType
-		if(nCmbID >= (1<<GDALGetDataTypeSize(eOutDataType))) {
-			printf( "\nWARNING: The number of unique combinations (%u) exceeded "
-					"the upper limit (%u) of the output data type. The output "
-					"raster contains invalid data.\n\n", 
-					nCmbID, (1<<GDALGetDataTypeSize(eOutDataType))-1 );
+		if(nCombinations > 0 && 
+			nMaxID > (((GUIntBig) 1) << GDALGetDataTypeSize(eOutDataType)) - 1) {
+			printf( "\nWARNING: The largest combination ID (" CPL_FRMT_GUIB ") exceeded "
+					"the upper limit (" CPL_FRMT_GUIB ") of the output data type. "
+					"The output raster contains invalid data.%s\n\n", 
+					nMaxID, (((GUIntBig) 1) << GDALGetDataTypeSize(eOutDataType)) - 1,
+					eOutDataType != GDT_UInt32 ? " Use -ot Auto to pick a type that fits." : "");
 		}
 	}
 
-	/* write the output CSV file */
-	for (i=0;i<nInputFiles;i++) {
-		nChar = nChar + (strlen(CPLGetBasename(ppszInputFilenames[i])) + 1);
+	/* write the combination table in ID order */
+	dfTimer = GetWallTime();
+	if(fpCSV != NULL) {
+		for (i=0;i<nInputFiles;i++) {
+			nChar = nChar + (strlen(GetInputName(&psInputRasters[i])) + 1);
+		}
+		pszVarList = (char*) CPLMalloc(nChar);
+		pszVarList[0] = '\0';
+		for (i=0;i<nInputFiles;i++) {
+			strcat(pszVarList, GetInputName(&psInputRasters[i]));
+			if(i < (nInputFiles-1)) 
+				strcat(pszVarList, ",");
+		}
+		InitBufferedWriter(&sCSVWriter, fpCSV, 0, 1024 * 1024);
+		WriteBuffered(&sCSVWriter, "CMB_ID,COUNT,", 13);
+		WriteBuffered(&sCSVWriter, pszVarList, strlen(pszVarList));
+		for (i=0;i<nStatFiles * STAT_FIELDS;i++) {
+			const char *pszName = GetStatColumnName(
+					&psInputRasters[nInputFiles + i / STAT_FIELDS], i % STAT_FIELDS);
+			WriteBuffered(&sCSVWriter, ",", 1);
+			WriteBuffered(&sCSVWriter, pszName, strlen(pszName));
+		}
+		WriteBuffered(&sCSVWriter, "\n", 1);
 	}
-	pszVarList = (char*) CPLMalloc(nChar);
-	pszVarList[0] = '\0';
-	for (i=0;i<nInputFiles;i++) {
-		strcat(pszVarList, CPLGetBasename(ppszInputFilenames[i]));
-		if(i < (nInputFiles-1)) 
-			strcat(pszVarList, ",");
-	}
-	VSIFPrintf(fp, "CMB_ID,COUNT,%s\n", pszVarList);
-	CPLHashSetForeach(phAllCombination, WriteDataToCSVForEach, fp);
-	VSIFClose(fp);
-	fp = NULL;
-	if (!bQuiet)
-		printf("Tabular output written to: %s\n", pszCSVFile);
+	nRows = nCombinations;
+	if(pszRecordFile == NULL) {
+		//combinations of the dictionary that are not in this run are left out
+		nRows = 0;
+		for(iEntry=0;iEntry<poTable->nEntries;iEntry++) {
+			if(poTable->panCounts[iEntry] > 0)
+				nRows++;
+		}
+	}
+	if(pszBinFile != NULL &&
+		!CreateBinaryTable(&sBinTable, pszBinFile, psInputRasters, nInputFiles, 
+							nStatFiles, nRows)) {
+		fprintf(stderr, "Can't open %s for writing output table\n", pszBinFile);
+		GDALDestroyDriverManager();
+		exit(1);
+	}
+
+	pszKeyText = (char*) CPLMalloc((nInputFiles + nStatFiles * STAT_FIELDS) * 32 + 48);
+	if(pszRecordFile != NULL) {
+		//combinations are in ID order in the record file, between unused slots
+		fpRecords = VSIFOpenL(pszRecordFile, "rb");
+		panRecord = (GUInt32*) CPLMalloc(nKeyWords * sizeof(GUInt32) + sizeof(GUIntBig));
+		iRecord = 0;
+		while(fpRecords != NULL && 
+			VSIFReadL(panRecord, nKeyWords * sizeof(GUInt32) + sizeof(GUIntBig), 1, 
+						fpRecords) == 1) {
+			GUIntBig nCount;
+			memcpy(&nCount, panRecord + nKeyWords, sizeof(GUIntBig));
+			if(nCount == 0)
+				continue;
+			WriteCombination(fpCSV != NULL ? &sCSVWriter : NULL, 
+							pszBinFile != NULL ? &sBinTable : NULL,
+							psInputRasters, nInputFiles, 0, nInitID + (unsigned int) iRecord,
+							nCount, panRecord, NULL, pszKeyText);
+			iRecord++;
+		}
+		if(fpRecords != NULL)
+			VSIFCloseL(fpRecords);
+		VSIUnlink(pszRecordFile);
+		CPLFree(panRecord);
+		CPLFree(pszRecordFile);
+	}
+	else {
+		sWriteContext.psCSV = fpCSV != NULL ? &sCSVWriter : NULL;
+		sWriteContext.psTable = pszBinFile != NULL ? &sBinTable : NULL;
+		sWriteContext.psInputRasters = psInputRasters;
+		sWriteContext.nInputFiles = nInputFiles;
+		sWriteContext.nStatFiles = nStatFiles;
+		sWriteContext.nInitID = nInitID;
+		sWriteContext.pszRow = pszKeyText;
+		poEngine->ForEach(WriteTableEntry, &sWriteContext);
+	}
+	CPLFree(pszKeyText);
+
+	if(fpCSV != NULL) {
+		bWriteOK &= CloseBufferedWriter(&sCSVWriter);
+		bWriteOK &= VSIFCloseL(fpCSV) == 0;
+		fpCSV = NULL;
+	}
+	if(pszBinFile != NULL)
+		bWriteOK &= CloseBinaryTable(&sBinTable);
+	sRunStats.dfTable = GetWallTime() - dfTimer;
+	if(!bWriteOK) {
+		fprintf(stderr, "Error writing the combination table\n");
+		GDALDestroyDriverManager();
+		exit(1);
+	}
+
+	//the new dictionary replaces the loaded one once that is released
+	if(pszDictFile != NULL) {
+		pszDictTemp = CPLStrdup(CPLSPrintf("%s.tmp", pszDictFile));
+		if(!SaveDictionary(pszDictTemp, psInputRasters, nInputFiles, nInitID, poTable)) {
+			fprintf(stderr, "Error writing the dictionary %s\n", pszDictTemp);
+			VSIUnlink(pszDictTemp);
+			GDALDestroyDriverManager();
+			exit(1);
+		}
+	}
+
+	if (!bQuiet) {
+		if(pszCSVFile != NULL)
+			printf("Tabular output written to: %s\n", pszCSVFile);
+		if(pszBinFile != NULL)
+			printf("Binary table written to: %s\n", pszBinFile);
+		if(pszDictFile != NULL)
+			printf("Dictionary written to: %s (%lu new combinations)\n", pszDictFile,
+					(unsigned long) (poTable->nEntries - sDict.nLoaded));
+		if(sSpill.nSpilledRuns > 0)
+			printf("%lu unique combinations, spilled to disk in %d runs\n",
+					(unsigned long) nCombinations, sSpill.nSpilledRuns);
+		else
+			printf("%lu unique combinations, %.1f bytes per combination (%.1f MB)\n",
+					(unsigned long) poTable->nEntries,
+					poTable->nEntries ? poTable->GetMemoryUsage() / (double) poTable->nEntries : 0.0,
+					poTable->GetMemoryUsage() / (1024.0 * 1024.0));
 
-	finish = clock();
-	dfDuration = (double)(finish - start) / CLOCKS_PER_SEC;
+		if(bSkipNodata)
+			printf("Pixels skipped as nodata: " CPL_FRMT_GUIB "\n", poEngine->sStats.nSkipped);
+		dfCounted = (double) (poEngine->sStats.nLeftHits + poEngine->sStats.nAboveHits + 
+								poEngine->sStats.nLookups);
+		if(dfCounted > 0)
+			printf("Pixels reusing the left neighbour: %.1f%%, the pixel above: %.1f%%, "
+					"looked up: %.1f%%\n",
+					100.0 * poEngine->sStats.nLeftHits / dfCounted,
+					100.0 * poEngine->sStats.nAboveHits / dfCounted,
+					100.0 * poEngine->sStats.nLookups / dfCounted);
+	}
+
+	dfDuration = GetWallTime() - dfStart;
+	if(bStats)
+		PrintRunStats(&sRunStats, poTable, (GUIntBig) nXSize * nYSize, nCombinations, 
+					dfDuration);
+	if(pszStatsFile != NULL &&
+		!WriteRunStatsJSON(pszStatsFile, &sRunStats, poEngine, (GUIntBig) nXSize * nYSize, 
+							nCombinations, dfDuration, nThreads, nQueue, sSpill.nSpilledRuns)) {
+		fprintf(stderr, "Error writing the statistics %s\n", pszStatsFile);
+	}
 	if (!bQuiet)
 		printf("gdal_combine completed in %2.1f seconds\n\n", dfDuration);
 	
@@ -448,22 +5786,32 @@ int main(int argc, char ** argv) {
 	if(pszOutRaster != NULL)
 		GDALClose(hOutDS);
 		
+	CloseInputRasters(psInputRasters, nInputFiles + nStatFiles);
 	for (i=0;i<nInputFiles;i++) {
-		GDALClose(psInputRasters[i].hDS);
-		if(psInputRasters[i].bIsIntDataType) {
-			CPLFree(psInputRasters[i].panScanline);
-		}
-		else {
-			CPLFree(psInputRasters[i].padfScanline);
-		}
 		CPLFree(ppszInputFilenames[i]);
+		CPLFree((char*) psInputRasters[i].pszFilename);
 	}
+	for (i=0;i<nStatFiles;i++)
+		CPLFree((char*) psInputRasters[nInputFiles + i].pszFilename);
+	CSLDestroy(papszStatFiles);
 	CPLFree(psInputRasters);
     CPLFree(ppszInputFilenames);
 	CPLFree(pszVarList);
 	
-	CPLHashSetDestroy(phAllCombination);
-	phAllCombination = NULL;
+	delete poEngine;
+	if(pszDictFile != NULL) {
+		CloseDictionary(&sDict);
+		VSIUnlink(pszDictFile);
+		if(VSIRename(pszDictTemp, pszDictFile) != 0)
+			fprintf(stderr, "Could not rename %s to %s\n", pszDictTemp, pszDictFile);
+		CPLFree(pszDictTemp);
+	}
+	CSLDestroy(sSpill.papszRunFiles);
+	CSLDestroy(papszCreateOptions);
+	CSLDestroy(papszQuant);
+	CSLDestroy(papszSkipNodata);
+	CPLFree(panRangeMin);
+	CPLFree(panRangeMax);
 	
 	GDALDestroyDriverManager();
 	
@@ -30,6 +30,9 @@
 #include "cpl_conv.h"
 #include "cpl_string.h"
 #include <vector>
+#include <queue>
+#include <algorithm>
+#include <functional>
 
 CPL_CVSID("$Id: polygonize.cpp 22501 2011-06-04 21:28:47Z rouault $");
 
@@ -44,24 +47,72 @@ CPL_CVSID("$Id: polygonize.cpp 22501 2011-06-04 21:28:47Z rouault $");
 /*      This is a helper class to hold polygons while they are being    */
 /*      formed in memory, and to provide services to coalesce a much    */
 /*      of edge sections into complete rings.                           */
+/*                                                                      */
+/*      Pixel edges are first collected as they are found, in scan      */
+/*      order, by the polygon fragment they belong to at the time,      */
+/*      packed as a few bytes each and runs of horizontal edges as one. */
+/*      Fragments later found to be the same polygon are attached to    */
+/*      one of them, and AssembleEdges() adds the edges of all of them  */
+/*      as segments in scan order once the polygon is complete, so the  */
+/*      result is the same as if the final polygon had been known from  */
+/*      the start.                                                      */
 /* ==================================================================== */
 /************************************************************************/
 
 class RPolygon {
 public:
-    RPolygon( int nValue ) { nPolyValue = nValue; nLastLineUpdated = -1; }
+    RPolygon( int nValue ) { nPolyValue = nValue; nLastLineUpdated = -1; nEnds = 0;
+                             nLastEdgeY = 0; nLastEdgeXV = 0;
+                             nHorizontalItem = -1; nRunLength = -1; }
+    ~RPolygon();
 
     int              nPolyValue;
     int              nLastLineUpdated;
 
     std::vector< std::vector<int> > aanXY;
 
+    /* pixel edges not added as segments yet, see AddEdge() */
+    std::vector<GByte> abyEdges;
+    int              nLastEdgeY;
+    int              nLastEdgeXV;
+    GIntBig          nHorizontalItem;
+    GIntBig          nRunLength;
+    std::vector<RPolygon *> apoFragments;
+
+    /* hash of string end points to string index, kept while adding */
+    /* segments, and to string index * 2 (+1 for the last point)     */
+    /* while coalescing                                              */
+    std::vector<GIntBig> anEndKey;
+    std::vector<int> anEndString;
+    size_t           nEnds;
+
+    int              FindEnd( int x, int y, int nFirst = 0 );
+    void             AddEnd( int x, int y, int nValue );
+    void             RemoveEnd( int x, int y, int nValue );
+    void             RebuildEnds();
+
+    void             AddEdge( int iX, int iY, int bVertical );
+    void             AddFragment( RPolygon *poFragment );
+    void             AssembleEdges();
     void             AddSegment( int x1, int y1, int x2, int y2 );
     void             Dump();
     void             Coalesce();
     void             Merge( int iBaseString, int iSrcString, int iDirection );
 };
 
+/************************************************************************/
+/*                             ~RPolygon()                              */
+/************************************************************************/
+
+RPolygon::~RPolygon()
+
+{
+    size_t iFragment;
+
+    for( iFragment = 0; iFragment < apoFragments.size(); iFragment++ )
+        delete apoFragments[iFragment];
+}
+
 /************************************************************************/
 /*                                Dump()                                */
 /************************************************************************/
@@ -92,7 +143,24 @@ void RPolygon::Dump()
 void RPolygon::Coalesce()
 
 {
-    size_t iBaseString;
+    size_t iBaseString, iString;
+
+/* -------------------------------------------------------------------- */
+/*      Index both ends of every string, so the strings that can be     */
+/*      merged onto a base string are found without scanning them all.  */
+/* -------------------------------------------------------------------- */
+    anEndKey.clear();
+    anEndString.clear();
+    nEnds = 0;
+
+    for( iString = 0; iString < aanXY.size(); iString++ )
+    {
+        std::vector<int> &anString = aanXY[iString];
+
+        AddEnd( anString[0], anString[1], (int) iString * 2 );
+        AddEnd( anString[anString.size()-2], anString[anString.size()-1],
+                (int) iString * 2 + 1 );
+    }
 
 /* -------------------------------------------------------------------- */
 /*      Iterate over loops starting from the first, trying to merge     */
@@ -101,42 +169,35 @@ void RPolygon::Coalesce()
     for( iBaseString = 0; iBaseString < aanXY.size(); iBaseString++ )
     {
         std::vector<int> &anBase = aanXY[iBaseString];
-        int bMergeHappened = TRUE;
+        int bMergeHappened = FALSE;
+        int nFirst = (int) (iBaseString+1) * 2;
 
 /* -------------------------------------------------------------------- */
-/*      Keep trying to merge the following strings into our target      */
-/*      "base" string till we have tried them all once without any      */
-/*      mergers.                                                        */
+/*      Keep merging the following strings into our target "base"       */
+/*      string, in passes over them in order, till a pass finds         */
+/*      nothing to merge.  The index gives the next string in the       */
+/*      pass starting or ending where the base string ends, starts      */
+/*      being tried first.                                              */
 /* -------------------------------------------------------------------- */
-        while( bMergeHappened )
+        for( ;; )
         {
-            size_t iString;
+            int nMatch = FindEnd( anBase[anBase.size()-2], 
+                                  anBase[anBase.size()-1], nFirst );
 
-            bMergeHappened = FALSE;
-
-/* -------------------------------------------------------------------- */
-/*      Loop over the following strings, trying to find one we can      */
-/*      merge onto the end of our base string.                          */
-/* -------------------------------------------------------------------- */
-            for( iString = iBaseString+1; 
-                 iString < aanXY.size(); 
-                 iString++ )
+            if( nMatch == -1 )
             {
-                std::vector<int> &anString = aanXY[iString];
+                if( !bMergeHappened )
+                    break;
 
-                if( anBase[anBase.size()-2] == anString[0]
-                    && anBase[anBase.size()-1] == anString[1] )
-                {
-                    Merge( iBaseString, iString, 1 );
-                    bMergeHappened = TRUE;
-                }
-                else if( anBase[anBase.size()-2] == anString[anString.size()-2]
-                         && anBase[anBase.size()-1] == anString[anString.size()-1] )
-                {
-                    Merge( iBaseString, iString, -1 );
-                    bMergeHappened = TRUE;
-                }
+                bMergeHappened = FALSE;
+                nFirst = (int) (iBaseString+1) * 2;
+                continue;
             }
+
+            iString = nMatch / 2;
+            Merge( iBaseString, iString, (nMatch % 2) ? -1 : 1 );
+            bMergeHappened = TRUE;
+            nFirst = (int) (iString+1) * 2;
         }
 
         /* At this point our loop *should* be closed! */
@@ -145,6 +206,9 @@ void RPolygon::Coalesce()
                    && anBase[1] == anBase[anBase.size()-1] );
     }
 
+    std::vector<GIntBig>().swap( anEndKey );
+    std::vector<int>().swap( anEndString );
+    nEnds = 0;
 }
 
 /************************************************************************/
@@ -175,13 +239,385 @@ void RPolygon::Merge( int iBaseString, int iSrcString, int iDirection )
         anBase.push_back( anString[i*2+1] );
     }
     
-    if( iSrcString < ((int) aanXY.size())-1 )
-        aanXY[iSrcString] = aanXY[aanXY.size()-1];
+    RemoveEnd( anString[0], anString[1], iSrcString * 2 );
+    RemoveEnd( anString[anString.size()-2], anString[anString.size()-1],
+               iSrcString * 2 + 1 );
+
+/* -------------------------------------------------------------------- */
+/*      Move the last string into the freed slot, and its index         */
+/*      entries with it.                                                */
+/* -------------------------------------------------------------------- */
+    int iLastString = ((int) aanXY.size())-1;
+
+    if( iSrcString < iLastString )
+    {
+        std::vector<int> &anLast = aanXY[iLastString];
+        int nLastSize = anLast.size();
+
+        RemoveEnd( anLast[0], anLast[1], iLastString * 2 );
+        RemoveEnd( anLast[nLastSize-2], anLast[nLastSize-1],
+                   iLastString * 2 + 1 );
+        AddEnd( anLast[0], anLast[1], iSrcString * 2 );
+        AddEnd( anLast[nLastSize-2], anLast[nLastSize-1], iSrcString * 2 + 1 );
+
+        anString.swap( anLast );
+    }
 
     size_t nSize = aanXY.size(); 
     aanXY.resize(nSize-1);
 }
 
+/************************************************************************/
+/*                            GPPutVarint()                             */
+/************************************************************************/
+
+static void GPPutVarint( std::vector<GByte> &abyData, GUIntBig nValue )
+
+{
+    while( nValue >= 0x80 )
+    {
+        abyData.push_back( (GByte) (nValue | 0x80) );
+        nValue >>= 7;
+    }
+    abyData.push_back( (GByte) nValue );
+}
+
+/************************************************************************/
+/*                            GPGetVarint()                             */
+/************************************************************************/
+
+static GUIntBig GPGetVarint( const std::vector<GByte> &abyData, size_t &iOffset )
+
+{
+    GUIntBig nValue = 0;
+    int nShift = 0;
+
+    while( abyData[iOffset] & 0x80 )
+    {
+        nValue |= ((GUIntBig) (abyData[iOffset++] & 0x7f)) << nShift;
+        nShift += 7;
+    }
+    nValue |= ((GUIntBig) abyData[iOffset++]) << nShift;
+
+    return nValue;
+}
+
+/************************************************************************/
+/*                              AddEdge()                               */
+/*                                                                      */
+/*      Record the top edge of pixel iX-1 of line iY, or its right      */
+/*      edge if bVertical. Edges must be recorded in scan order.        */
+/*                                                                      */
+/*      An edge is keyed x*2 + vertical on its line, and recorded as    */
+/*      an item of varints following on from the last edge recorded:    */
+/*      (delta << 2) | (run << 1) | newline, where delta is the key     */
+/*      step along the same line, or the number of lines down,          */
+/*      followed then by the key on the new line. A horizontal edge     */
+/*      just right of the last item, if that is horizontal, makes it a  */
+/*      run instead, with the number of further edges as a last varint. */
+/************************************************************************/
+
+void RPolygon::AddEdge( int iX, int iY, int bVertical )
+
+{
+    int nXV = iX * 2 + bVertical;
+
+    nLastLineUpdated = bVertical ? iY + 1 : iY;
+
+    if( !bVertical && nHorizontalItem != -1
+        && iY == nLastEdgeY && nXV == nLastEdgeXV + 2 )
+    {
+        if( nRunLength == -1 )
+        {
+            abyEdges[nHorizontalItem] |= 2;
+            nRunLength = abyEdges.size();
+            abyEdges.push_back( 1 );
+        }
+        else
+        {
+            size_t iOffset = nRunLength;
+            GUIntBig nCount = GPGetVarint( abyEdges, iOffset );
+
+            abyEdges.resize( nRunLength );
+            GPPutVarint( abyEdges, nCount + 1 );
+        }
+        nLastEdgeXV = nXV;
+        return;
+    }
+
+    nHorizontalItem = bVertical ? -1 : (GIntBig) abyEdges.size();
+    nRunLength = -1;
+    if( iY != nLastEdgeY || abyEdges.empty() )
+    {
+        GPPutVarint( abyEdges, (((GUIntBig) (iY - nLastEdgeY)) << 2) | 1 );
+        GPPutVarint( abyEdges, nXV );
+    }
+    else
+        GPPutVarint( abyEdges, ((GUIntBig) (nXV - nLastEdgeXV)) << 2 );
+    nLastEdgeY = iY;
+    nLastEdgeXV = nXV;
+}
+
+/************************************************************************/
+/*                            AddFragment()                             */
+/*                                                                      */
+/*      Attach another fragment of this polygon, and the fragments      */
+/*      attached to it. The polygon takes ownership of them.            */
+/************************************************************************/
+
+void RPolygon::AddFragment( RPolygon *poFragment )
+
+{
+    apoFragments.push_back( poFragment );
+    apoFragments.insert( apoFragments.end(), poFragment->apoFragments.begin(),
+                         poFragment->apoFragments.end() );
+    poFragment->apoFragments.clear();
+
+    nLastLineUpdated = MAX(nLastLineUpdated, poFragment->nLastLineUpdated);
+}
+
+/************************************************************************/
+/*                             GPNextEdge()                             */
+/*                                                                      */
+/*      Read the next edge recorded by AddEdge(), as                    */
+/*      (y << 32) | (x*2 + vertical). Returns FALSE past the last one.  */
+/************************************************************************/
+
+typedef struct {
+    size_t   iOffset;
+    int      nY;
+    int      nXV;
+    GUIntBig nRunLeft;
+} GPEdgeReader;
+
+static int GPNextEdge( const std::vector<GByte> &abyEdges, GPEdgeReader &sReader,
+                       GIntBig &nEdge )
+
+{
+    if( sReader.nRunLeft > 0 )
+    {
+        sReader.nRunLeft--;
+        sReader.nXV += 2;
+    }
+    else if( sReader.iOffset < abyEdges.size() )
+    {
+        GUIntBig nItem = GPGetVarint( abyEdges, sReader.iOffset );
+
+        if( nItem & 1 )
+        {
+            sReader.nY += (int) (nItem >> 2);
+            sReader.nXV = (int) GPGetVarint( abyEdges, sReader.iOffset );
+        }
+        else
+            sReader.nXV += (int) (nItem >> 2);
+        if( nItem & 2 )
+            sReader.nRunLeft = GPGetVarint( abyEdges, sReader.iOffset );
+    }
+    else
+        return FALSE;
+
+    nEdge = (((GIntBig) sReader.nY) << 32) | sReader.nXV;
+    return TRUE;
+}
+
+/************************************************************************/
+/*                           AssembleEdges()                            */
+/*                                                                      */
+/*      Add the recorded edges of this polygon and of its fragments as  */
+/*      segments, merging them back into scan order, and free the       */
+/*      fragments.                                                      */
+/************************************************************************/
+
+void RPolygon::AssembleEdges()
+
+{
+    std::vector<RPolygon *> apoParts( apoFragments );
+    std::vector<GPEdgeReader> asReaders;
+    std::priority_queue< std::pair<GIntBig,int>, 
+                         std::vector< std::pair<GIntBig,int> >,
+                         std::greater< std::pair<GIntBig,int> > > oQueue;
+    size_t iPart;
+    GIntBig nEdge, nNextEdge;
+
+    apoParts.push_back( this );
+    asReaders.resize( apoParts.size() );
+    for( iPart = 0; iPart < apoParts.size(); iPart++ )
+    {
+        memset( &asReaders[iPart], 0, sizeof(GPEdgeReader) );
+        if( GPNextEdge( apoParts[iPart]->abyEdges, asReaders[iPart], nEdge ) )
+            oQueue.push( std::make_pair( nEdge, (int) iPart ) );
+    }
+
+    while( !oQueue.empty() )
+    {
+        nEdge = oQueue.top().first;
+        int iY = (int) (nEdge >> 32);
+        int iX = (int) (nEdge & 0xffffffff) / 2;
+
+        iPart = oQueue.top().second;
+        oQueue.pop();
+        if( GPNextEdge( apoParts[iPart]->abyEdges, asReaders[iPart], nNextEdge ) )
+            oQueue.push( std::make_pair( nNextEdge, (int) iPart ) );
+
+        if( nEdge & 1 )
+            AddSegment( iX, iY, iX, iY+1 );
+        else
+            AddSegment( iX-1, iY, iX, iY );
+    }
+
+    std::vector<GByte>().swap( abyEdges );
+    std::vector<GIntBig>().swap( anEndKey );
+    std::vector<int>().swap( anEndString );
+    nEnds = 0;
+    for( iPart = 0; iPart < apoFragments.size(); iPart++ )
+        delete apoFragments[iPart];
+    apoFragments.clear();
+}
+
+/************************************************************************/
+/*                              GPEndHash()                             */
+/************************************************************************/
+
+static size_t GPEndHash( GIntBig nKey, size_t nMask )
+
+{
+    GUInt32 nX = (GUInt32) (nKey >> 32);
+    GUInt32 nY = (GUInt32) (nKey & 0xffffffff);
+
+    return ((nX * 73856093U) ^ (nY * 19349663U)) & nMask;
+}
+
+/************************************************************************/
+/*                              FindEnd()                               */
+/*                                                                      */
+/*      Return the lowest value indexed at x,y that is not less than    */
+/*      nFirst, or -1.                                                  */
+/************************************************************************/
+
+int RPolygon::FindEnd( int x, int y, int nFirst )
+
+{
+    if( nEnds == 0 )
+        return -1;
+
+    GIntBig nKey = (((GIntBig) x) << 32) | (GUInt32) y;
+    size_t nMask = anEndKey.size() - 1;
+    size_t iSlot = GPEndHash( nKey, nMask );
+    int nValue = -1;
+
+    for( ; anEndKey[iSlot] != -1; iSlot = (iSlot + 1) & nMask )
+    {
+        if( anEndKey[iSlot] == nKey && anEndString[iSlot] >= nFirst
+            && (nValue == -1 || anEndString[iSlot] < nValue) )
+            nValue = anEndString[iSlot];
+    }
+
+    return nValue;
+}
+
+/************************************************************************/
+/*                               AddEnd()                               */
+/************************************************************************/
+
+void RPolygon::AddEnd( int x, int y, int nValue )
+
+{
+    if( (nEnds + 1) * 2 > anEndKey.size() )
+    {
+        std::vector<GIntBig> anOldKey( MAX(anEndKey.size() * 2, 16), -1 );
+        std::vector<int> anOldString( anOldKey.size() );
+        size_t iSlot;
+
+        anEndKey.swap( anOldKey );
+        anEndString.swap( anOldString );
+        nEnds = 0;
+        for( iSlot = 0; iSlot < anOldKey.size(); iSlot++ )
+        {
+            if( anOldKey[iSlot] != -1 )
+                AddEnd( (int) (anOldKey[iSlot] >> 32),
+                        (int) (anOldKey[iSlot] & 0xffffffff),
+                        anOldString[iSlot] );
+        }
+    }
+
+    GIntBig nKey = (((GIntBig) x) << 32) | (GUInt32) y;
+    size_t nMask = anEndKey.size() - 1;
+    size_t iSlot = GPEndHash( nKey, nMask );
+
+    while( anEndKey[iSlot] != -1 )
+        iSlot = (iSlot + 1) & nMask;
+
+    anEndKey[iSlot] = nKey;
+    anEndString[iSlot] = nValue;
+    nEnds++;
+}
+
+/************************************************************************/
+/*                             RemoveEnd()                              */
+/*                                                                      */
+/*      Remove the entry of nValue at x,y, shifting back the entries    */
+/*      after it so no probe chain is broken.                           */
+/************************************************************************/
+
+void RPolygon::RemoveEnd( int x, int y, int nValue )
+
+{
+    GIntBig nKey = (((GIntBig) x) << 32) | (GUInt32) y;
+    size_t nMask = anEndKey.size() - 1;
+    size_t iSlot = GPEndHash( nKey, nMask );
+
+    while( anEndKey[iSlot] != nKey || anEndString[iSlot] != nValue )
+    {
+        CPLAssert( anEndKey[iSlot] != -1 );
+        iSlot = (iSlot + 1) & nMask;
+    }
+
+    size_t iNext = iSlot;
+
+    for( ;; )
+    {
+        iNext = (iNext + 1) & nMask;
+        if( anEndKey[iNext] == -1 )
+            break;
+
+        // Only move entries whose home slot is not between the hole
+        // and their current slot.
+        size_t iHome = GPEndHash( anEndKey[iNext], nMask );
+
+        if( ((iNext - iHome) & nMask) >= ((iNext - iSlot) & nMask) )
+        {
+            anEndKey[iSlot] = anEndKey[iNext];
+            anEndString[iSlot] = anEndString[iNext];
+            iSlot = iNext;
+        }
+    }
+
+    anEndKey[iSlot] = -1;
+    nEnds--;
+}
+
+/************************************************************************/
+/*                            RebuildEnds()                             */
+/************************************************************************/
+
+void RPolygon::RebuildEnds()
+
+{
+    size_t iString;
+
+    anEndKey.clear();
+    anEndString.clear();
+    nEnds = 0;
+
+    for( iString = 0; iString < aanXY.size(); iString++ )
+    {
+        std::vector<int> &anString = aanXY[iString];
+
+        AddEnd( anString[anString.size()-2], anString[anString.size()-1],
+                (int) iString );
+    }
+}
+
 /************************************************************************/
 /*                             AddSegment()                             */
 /************************************************************************/
@@ -191,53 +627,58 @@ void RPolygon::AddSegment( int x1, int y1, int x2, int y2 )
 {
     nLastLineUpdated = MAX(y1, y2);
 
+    if( nEnds != aanXY.size() )
+        RebuildEnds();
+
 /* -------------------------------------------------------------------- */
-/*      Is there an existing string ending with this?                   */
+/*      Is there an existing string ending with this?  The first one    */
+/*      ending with either end of the segment is extended.              */
 /* -------------------------------------------------------------------- */
-    size_t iString;
+    int iString = FindEnd( x1, y1 );
+    int iString2 = FindEnd( x2, y2 );
 
-    for( iString = 0; iString < aanXY.size(); iString++ )
+    if( iString2 != -1 && (iString == -1 || iString2 < iString) )
+        iString = iString2;
+    else if( iString != -1 )
+    {
+        int nTemp;
+
+        nTemp = x2;
+        x2 = x1;
+        x1 = nTemp;
+
+        nTemp = y2;
+        y2 = y1;
+        y1 = nTemp;
+    }
+
+    if( iString != -1 )
     {
         std::vector<int> &anString = aanXY[iString];
         size_t nSSize = anString.size();
-        
-        if( anString[nSSize-2] == x1 
-            && anString[nSSize-1] == y1 )
-        {
-            int nTemp;
-
-            nTemp = x2;
-            x2 = x1;
-            x1 = nTemp;
 
-            nTemp = y2;
-            y2 = y1;
-            y1 = nTemp;
-        }
+        // We are going to add a segment, but should we just extend 
+        // an existing segment already going in the right direction?
 
-        if( anString[nSSize-2] == x2 
-            && anString[nSSize-1] == y2 )
+        int nLastLen = MAX(ABS(anString[nSSize-4]-anString[nSSize-2]),
+                           ABS(anString[nSSize-3]-anString[nSSize-1]));
+            
+        if( nSSize >= 4 
+            && (anString[nSSize-4] - anString[nSSize-2]
+                == (anString[nSSize-2] - x1)*nLastLen)
+            && (anString[nSSize-3] - anString[nSSize-1]
+                == (anString[nSSize-1] - y1)*nLastLen) )
         {
-            // We are going to add a segment, but should we just extend 
-            // an existing segment already going in the right direction?
+            anString.pop_back();
+            anString.pop_back();
+        }
 
-            int nLastLen = MAX(ABS(anString[nSSize-4]-anString[nSSize-2]),
-                               ABS(anString[nSSize-3]-anString[nSSize-1]));
-            
-            if( nSSize >= 4 
-                && (anString[nSSize-4] - anString[nSSize-2]
-                    == (anString[nSSize-2] - x1)*nLastLen)
-                && (anString[nSSize-3] - anString[nSSize-1]
-                    == (anString[nSSize-1] - y1)*nLastLen) )
-            {
-                anString.pop_back();
-                anString.pop_back();
-            }
+        anString.push_back( x1 );
+        anString.push_back( y1 );
 
-            anString.push_back( x1 );
-            anString.push_back( y1 );
-            return;
-        }
+        RemoveEnd( x2, y2, iString );
+        AddEnd( x1, y1, iString );
+        return;
     }
 
 /* -------------------------------------------------------------------- */
@@ -252,6 +693,8 @@ void RPolygon::AddSegment( int x1, int y1, int x2, int y2 )
     anString.push_back( x2 );
     anString.push_back( y2 );
 
+    AddEnd( x2, y2, (int) nSize );
+
     return;
 }
 
@@ -261,47 +704,140 @@ void RPolygon::AddSegment( int x1, int y1, int x2, int y2 )
 /* ==================================================================== */
 /************************************************************************/
 
+/************************************************************************/
+/*                            GPGetFinalId()                            */
+/*                                                                      */
+/*      Follow the polygon id map to the id a polygon is currently      */
+/*      merged into, pointing the ids on the way directly to it.        */
+/************************************************************************/
+
+static int GPGetFinalId( GInt32 *panPolyIdMap, int nId )
+
+{
+    int nFinalId = nId;
+
+    while( panPolyIdMap[nFinalId] != nFinalId )
+        nFinalId = panPolyIdMap[nFinalId];
+
+    while( panPolyIdMap[nId] != nFinalId )
+    {
+        int nNextId = panPolyIdMap[nId];
+        panPolyIdMap[nId] = nFinalId;
+        nId = nNextId;
+    }
+
+    return nFinalId;
+}
+
+/************************************************************************/
+/*                          GPResolveLineIds()                          */
+/*                                                                      */
+/*      Replace the polygon ids of a line by the ids they are           */
+/*      currently merged into.                                          */
+/************************************************************************/
+
+static void GPResolveLineIds( GInt32 *panPolyIdMap, GInt32 *panLineId, int nXSize )
+
+{
+    int i, nLastId = -1, nFinalId = -1;
+
+    for( i = 0; i < nXSize; i++ )
+    {
+        if( panLineId[i] != nLastId )
+        {
+            nLastId = panLineId[i];
+            nFinalId = GPGetFinalId( panPolyIdMap, nLastId );
+        }
+        panLineId[i] = nFinalId;
+    }
+}
+
+/************************************************************************/
+/*                            GPGetPolygon()                            */
+/*                                                                      */
+/*      Return the polygon of an id, creating it, and adding the id     */
+/*      to the list of live polygons, if there is none yet.             */
+/************************************************************************/
+
+static RPolygon *GPGetPolygon( RPolygon **papoPoly, GInt32 *panPolyValue,
+                               std::vector<int> &anLiveIds, int nId )
+
+{
+    if( papoPoly[nId] == NULL )
+    {
+        papoPoly[nId] = new RPolygon( panPolyValue[nId] );
+        anLiveIds.push_back( nId );
+    }
+
+    return papoPoly[nId];
+}
+
+/************************************************************************/
+/*                        GPGatherFragments()                           */
+/*                                                                      */
+/*      Attach the live polygons of ids merged into another one since   */
+/*      the last call to the polygon of that id.                        */
+/************************************************************************/
+
+static void GPGatherFragments( GDALRasterPolygonEnumerator *poEnum, 
+                               RPolygon **papoPoly,
+                               std::vector<int> &anLiveIds )
+
+{
+    size_t iLive, nLive = 0;
+
+    for( iLive = 0; iLive < anLiveIds.size(); iLive++ )
+    {
+        int nId = anLiveIds[iLive];
+        int nFinalId = GPGetFinalId( poEnum->panPolyIdMap, nId );
+
+        if( nFinalId == nId )
+            continue;
+
+        GPGetPolygon( papoPoly, poEnum->panPolyValue, anLiveIds, nFinalId )
+            ->AddFragment( papoPoly[nId] );
+        papoPoly[nId] = NULL;
+    }
+
+    for( iLive = 0; iLive < anLiveIds.size(); iLive++ )
+    {
+        if( papoPoly[anLiveIds[iLive]] != NULL )
+            anLiveIds[nLive++] = anLiveIds[iLive];
+    }
+    anLiveIds.resize( nLive );
+}
+
 /************************************************************************/
 /*                              AddEdges()                              */
 /*                                                                      */
 /*      Examine one pixel and compare to its neighbour above            */
 /*      (previous) and right.  If they are different polygon ids        */
 /*      then add the pixel edge to this polygon and the one on the      */
-/*      other side of the edge.                                         */
+/*      other side of the edge. The ids of both lines must be the ids   */
+/*      they are currently merged into.                                 */
 /************************************************************************/
 
 static void AddEdges( GInt32 *panThisLineId, GInt32 *panLastLineId, 
-                      GInt32 *panPolyIdMap, GInt32 *panPolyValue,
-                      RPolygon **papoPoly, int iX, int iY )
+                      GInt32 *panPolyValue,
+                      RPolygon **papoPoly, std::vector<int> &anLiveIds,
+                      int iX, int iY )
 
 {
     int nThisId = panThisLineId[iX];
     int nRightId = panThisLineId[iX+1];
     int nPreviousId = panLastLineId[iX];
-    int iXReal = iX - 1;
-
-    if( nThisId != -1 )
-        nThisId = panPolyIdMap[nThisId];
-    if( nRightId != -1 )
-        nRightId = panPolyIdMap[nRightId];
-    if( nPreviousId != -1 )
-        nPreviousId = panPolyIdMap[nPreviousId];
 
     if( nThisId != nPreviousId )
     {
         if( nThisId != -1 )
         {
-            if( papoPoly[nThisId] == NULL )
-                papoPoly[nThisId] = new RPolygon( panPolyValue[nThisId] );
-
-            papoPoly[nThisId]->AddSegment( iXReal, iY, iXReal+1, iY );
+            GPGetPolygon( papoPoly, panPolyValue, anLiveIds, nThisId )
+                ->AddEdge( iX, iY, FALSE );
         }
         if( nPreviousId != -1 )
         {
-            if( papoPoly[nPreviousId] == NULL )
-                papoPoly[nPreviousId] = new RPolygon(panPolyValue[nPreviousId]);
-
-            papoPoly[nPreviousId]->AddSegment( iXReal, iY, iXReal+1, iY );
+            GPGetPolygon( papoPoly, panPolyValue, anLiveIds, nPreviousId )
+                ->AddEdge( iX, iY, FALSE );
         }
     }
 
@@ -309,18 +845,14 @@ static void AddEdges( GInt32 *panThisLineId, GInt32 *panLastLineId,
     {
         if( nThisId != -1 )
         {
-            if( papoPoly[nThisId] == NULL )
-                papoPoly[nThisId] = new RPolygon(panPolyValue[nThisId]);
-
-            papoPoly[nThisId]->AddSegment( iXReal+1, iY, iXReal+1, iY+1 );
+            GPGetPolygon( papoPoly, panPolyValue, anLiveIds, nThisId )
+                ->AddEdge( iX, iY, TRUE );
         }
 
         if( nRightId != -1 )
         {
-            if( papoPoly[nRightId] == NULL )
-                papoPoly[nRightId] = new RPolygon(panPolyValue[nRightId]);
-
-            papoPoly[nRightId]->AddSegment( iXReal+1, iY, iXReal+1, iY+1 );
+            GPGetPolygon( papoPoly, panPolyValue, anLiveIds, nRightId )
+                ->AddEdge( iX, iY, TRUE );
         }
     }
 }
@@ -340,6 +872,7 @@ EmitPolygonToLayer( OGRLayerH hOutLayer, int iPixValField,
 /* -------------------------------------------------------------------- */
 /*      Turn bits of lines into coherent rings.                         */
 /* -------------------------------------------------------------------- */
+    poRPoly->AssembleEdges();
     poRPoly->Coalesce();
 
 /* -------------------------------------------------------------------- */
@@ -480,6 +1013,7 @@ static void GPMaskToSingleValue( int nXSize, GInt32 *panImageLine,
  * rasters can be processed.  However, if the raster has many polygons 
  * or very large/complex polygons, the memory use for holding polygon 
  * enumerations and active polygon geometries may grow to be quite large. 
+ * The source band, and the mask band, are read only once. 
  *
  * The algorithm will generally produce very dense polygon geometries, with
  * edges that follow exactly on pixel boundaries for all non-interior pixels.
@@ -588,70 +1122,12 @@ GDALPolygonize( GDALRasterBandH hSrcBand,
     if( hSrcDS )
         GDALGetGeoTransform( hSrcDS, adfGeoTransform );
 
-/* -------------------------------------------------------------------- */
-/*      The first pass over the raster is only used to build up the     */
-/*      polygon id map so we will know in advance what polygons are     */
-/*      what on the second pass.                                        */
-/* -------------------------------------------------------------------- */
-    int iY;
-    GDALRasterPolygonEnumerator oFirstEnum(nConnectedness);
-
-    for( iY = 0; eErr == CE_None && iY < nYSize; iY++ )
-    {
-        eErr = GDALRasterIO( 
-            hSrcBand,
-            GF_Read, 0, iY, nXSize, 1, 
-            panThisLineVal, nXSize, 1, GDT_Int32, 0, 0 );
-        
-        if( eErr == CE_None && hMaskBand != NULL )
-            eErr = GPMaskImageData( hMaskBand, pabyMaskLine, iY, nXSize, panThisLineVal );
-
-		if( eErr == CE_None && bSingleValue )
-			GPMaskToSingleValue ( nXSize, panThisLineVal, nSingleValue );
-
-        if( iY == 0 )
-            oFirstEnum.ProcessLine( 
-                NULL, panThisLineVal, NULL, panThisLineId, nXSize );
-        else
-            oFirstEnum.ProcessLine(
-                panLastLineVal, panThisLineVal, 
-                panLastLineId,  panThisLineId, 
-                nXSize );
-
-        // swap lines
-        GInt32 *panTmp = panLastLineVal;
-        panLastLineVal = panThisLineVal;
-        panThisLineVal = panTmp;
-
-        panTmp = panThisLineId;
-        panThisLineId = panLastLineId;
-        panLastLineId = panTmp;
-
-/* -------------------------------------------------------------------- */
-/*      Report progress, and support interrupts.                        */
-/* -------------------------------------------------------------------- */
-        if( eErr == CE_None 
-            && !pfnProgress( 0.10 * ((iY+1) / (double) nYSize), 
-                             "", pProgressArg ) )
-        {
-            CPLError( CE_Failure, CPLE_UserInterrupt, "User terminated" );
-            eErr = CE_Failure;
-        }
-    }
-
-/* -------------------------------------------------------------------- */
-/*      Make a pass through the maps, ensuring every polygon id         */
-/*      points to the final id it should use, not an intermediate       */
-/*      value.                                                          */
-/* -------------------------------------------------------------------- */
-    oFirstEnum.CompleteMerges();
-
 /* -------------------------------------------------------------------- */
 /*      Initialize ids to -1 to serve as a nodata value for the         */
 /*      previous line, and past the beginning and end of the            */
 /*      scanlines.                                                      */
 /* -------------------------------------------------------------------- */
-    int iX;
+    int iX, iY;
 
     panThisLineId[0] = -1;
     panThisLineId[nXSize+1] = -1;
@@ -660,17 +1136,20 @@ GDALPolygonize( GDALRasterBandH hSrcBand,
         panLastLineId[iX] = -1;
 
 /* -------------------------------------------------------------------- */
-/*      We will use a new enumerator for the second pass primariliy     */
-/*      so we can preserve the first pass map.                          */
+/*      The polygons are enumerated and their edges collected in a      */
+/*      single pass. Edges are collected by the polygon id their        */
+/*      pixels have at the time, and ids merged since are gathered      */
+/*      before looking for complete polygons.  Only the ids with a      */
+/*      polygon in memory are kept in anLiveIds, so gathering and       */
+/*      looking for complete polygons does not visit every id seen.     */
 /* -------------------------------------------------------------------- */
-    GDALRasterPolygonEnumerator oSecondEnum(nConnectedness);
-    RPolygon **papoPoly = (RPolygon **) 
-        CPLCalloc(sizeof(RPolygon*),oFirstEnum.nNextPolygonId);
+    GDALRasterPolygonEnumerator oPolyEnum(nConnectedness);
+    RPolygon **papoPoly = NULL;
+    int nPolyAlloc = 0;
+    std::vector<int> anLiveIds;
+    std::vector<int> anDoneIds;
+    size_t iLive, nLive;
 
-/* ==================================================================== */
-/*      Second pass during which we will actually collect polygon       */
-/*      edges as geometries.                                            */
-/* ==================================================================== */
     for( iY = 0; eErr == CE_None && iY < nYSize+1; iY++ )
     {
 /* -------------------------------------------------------------------- */
@@ -692,8 +1171,8 @@ GDALPolygonize( GDALRasterBandH hSrcBand,
             continue;
 
 /* -------------------------------------------------------------------- */
-/*      Determine what polygon the various pixels belong to (redoing    */
-/*      the same thing done in the first pass above).                   */
+/*      Determine what polygon the various pixels belong to, and what   */
+/*      the pixels of the last line belong to now.                      */
 /* -------------------------------------------------------------------- */
         if( iY == nYSize )
         {
@@ -701,14 +1180,28 @@ GDALPolygonize( GDALRasterBandH hSrcBand,
                 panThisLineId[iX] = -1;
         }
         else if( iY == 0 )
-            oSecondEnum.ProcessLine( 
+            oPolyEnum.ProcessLine( 
                 NULL, panThisLineVal, NULL, panThisLineId+1, nXSize );
         else
-            oSecondEnum.ProcessLine(
+            oPolyEnum.ProcessLine(
                 panLastLineVal, panThisLineVal, 
                 panLastLineId+1,  panThisLineId+1, 
                 nXSize );
 
+        if( iY < nYSize )
+            GPResolveLineIds( oPolyEnum.panPolyIdMap, panThisLineId+1, nXSize );
+        if( iY > 0 )
+            GPResolveLineIds( oPolyEnum.panPolyIdMap, panLastLineId+1, nXSize );
+
+        if( oPolyEnum.nPolyAlloc > nPolyAlloc )
+        {
+            papoPoly = (RPolygon **) 
+                CPLRealloc( papoPoly, sizeof(RPolygon*) * oPolyEnum.nPolyAlloc );
+            memset( papoPoly + nPolyAlloc, 0, 
+                    sizeof(RPolygon*) * (oPolyEnum.nPolyAlloc - nPolyAlloc) );
+            nPolyAlloc = oPolyEnum.nPolyAlloc;
+        }
+
 /* -------------------------------------------------------------------- */
 /*      Add polygon edges to our polygon list for the pixel             */
 /*      boundaries within and above this line.                          */
@@ -716,8 +1209,8 @@ GDALPolygonize( GDALRasterBandH hSrcBand,
         for( iX = 0; iX < nXSize+1; iX++ )
         {
             AddEdges( panThisLineId, panLastLineId, 
-                      oFirstEnum.panPolyIdMap, oFirstEnum.panPolyValue,
-                      papoPoly, iX, iY );
+                      oPolyEnum.panPolyValue,
+                      papoPoly, anLiveIds, iX, iY );
         }
 
 /* -------------------------------------------------------------------- */
@@ -727,22 +1220,36 @@ GDALPolygonize( GDALRasterBandH hSrcBand,
 /* -------------------------------------------------------------------- */
         if( iY % 8 == 7 )
         {
-            for( iX = 0; 
-                 eErr == CE_None && iX < oSecondEnum.nNextPolygonId; 
-                 iX++ )
+            GPGatherFragments( &oPolyEnum, papoPoly, anLiveIds );
+
+            anDoneIds.clear();
+            nLive = 0;
+            for( iLive = 0; iLive < anLiveIds.size(); iLive++ )
+            {
+                if( papoPoly[anLiveIds[iLive]]->nLastLineUpdated < iY-1 )
+                    anDoneIds.push_back( anLiveIds[iLive] );
+                else
+                    anLiveIds[nLive++] = anLiveIds[iLive];
+            }
+            anLiveIds.resize( nLive );
+
+            // Write them out in id order, as scanning all the ids would.
+            std::sort( anDoneIds.begin(), anDoneIds.end() );
+
+            for( iLive = 0; iLive < anDoneIds.size(); iLive++ )
             {
-                if( papoPoly[iX] && papoPoly[iX]->nLastLineUpdated < iY-1 )
+                RPolygon *poRPoly = papoPoly[anDoneIds[iLive]];
+
+                if( eErr == CE_None
+                    && (hMaskBand == NULL
+                        || poRPoly->nPolyValue != GP_NODATA_MARKER) )
                 {
-                    if( hMaskBand == NULL
-                        || papoPoly[iX]->nPolyValue != GP_NODATA_MARKER )
-                    {
-                        eErr = 
-                            EmitPolygonToLayer( hOutLayer, iPixValField, 
-                                                papoPoly[iX], adfGeoTransform );
-                    }
-                    delete papoPoly[iX];
-                    papoPoly[iX] = NULL;
+                    eErr = 
+                        EmitPolygonToLayer( hOutLayer, iPixValField, 
+                                            poRPoly, adfGeoTransform );
                 }
+                delete poRPoly;
+                papoPoly[anDoneIds[iLive]] = NULL;
             }
         }
 
@@ -762,7 +1269,7 @@ GDALPolygonize( GDALRasterBandH hSrcBand,
 /*      Report progress, and support interrupts.                        */
 /* -------------------------------------------------------------------- */
         if( eErr == CE_None 
-            && !pfnProgress( 0.10 + 0.90 * ((iY+1) / (double) nYSize), 
+            && !pfnProgress( (iY+1) / (double) (nYSize+1), 
                              "", pProgressArg ) )
         {
             CPLError( CE_Failure, CPLE_UserInterrupt, "User terminated" );
@@ -773,20 +1280,24 @@ GDALPolygonize( GDALRasterBandH hSrcBand,
 /* -------------------------------------------------------------------- */
 /*      Make a cleanup pass for all unflushed polygons.                 */
 /* -------------------------------------------------------------------- */
-    for( iX = 0; eErr == CE_None && iX < oSecondEnum.nNextPolygonId; iX++ )
+    GPGatherFragments( &oPolyEnum, papoPoly, anLiveIds );
+
+    std::sort( anLiveIds.begin(), anLiveIds.end() );
+
+    for( iLive = 0; iLive < anLiveIds.size(); iLive++ )
     {
-        if( papoPoly[iX] )
+        RPolygon *poRPoly = papoPoly[anLiveIds[iLive]];
+
+        if( eErr == CE_None 
+            && (hMaskBand == NULL
+                || poRPoly->nPolyValue != GP_NODATA_MARKER) )
         {
-            if( hMaskBand == NULL
-                || papoPoly[iX]->nPolyValue != GP_NODATA_MARKER )
-            {
-                eErr = 
-                    EmitPolygonToLayer( hOutLayer, iPixValField, 
-                                        papoPoly[iX], adfGeoTransform );
-            }
-            delete papoPoly[iX];
-            papoPoly[iX] = NULL;
+            eErr = 
+                EmitPolygonToLayer( hOutLayer, iPixValField, 
+                                    poRPoly, adfGeoTransform );
         }
+        delete poRPoly;
+        papoPoly[anLiveIds[iLive]] = NULL;
     }
 
 /* -------------------------------------------------------------------- */
@@ -0,0 +1,189 @@
+#!/usr/bin/env python
+#******************************************************************************
+#  gdal_combine_test.py - regression checks for gdal_combine
+#
+#  Builds small random test rasters with GDAL, runs gdal_combine on them
+#  with different options and checks the results.
+#
+#  usage: python gdal_combine_test.py [path/to/gdal_combine]
+#******************************************************************************
+
+try:
+    from osgeo import gdal
+except ImportError:
+    import gdal
+
+import array
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+
+combine = 'gdal_combine'
+tmpdir = None
+
+# =============================================================================
+def CreateRaster(filename, xsize, ysize, nvalues, datatype, options, seed):
+
+    drv = gdal.GetDriverByName('GTiff')
+    ds = drv.Create(filename, xsize, ysize, 1, datatype, options)
+    band = ds.GetRasterBand(1)
+    typecode = {gdal.GDT_Byte: 'B', gdal.GDT_UInt16: 'H'}[datatype]
+    rnd = random.Random(seed)
+    for y in range(ysize):
+        line = array.array(typecode, [rnd.randint(0, nvalues - 1) for x in range(xsize)])
+        band.WriteRaster(0, y, xsize, 1, line.tostring() if hasattr(line, 'tostring')
+                         else line.tobytes(), xsize, 1, datatype)
+    ds = None
+
+# =============================================================================
+def RunCombine(args, env=None):
+
+    cmd = [combine, '-q'] + args
+    if env is not None:
+        env = dict(os.environ, **env)
+    if subprocess.call(cmd, env=env) != 0:
+        raise RuntimeError('failed: ' + ' '.join(cmd))
+
+# =============================================================================
+def ReadOutputs(name):
+
+    ds = gdal.Open(os.path.join(tmpdir, name + '.tif'))
+    band = ds.GetRasterBand(1)
+    ids = band.ReadRaster(0, 0, ds.RasterXSize, ds.RasterYSize)
+    ds = None
+    f = open(os.path.join(tmpdir, name + '.csv'))
+    csv = f.read()
+    f.close()
+    return ids, csv
+
+# =============================================================================
+def ReadValues(filename):
+
+    ds = gdal.Open(filename)
+    band = ds.GetRasterBand(1)
+    values = array.array('I')
+    data = band.ReadRaster(0, 0, ds.RasterXSize, ds.RasterYSize,
+                           buf_type=gdal.GDT_UInt32)
+    if hasattr(values, 'frombytes'):
+        values.frombytes(data)
+    else:
+        values.fromstring(data)
+    ds = None
+    return values
+
+# =============================================================================
+#   IDs are numbered from 0 by the first occurrence of the combinations in
+#   row-major order, whatever the window layout: -buffer_mem 1 makes the
+#   windows shorter than a block row of the tiled inputs, the striped
+#   copies have other blocks, and -threads and -queue change how many
+#   windows are in flight.
+# =============================================================================
+def TestIdsFollowRowMajorOrder():
+
+    a = ReadValues(os.path.join(tmpdir, 'a.tif'))
+    b = ReadValues(os.path.join(tmpdir, 'b.tif'))
+    first = {}
+    expected = array.array('I', [first.setdefault(key, len(first)) for key in zip(a, b)])
+
+    for inputs in (('a.tif', 'b.tif'), ('a_strip.tif', 'b_strip.tif')):
+        for opts in ([], ['-buffer_mem', '1'], ['-buffer_mem', '1', '-queue', '1'],
+                     ['-buffer_mem', '1', '-threads', '3'], ['-threads', '4']):
+            name = 'q' + '_'.join((inputs[0][:-4],) + tuple(opts))
+            RunCombine(opts + ['-o', os.path.join(tmpdir, name + '.tif'),
+                               '-csv', os.path.join(tmpdir, name + '.csv')] +
+                       [os.path.join(tmpdir, f) for f in inputs])
+            if ReadValues(os.path.join(tmpdir, name + '.tif')) != expected:
+                return 'IDs of %s with %s are not in row-major order' % \
+                       (' '.join(inputs), ' '.join(opts))
+            # the column names are the input names
+            csv = ReadOutputs(name)[1].split('\n', 1)[1]
+            if opts == [] and inputs[0] == 'a.tif':
+                ref = csv
+            elif csv != ref:
+                return 'table of %s with %s differs' % (' '.join(inputs), ' '.join(opts))
+    return None
+
+# =============================================================================
+#   Spilled runs: the table holds about 2 million combinations of about
+#   28 bytes, so -max_mem 8 should take about 7 runs, not one per window
+#   once the table has spilled. The IDs must be the same as without
+#   spilling.
+# =============================================================================
+def CombineNoise(name, opts, env=None):
+
+    RunCombine(['-buffer_mem', '1'] + opts +
+               ['-o', os.path.join(tmpdir, name + '.tif'),
+                '-csv', os.path.join(tmpdir, name + '.csv'),
+                '-stats_json', os.path.join(tmpdir, name + '.json'),
+                os.path.join(tmpdir, 'c.tif'), os.path.join(tmpdir, 'd.tif')], env)
+    f = open(os.path.join(tmpdir, name + '.json'))
+    stats = json.load(f)
+    f.close()
+    return ReadOutputs(name), stats['spill_runs']
+
+def TestSpillRuns():
+
+    ref, runs = CombineNoise('nospill', [])
+    out, runs = CombineNoise('spill', ['-max_mem', '8'])
+    if runs < 2 or runs > 14:
+        return '%d runs spilled with -max_mem 8, expected about 7' % runs
+    if out != ref:
+        return 'output with -max_mem 8 differs from the one without'
+    return None
+
+# =============================================================================
+#   More runs than can be open at once are merged in several passes.
+# =============================================================================
+def TestSpillMultiPassMerge():
+
+    ref, runs = CombineNoise('nospill', [])
+    for maxopen in ('2', '5'):
+        out, runs = CombineNoise('spill', ['-max_mem', '1'],
+                                 {'GDAL_COMBINE_MAX_OPEN_RUNS': maxopen})
+        if runs <= int(maxopen):
+            return 'only %d runs spilled with -max_mem 1' % runs
+        if out != ref:
+            return 'output merging %s runs at a time differs' % maxopen
+    return None
+
+# =============================================================================
+# 	Mainline
+# =============================================================================
+
+tests = [ TestIdsFollowRowMajorOrder, TestSpillRuns,
+          TestSpillMultiPassMerge ]
+
+if len(sys.argv) > 1:
+    combine = sys.argv[1]
+
+tmpdir = tempfile.mkdtemp(prefix='gdal_combine_test')
+failures = 0
+try:
+    CreateRaster(os.path.join(tmpdir, 'a.tif'), 2000, 1000, 40, gdal.GDT_Byte,
+                 ['TILED=YES', 'BLOCKXSIZE=64', 'BLOCKYSIZE=64'], 1)
+    CreateRaster(os.path.join(tmpdir, 'b.tif'), 2000, 1000, 40, gdal.GDT_UInt16,
+                 ['TILED=YES', 'BLOCKXSIZE=64', 'BLOCKYSIZE=64'], 2)
+    CreateRaster(os.path.join(tmpdir, 'a_strip.tif'), 2000, 1000, 40, gdal.GDT_Byte,
+                 [], 1)
+    CreateRaster(os.path.join(tmpdir, 'b_strip.tif'), 2000, 1000, 40, gdal.GDT_UInt16,
+                 [], 2)
+    CreateRaster(os.path.join(tmpdir, 'c.tif'), 2000, 1000, 65536, gdal.GDT_UInt16,
+                 ['TILED=YES', 'BLOCKXSIZE=64', 'BLOCKYSIZE=64'], 3)
+    CreateRaster(os.path.join(tmpdir, 'd.tif'), 2000, 1000, 65536, gdal.GDT_UInt16,
+                 ['TILED=YES', 'BLOCKXSIZE=64', 'BLOCKYSIZE=64'], 4)
+
+    for test in tests:
+        msg = test()
+        if msg is None:
+            print('%s: ok' % test.__name__)
+        else:
+            print('%s: FAILED, %s' % (test.__name__, msg))
+            failures += 1
+finally:
+    shutil.rmtree(tmpdir)
+
+sys.exit(1 if failures else 0)
@@ -0,0 +1,163 @@
+#!/usr/bin/env python
+#******************************************************************************
+#  polygonize_bench.py - timing benchmark for GDALPolygonize
+#
+#  Builds two test rasters with GDAL and times gdal.Polygonize on them,
+#  4- and 8-connected, into an in-memory layer:
+#
+#   frac.tif   thresholded multi-octave value noise, one huge polygon with
+#              a fractal boundary and thousands of holes (3000 x 3000)
+#   sines.tif  quantized sum of sines with a little noise, a thematic map
+#              of about 160k polygons (2000 x 1500)
+#
+#  Run it against each build of GDAL to compare, e.g. with LD_LIBRARY_PATH
+#  pointing at one and then the other. The rasters only depend on -seed,
+#  and are kept with -keep dir to polygonize them again elsewhere.
+#
+#  usage: python polygonize_bench.py [-scale f] [-seed n] [-keep dir]
+#******************************************************************************
+
+try:
+    from osgeo import gdal, ogr
+except ImportError:
+    import gdal, ogr
+
+import array
+import math
+import os
+import random
+import shutil
+import sys
+import tempfile
+import time
+
+# =============================================================================
+def WriteLines(filename, xsize, ysize, lines):
+
+    drv = gdal.GetDriverByName('GTiff')
+    ds = drv.Create(filename, xsize, ysize, 1, gdal.GDT_Byte,
+                    ['TILED=YES', 'COMPRESS=LZW'])
+    band = ds.GetRasterBand(1)
+    y = 0
+    for line in lines:
+        line = array.array('B', line)
+        band.WriteRaster(0, y, xsize, 1, line.tostring() if hasattr(line, 'tostring')
+                         else line.tobytes(), xsize, 1, gdal.GDT_Byte)
+        y += 1
+    ds = None
+
+# =============================================================================
+#   Value noise: random values on grids of spacing 2, 4 ... 256 pixels,
+#   interpolated bilinearly and summed with weight spacing^0.6, then
+#   thresholded at half the total weight.
+# =============================================================================
+def FractalLines(xsize, ysize, seed):
+
+    rnd = random.Random(seed)
+    octaves = []
+    total = 0.0
+    s = 2
+    while s <= 256:
+        gw = xsize // s + 2
+        gh = ysize // s + 2
+        grid = [[rnd.random() for i in range(gw)] for j in range(gh)]
+        ix = [x // s for x in range(xsize)]
+        fx = [(x % s) / float(s) for x in range(xsize)]
+        octaves.append([s, s ** 0.6, grid, ix, fx, {}])
+        total += s ** 0.6
+        s *= 2
+
+    for y in range(ysize):
+        value = [0.0] * xsize
+        for octave in octaves:
+            s, weight, grid, ix, fx, rows = octave
+            iy = y // s
+            fy = (y % s) / float(s)
+            # the grid rows interpolated along x, two at a time
+            for j in (iy, iy + 1):
+                if j not in rows:
+                    g = grid[j]
+                    rows[j] = [(g[i] * (1 - f) + g[i + 1] * f) * weight
+                               for i, f in zip(ix, fx)]
+            for j in list(rows.keys()):
+                if j < iy:
+                    del rows[j]
+            a = rows[iy]
+            b = rows[iy + 1]
+            value = [v + p * (1 - fy) + q * fy for v, p, q in zip(value, a, b)]
+        yield [1 if v > total * 0.5 else 0 for v in value]
+
+# =============================================================================
+def SinesLines(xsize, ysize, seed):
+
+    rnd = random.Random(seed)
+    sx = [math.sin(x / 37.0) for x in range(xsize)]
+    for y in range(ysize):
+        cy = math.cos(y / 23.0)
+        yield [int((sx[x] + cy + math.sin((x + y) / 51.0) + rnd.random() * 0.3 + 3) * 2)
+               for x in range(xsize)]
+
+# =============================================================================
+def TimePolygonize(filename, connectedness):
+
+    ds = gdal.Open(filename)
+    band = ds.GetRasterBand(1)
+    dst_ds = ogr.GetDriverByName('Memory').CreateDataSource('out')
+    dst_layer = dst_ds.CreateLayer('out', srs=None)
+    dst_layer.CreateField(ogr.FieldDefn('DN', ogr.OFTInteger))
+
+    options = []
+    if connectedness == 8:
+        options.append('8CONNECTED=8')
+    start = time.time()
+    gdal.Polygonize(band, None, dst_layer, 0, options)
+    elapsed = time.time() - start
+
+    count = dst_layer.GetFeatureCount()
+    dst_ds = None
+    ds = None
+    return elapsed, count
+
+# =============================================================================
+# 	Mainline
+# =============================================================================
+
+scale = 1.0
+seed = 7
+keep = None
+
+i = 1
+while i < len(sys.argv):
+    if sys.argv[i] == '-scale' and i < len(sys.argv) - 1:
+        i += 1
+        scale = float(sys.argv[i])
+    elif sys.argv[i] == '-seed' and i < len(sys.argv) - 1:
+        i += 1
+        seed = int(sys.argv[i])
+    elif sys.argv[i] == '-keep' and i < len(sys.argv) - 1:
+        i += 1
+        keep = sys.argv[i]
+    else:
+        print('usage: python polygonize_bench.py [-scale f] [-seed n] [-keep dir]')
+        sys.exit(1)
+    i += 1
+
+rasters = [('frac.tif', int(3000 * scale), int(3000 * scale), FractalLines),
+           ('sines.tif', int(2000 * scale), int(1500 * scale), SinesLines)]
+
+tmpdir = keep if keep is not None else tempfile.mkdtemp(prefix='polygonize_bench')
+if not os.path.isdir(tmpdir):
+    os.makedirs(tmpdir)
+try:
+    print('GDAL %s' % gdal.VersionInfo('RELEASE_NAME'))
+    for name, xsize, ysize, generator in rasters:
+        filename = os.path.join(tmpdir, name)
+        if not os.path.exists(filename):
+            WriteLines(filename, xsize, ysize, generator(xsize, ysize, seed))
+        for connectedness in (4, 8):
+            elapsed, count = TimePolygonize(filename, connectedness)
+            print('%s %dx%d %d-connected: %d polygons in %.2fs'
+                  % (name, xsize, ysize, connectedness, count, elapsed))
+finally:
+    if keep is None:
+        shutil.rmtree(tmpdir)